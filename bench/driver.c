@@ -0,0 +1,251 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "prolog.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Times the interpreter on a fact base written by generate.  Each run
+ * loads the file into fresh tables and then measures, in order:
+ *
+ *   load    reading, interning and storing every fact
+ *   intern  interning each atom name a0, a1, ... into empty tables
+ *   lookup  resolving each atom name back to its symbol in the loaded ones
+ *   point   num_probes lookups r(K,...) with K bound to a random atom
+ *   scan    enumerating every r(...) fact
+ *   join2   r(X1,...,Y), s(Y,...)
+ *   join3   num_join_probes joins r(K,...,Y), s(Y,...,Z), t(Z,...)
+ *
+ * One line is printed per phase and run, as CSV with a header: the phase,
+ * the run, the seconds it took and the rows it produced (facts loaded,
+ * atoms interned, atoms some fact mentions or solutions). */
+
+typedef struct bench_t {
+  const char *filename;
+  int arity;
+  int num_atoms;
+  int num_runs;
+  int num_probes;
+  int num_join_probes;
+  unsigned long seed;
+} bench_t;
+
+double bench_now(void);
+void bench_report(const char *, int, double, long);
+void bench_goal(char *, const char *, const char *, const char *, int);
+long bench_count(prolog_query_t *);
+long bench_probes(bench_t *, prolog_query_t *, symbol_table_node_t **, int);
+int bench_run(bench_t *, int);
+void usage(const char *);
+
+double bench_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+void bench_report(const char *phase, int run, double seconds, long rows) {
+  printf("%s,%d,%.6f,%ld\n", phase, run, seconds, rows);
+}
+
+/* Appends the goal name(first,N1,...,last) to text, separated from any
+ * goals before it by a comma.  The variables in the middle are named after
+ * the predicate, so the goals of a join only share first and last. */
+void bench_goal(char *text,
+		const char *name,
+		const char *first,
+		const char *last,
+		int arity) {
+  char *end = text + strlen(text);
+  int i;
+
+  end += sprintf(end, "%s%s(%s", *text != '\0' ? ", " : "", name, first);
+  for (i=1; i<arity; ++i) {
+    if (i == arity - 1 && last != NULL) {
+      end += sprintf(end, ",%s", last);
+    } else {
+      end += sprintf(end, ",%c%d", toupper((unsigned char)*name), i);
+    }
+  }
+  sprintf(end, ")");
+}
+
+long bench_count(prolog_query_t *query) {
+  long rows = 0;
+
+  prolog_query_execute(query);
+  while (prolog_query_next(query)) {
+    rows++;
+  }
+  prolog_query_close(query);
+
+  return rows;
+}
+
+/* Runs query num_probes times with its variable K bound to a random
+ * atom. */
+long bench_probes(bench_t *bench,
+		  prolog_query_t *query,
+		  symbol_table_node_t **atoms,
+		  int num_probes) {
+  int slot = prolog_query_variable(query, "K"),
+      i;
+  long rows = 0;
+
+  for (i=0; i<num_probes; ++i) {
+    prolog_query_bind(query, slot, atoms[rand() % bench->num_atoms]);
+    rows += bench_count(query);
+  }
+
+  return rows;
+}
+
+int bench_run(bench_t *bench, int run) {
+  prolog_t prolog,
+           fresh;
+  prolog_query_t query;
+  symbol_table_node_t **atoms = malloc(sizeof(*atoms) * bench->num_atoms);
+  char *text = malloc(64 * (bench->arity + 1) * 3),
+       name[32];
+  double start;
+  long rows;
+  int i;
+
+  initialize_prolog(&prolog);
+  srand((unsigned)bench->seed);
+
+  start = bench_now();
+  if (!prolog_consult(&prolog, bench->filename)) {
+    destroy_prolog(&prolog);
+    free(atoms);
+    free(text);
+    return 0;
+  }
+  rows = 0;
+  for (i=0; i<prolog.predicate_table.num_predicates; ++i) {
+    rows += prolog.predicate_table.predicates[i]->num_link;
+  }
+  bench_report("load", run, bench_now() - start, rows);
+
+  initialize_prolog(&fresh);
+  start = bench_now();
+  for (i=0; i<bench->num_atoms; ++i) {
+    sprintf(name, "a%d", i);
+    prolog_atom(&fresh, name);
+  }
+  bench_report("intern",
+	       run,
+	       bench_now() - start,
+	       fresh.symbol_table.num_symbols);
+  destroy_prolog(&fresh);
+
+  start = bench_now();
+  rows = 0;
+  for (i=0; i<bench->num_atoms; ++i) {
+    sprintf(name, "a%d", i);
+    atoms[i] = prolog_atom(&prolog, name);
+    rows += atoms[i]->num_link > 0;
+  }
+  bench_report("lookup", run, bench_now() - start, rows);
+
+  *text = '\0';
+  bench_goal(text, "r", "K", NULL, bench->arity);
+  prolog_prepare(&prolog, &query, text);
+  start = bench_now();
+  rows = bench_probes(bench, &query, atoms, bench->num_probes);
+  bench_report("point", run, bench_now() - start, rows);
+  destroy_prolog_query(&query);
+
+  *text = '\0';
+  bench_goal(text, "r", "X", NULL, bench->arity);
+  prolog_prepare(&prolog, &query, text);
+  start = bench_now();
+  rows = bench_count(&query);
+  bench_report("scan", run, bench_now() - start, rows);
+  destroy_prolog_query(&query);
+
+  *text = '\0';
+  bench_goal(text, "r", "X", "Y", bench->arity);
+  bench_goal(text, "s", "Y", NULL, bench->arity);
+  prolog_prepare(&prolog, &query, text);
+  start = bench_now();
+  rows = bench_count(&query);
+  bench_report("join2", run, bench_now() - start, rows);
+  destroy_prolog_query(&query);
+
+  *text = '\0';
+  bench_goal(text, "r", "K", "Y", bench->arity);
+  bench_goal(text, "s", "Y", "Z", bench->arity);
+  bench_goal(text, "t", "Z", NULL, bench->arity);
+  prolog_prepare(&prolog, &query, text);
+  start = bench_now();
+  rows = bench_probes(bench, &query, atoms, bench->num_join_probes);
+  bench_report("join3", run, bench_now() - start, rows);
+  destroy_prolog_query(&query);
+
+  destroy_prolog(&prolog);
+  free(atoms);
+  free(text);
+
+  return 1;
+}
+
+void usage(const char *name) {
+  fprintf(stderr,
+	  "usage: %s [-a arity] [-c atoms] [-r runs] [-q probes] "
+	  "[-j join probes] [-s seed] FILE\n",
+	  name);
+}
+
+int main(int argc, char **argv) {
+  bench_t bench;
+  int i;
+
+  bench.filename = NULL;
+  bench.arity = 2;
+  bench.num_atoms = 10000;
+  bench.num_runs = 5;
+  bench.num_probes = 10000;
+  bench.num_join_probes = 100;
+  bench.seed = 1;
+
+  for (i=1; i<argc; ++i) {
+    if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+      bench.arity = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+      bench.num_atoms = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      bench.num_runs = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+      bench.num_probes = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      bench.num_join_probes = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      bench.seed = strtoul(argv[++i], NULL, 10);
+    } else if (argv[i][0] != '-' && bench.filename == NULL) {
+      bench.filename = argv[i];
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  /* The joins link the last argument of one goal to the first of the
+   * next, so they need two. */
+  if (bench.filename == NULL || bench.arity < 2 || bench.num_atoms < 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  printf("phase,run,seconds,rows\n");
+  for (i=1; i<=bench.num_runs; ++i) {
+    if (!bench_run(&bench, i)) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
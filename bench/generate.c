@@ -0,0 +1,139 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Writes a synthetic fact base for the benchmark driver: num_facts facts
+ * of the given arity for each of the predicates r, s and t.  Arguments are
+ * drawn from num_atoms atoms a0, a1, ... with Zipf-distributed frequencies;
+ * a skew of 0 draws them uniformly and larger skews favour the first
+ * atoms more and more.  The output only depends on the options, so a seed
+ * reproduces a fact base exactly. */
+
+typedef struct generator_t {
+  unsigned long state;
+  int num_atoms;
+  double *cdf;
+} generator_t;
+
+void initialize_generator(generator_t *, unsigned long, int, double);
+void destroy_generator(generator_t *);
+double generator_uniform(generator_t *);
+int generator_atom(generator_t *);
+void usage(const char *);
+
+void initialize_generator(generator_t *generator,
+			  unsigned long seed,
+			  int num_atoms,
+			  double skew) {
+  double total = 0.0;
+  int i;
+
+  generator->state = (seed & 0xffffffffUL) != 0 ? seed & 0xffffffffUL : 1;
+  generator->num_atoms = num_atoms;
+  generator->cdf = malloc(sizeof(double) * num_atoms);
+
+  for (i=0; i<num_atoms; ++i) {
+    total += 1.0 / pow(i + 1, skew);
+    generator->cdf[i] = total;
+  }
+
+  for (i=0; i<num_atoms; ++i) {
+    generator->cdf[i] /= total;
+  }
+}
+
+void destroy_generator(generator_t *generator) {
+  free(generator->cdf);
+  generator->cdf = NULL;
+}
+
+/* xorshift32, kept to 32 bits so that it is the same everywhere. */
+double generator_uniform(generator_t *generator) {
+  unsigned long x = generator->state;
+
+  x ^= (x << 13) & 0xffffffffUL;
+  x ^= x >> 17;
+  x ^= (x << 5) & 0xffffffffUL;
+  generator->state = x;
+
+  return (double)x / 4294967296.0;
+}
+
+/* Draws an atom by binary search on the cumulative distribution. */
+int generator_atom(generator_t *generator) {
+  double u = generator_uniform(generator);
+  int low = 0,
+      high = generator->num_atoms - 1,
+      middle;
+
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    if (generator->cdf[middle] <= u) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  return low;
+}
+
+void usage(const char *name) {
+  fprintf(stderr,
+	  "usage: %s [-n facts] [-a arity] [-c atoms] [-z skew] [-s seed]\n",
+	  name);
+}
+
+int main(int argc, char **argv) {
+  static const char *predicates[] = { "r", "s", "t" };
+  generator_t generator;
+  unsigned long seed = 1;
+  double skew = 0.0;
+  long num_facts = 100000,
+       i;
+  int arity = 2,
+      num_atoms = 10000,
+      p,
+      j;
+
+  for (j=1; j<argc; ++j) {
+    if (strcmp(argv[j], "-n") == 0 && j + 1 < argc) {
+      num_facts = atol(argv[++j]);
+    } else if (strcmp(argv[j], "-a") == 0 && j + 1 < argc) {
+      arity = atoi(argv[++j]);
+    } else if (strcmp(argv[j], "-c") == 0 && j + 1 < argc) {
+      num_atoms = atoi(argv[++j]);
+    } else if (strcmp(argv[j], "-z") == 0 && j + 1 < argc) {
+      skew = atof(argv[++j]);
+    } else if (strcmp(argv[j], "-s") == 0 && j + 1 < argc) {
+      seed = strtoul(argv[++j], NULL, 10);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (num_facts < 0 || arity < 1 || num_atoms < 1 || skew < 0.0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  initialize_generator(&generator, seed, num_atoms, skew);
+
+  for (p=0; p<3; ++p) {
+    for (i=0; i<num_facts; ++i) {
+      printf("%s(", predicates[p]);
+      for (j=0; j<arity; ++j) {
+	printf(j == 0 ? "a%d" : ",a%d", generator_atom(&generator));
+      }
+      printf(").\n");
+    }
+  }
+
+  destroy_generator(&generator);
+
+  return 0;
+}
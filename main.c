@@ -0,0 +1,199 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "prolog.h"
+#include <unistd.h>
+
+/*****************************************
+ * Main function
+ *****************************************/
+int main(int argc, char **argv) {
+  mpc_result_t r;
+  symbol_table_t symbol_table;
+  predicate_table_t predicate_table;
+  loader_t loader;
+  snapshot_t snapshot;
+  grammar_t grammar;
+  session_t session;
+  int return_value = 1,
+      use_mpc = 0,
+      use_session = 0,
+      num_filenames = 0,
+      num_specs = 0,
+      num_threads = 1,
+      first = 0,
+      i;
+  const char **filenames = malloc(sizeof(const char *) * argc),
+             **specs = malloc(sizeof(const char *) * argc),
+             *filename = NULL,
+             *save_filename = NULL;
+
+  for (i=1; i<argc; ++i) {
+    if (strcmp(argv[i], "-d") == 0) {
+      debug_output = 1;
+    } else if (strcmp(argv[i], "--mpc") == 0) {
+      use_mpc = 1;
+    } else if (strcmp(argv[i], "--session") == 0) {
+      use_session = 1;
+    } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+      specs[num_specs++] = argv[++i];
+    } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+      save_filename = argv[++i];
+    } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+      num_threads = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      num_or_workers = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "--first") == 0) {
+      first_solution_only = 1;
+    } else if (strcmp(argv[i], "--table") == 0) {
+      tabling = 1;
+    } else if (strcmp(argv[i], "--materialize") == 0) {
+      /* Implies --set: see rule_add_symbols. */
+      materialize = 1;
+    } else if (strcmp(argv[i], "--set") == 0) {
+      set_semantics = 1;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+      statistics_output = STATS_TEXT;
+    } else if (strcmp(argv[i], "--stats=json") == 0) {
+      statistics_output = STATS_JSON;
+    } else if (strcmp(argv[i], "--memstats") == 0) {
+      memory_output = 1;
+    } else {
+      filename = filenames[num_filenames++] = argv[i];
+    }
+  }
+
+  /* After the options, so that --memstats sees the tables' first
+   * allocations. */
+  initialize_symbol_table(&symbol_table);
+  initialize_predicate_table(&predicate_table);
+  initialize_snapshot(&snapshot);
+
+  initialize_grammar(&grammar);
+  if (debug_output) {
+    print_grammar(&grammar);
+  }
+
+  /* A snapshot can only be loaded into empty tables, so it has to come
+   * first, and extra indexes are added once it is in. */
+  statistics_begin(STATS_BUILD);
+  if (!use_mpc && num_filenames > 0 && snapshot_is_image(filenames[0])) {
+    return_value = snapshot_load(&snapshot,
+				 filenames[0],
+				 &symbol_table,
+				 &predicate_table);
+    first = 1;
+  }
+
+  for (i=0; i<num_specs && return_value; ++i) {
+    if (!predicate_table_add_index_spec(&predicate_table, specs[i])) {
+      fprintf(stderr, "invalid index '%s', expected name/arity:pos,...\n",
+	      specs[i]);
+      return_value = 0;
+    }
+  }
+  statistics_end(STATS_BUILD);
+
+  if (return_value && use_mpc) {
+    statistics_begin(STATS_PARSE);
+    return_value = parse_file(&grammar, &r, filename);
+    statistics_end(STATS_PARSE);
+    if (return_value) {
+      if (debug_output) {
+	print_tags(r.output, 0);
+      }
+      statistics_begin(STATS_AST);
+      define_facts(r.output, &symbol_table, &predicate_table);
+      define_rules(r.output, &symbol_table, &predicate_table);
+      statistics_end(STATS_AST);
+
+      if (debug_output) {
+	print_rules(&symbol_table, &predicate_table);
+      }
+      statistics_begin(STATS_QUERY);
+      execute_queries(r.output, &symbol_table, &predicate_table);
+      statistics_end(STATS_QUERY);
+      mpc_ast_delete(r.output);
+    }
+  } else if (return_value && use_session) {
+    initialize_loader(&loader, &symbol_table, &predicate_table);
+    loader.num_threads = num_threads;
+    initialize_session(&session,
+		       &symbol_table,
+		       &predicate_table,
+		       &loader,
+		       &grammar,
+		       &snapshot);
+    session.interactive = isatty(fileno(stdin));
+
+    statistics_begin(STATS_PARSE);
+    for (i=first; i<num_filenames; ++i) {
+      session_consult(&session, filenames[i]);
+    }
+    statistics_end(STATS_PARSE);
+
+    statistics_begin(STATS_QUERY);
+    session_run(&session, stdin);
+    statistics_end(STATS_QUERY);
+
+    destroy_session(&session);
+    destroy_loader(&loader);
+  } else if (return_value) {
+    initialize_loader(&loader, &symbol_table, &predicate_table);
+    loader.num_threads = num_threads;
+    statistics_begin(STATS_PARSE);
+    if (num_filenames == 0) {
+      return_value = load_file(&loader, NULL);
+    }
+
+    for (i=first; i<num_filenames && return_value; ++i) {
+      return_value = load_file(&loader, filenames[i]);
+      if (!return_value && parse_file(&grammar, &r, filenames[i])) {
+	mpc_ast_delete(r.output);
+      }
+    }
+    statistics_end(STATS_PARSE);
+
+    statistics_begin(STATS_BUILD);
+    if (return_value && materialize) {
+      predicate_table_materialize(&predicate_table, &symbol_table);
+    }
+
+    if (return_value && save_filename != NULL) {
+      return_value = snapshot_save(save_filename,
+				   &symbol_table,
+				   &predicate_table);
+    }
+    statistics_end(STATS_BUILD);
+
+    if (return_value) {
+      if (debug_output) {
+	print_rules(&symbol_table, &predicate_table);
+      }
+      statistics_begin(STATS_QUERY);
+      loader_execute_queries(&loader);
+      statistics_end(STATS_QUERY);
+    }
+    destroy_loader(&loader);
+  }
+
+  if (tabling) {
+    print_answer_statistics(&predicate_table);
+  }
+
+  if (statistics_output != STATS_NONE) {
+    print_statistics(stderr);
+  }
+
+  if (memory_output) {
+    print_memory(stderr, &symbol_table, &predicate_table);
+  }
+
+  destroy_grammar(&grammar);
+  destroy_symbol_table(&symbol_table);
+  destroy_predicate_table(&predicate_table);
+  destroy_snapshot(&snapshot);
+  free(filenames);
+  free(specs);
+
+  return !return_value;
+}
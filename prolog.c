@@ -1,27 +1,101 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include "prolog.h"
 #include "mpc/mpc.h"
 #include <assert.h>
-
+#include <ctype.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifdef PROLOG_STATS
+#define STATS_COUNT(counter) \
+  (statistics_output != STATS_NONE \
+   ? (void)__atomic_fetch_add(&statistics.counters[counter], \
+			      1UL, \
+			      __ATOMIC_RELAXED) \
+   : (void)0)
+#else
+#define STATS_COUNT(counter) ((void)0)
+#endif
+#ifdef PROLOG_STATS
+#define NEW(type, num) \
+  ((type*)memory_alloc(MEMORY_CATEGORY, sizeof(type) * (num)))
+#define RENEW(orig, type, num) \
+  (STATS_COUNT(STATS_RENEWS), \
+   (type*)memory_realloc(MEMORY_CATEGORY, (orig), sizeof(type) * (num)))
+#define FREE(ptr) memory_free(ptr)
+#else
 #define NEW(type, num) ((type*)malloc(sizeof(type) * (num)))
 #define RENEW(orig, type, num) ((type*)realloc((orig), sizeof(type) * (num)))
-#define MAX_PARAMS 10
+#define FREE(ptr) free(ptr)
+#endif
+#define ARENA_NEW(arena, type, num) \
+  ((type*)arena_alloc((arena), MEMORY_CATEGORY, sizeof(type) * (num)))
+#define ARENA_RENEW(arena, orig, type, old, num) \
+  ((type*)arena_realloc((arena), MEMORY_CATEGORY, (orig), \
+			sizeof(type) * (old), sizeof(type) * (num)))
+#define MEMORY_CATEGORY MEMORY_OTHER
+#define MEMORY_HEADER_SIZE 16
 #define ENLARGE_FACTOR 2
+#define INITIAL_BUCKETS 16
+#define BOUND_VARIABLE_SELECTIVITY 10.0
+#define SCAN_RATIO 8
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define BITMAP_ARRAY_MAX 4096
+#define BITMAP_WORDS 2048
+#define LOADER_CHUNK_SIZE (1 << 16)
+#define SESSION_LINE_SIZE 1024
+#define SOLVE_STOP_INTERVAL 1024
+#define SNAPSHOT_MAGIC "PLSNAPSH"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_BYTE_ORDER 0x01020304U
+#define SNAPSHOT_ALIGN(size) (((size) + 7) & ~(size_t)7)
+#define MACHINE_SLOT(machine, y) \
+  ((machine)->slots[(machine)->frames[(machine)->env].slots + (y)])
+#define INDEX_KEY(args, columns, ordinal, pos) \
+  ((args) != NULL ? (atom_t)(args)[pos]->id : (columns)[pos][ordinal])
+#define ARENA_ALIGN(size) (((size) + sizeof(double) - 1) & ~(sizeof(double) - 1))
+
+typedef char memory_header_must_fit[
+  sizeof(memory_header_t) <= MEMORY_HEADER_SIZE ? 1 : -1];
+
+int debug_output = 0;
+int num_or_workers = 1;
+int first_solution_only = 0;
+int tabling = 0;
+int materialize = 0;
+int set_semantics = 0;
+statistics_t statistics;
+statistics_format_t statistics_output = STATS_NONE;
+memory_usage_t memory_usage;
+int memory_output = 0;
 
 /*****************************************
  * AST Functions
  *****************************************/
-int parse_file(mpc_result_t *r, const char *filename) {
-  mpc_parser_t	*Constant  = mpc_new("constant");
-  mpc_parser_t	*Variable  = mpc_new("variable");
-  mpc_parser_t	*Ident	   = mpc_new("ident");
-  mpc_parser_t	*Params	   = mpc_new("params");
-  mpc_parser_t	*Predicate = mpc_new("predicate");
-  mpc_parser_t  *Union     = mpc_new("union");
-  mpc_parser_t	*Fact	   = mpc_new("fact");
-  mpc_parser_t  *Query     = mpc_new("query");
-  mpc_parser_t	*Lang	   = mpc_new("lang");
-
-  int return_value;
+void initialize_grammar(grammar_t *grammar) {
+  grammar->constant  = mpc_new("constant");
+  grammar->variable  = mpc_new("variable");
+  grammar->ident     = mpc_new("ident");
+  grammar->params    = mpc_new("params");
+  grammar->predicate = mpc_new("predicate");
+  grammar->union_    = mpc_new("union");
+  grammar->fact      = mpc_new("fact");
+  grammar->rule      = mpc_new("rule");
+  grammar->query     = mpc_new("query");
+  grammar->limit     = mpc_new("limit");
+  grammar->lang      = mpc_new("lang");
 
   mpca_lang(MPCA_LANG_DEFAULT,
 	    " constant  : /[a-z0-9_]+/;                            "
@@ -31,40 +105,53 @@ int parse_file(mpc_result_t *r, const char *filename) {
 	    " predicate : <ident> '(' <params> ')';                "
 	    " union     : <predicate> (',' <predicate>)*;          "
 	    " fact      : <union> '.';                             "
-	    " query     : \"?-\" <union> '.';                      "
-	    " lang      : /^/ (<fact> | <query>)+ /$/;             ",
-	    Constant, Variable, Ident, Params, Predicate, Union, Fact, Query,
-	    Lang, NULL);
-
-  printf("Constant:  "); mpc_print(Constant);
-  printf("Variable:  "); mpc_print(Variable);
-  printf("Ident:     "); mpc_print(Ident);
-  printf("Params:    "); mpc_print(Params);
-  printf("Predicate: "); mpc_print(Predicate);
-  printf("Union:     "); mpc_print(Union);
-  printf("Fact:      "); mpc_print(Fact);
-  printf("Query:     "); mpc_print(Query);
-  printf("Lang:      "); mpc_print(Lang);
+	    " rule      : <predicate> \":-\" <union> '.';          "
+	    " limit     : \"limit\" /[0-9]+/;                        "
+	    " query     : \"?-\" <union> <limit>? '.';             "
+	    " lang      : /^/ (<rule> | <fact> | <query>)+ /$/;    ",
+	    grammar->constant, grammar->variable, grammar->ident,
+	    grammar->params, grammar->predicate, grammar->union_,
+	    grammar->fact, grammar->rule, grammar->query, grammar->limit,
+	    grammar->lang, NULL);
+}
+
+void destroy_grammar(grammar_t *grammar) {
+  mpc_cleanup(11,
+	      grammar->constant, grammar->variable, grammar->ident,
+	      grammar->params,   grammar->predicate, grammar->union_,
+	      grammar->fact,     grammar->rule,      grammar->query,
+	      grammar->limit,    grammar->lang
+	      );
+}
+
+void print_grammar(grammar_t *grammar) {
+  printf("Constant:  "); mpc_print(grammar->constant);
+  printf("Variable:  "); mpc_print(grammar->variable);
+  printf("Ident:     "); mpc_print(grammar->ident);
+  printf("Params:    "); mpc_print(grammar->params);
+  printf("Predicate: "); mpc_print(grammar->predicate);
+  printf("Union:     "); mpc_print(grammar->union_);
+  printf("Fact:      "); mpc_print(grammar->fact);
+  printf("Rule:      "); mpc_print(grammar->rule);
+  printf("Query:     "); mpc_print(grammar->query);
+  printf("Limit:     "); mpc_print(grammar->limit);
+  printf("Lang:      "); mpc_print(grammar->lang);
+}
+
+int parse_file(grammar_t *grammar, mpc_result_t *r, const char *filename) {
+  int return_value;
 
   if (filename != NULL) {
-    return_value = mpc_parse_contents(filename, Lang, r);
+    return_value = mpc_parse_contents(filename, grammar->lang, r);
   } else {
-    return_value = mpc_parse_pipe("<stdin>", stdin, Lang, r);
+    return_value = mpc_parse_pipe("<stdin>", stdin, grammar->lang, r);
   }
 
   if (!return_value) {
     mpc_err_print(r->error);
     mpc_err_delete(r->error);
-
-    goto cleanup;
   }
 
- cleanup:
-  mpc_cleanup(9,
-	      Constant, Variable, Ident, Params, Predicate,
-	      Union,    Fact,     Query, Lang
-	      );
-
   return return_value;
 }
 
@@ -136,310 +223,5769 @@ const mpc_ast_t *find_tag_next(find_tag_state_t *state, const char *tag) {
 }
 
 /*****************************************
- * Symbol Table Functions
+ * Loader Functions
  *****************************************/
-
-/* ==== Symbol Table ==== */
-void initialize_symbol_table(symbol_table_t *table) {
-  table->num_symbols = 0;
-  table->num_allocated = 1;
-  table->symbols = NEW(symbol_table_node_t *, table->num_allocated);
+void initialize_loader(loader_t *loader,
+		       symbol_table_t *symbol_table,
+		       predicate_table_t *predicate_table) {
+  loader->filename = "<stdin>";
+  loader->cursor = loader->end = NULL;
+  loader->line = 1;
+  loader->symbol_table = symbol_table;
+  loader->predicate_table = predicate_table;
+
+  loader->num_idents = 0;
+  loader->idents_allocated = 1;
+  loader->idents = NEW(loader_ident_t, loader->idents_allocated);
+  loader->symbols = NEW(symbol_table_node_t *, loader->idents_allocated);
+
+  loader->num_queries = 0;
+  loader->queries_allocated = 1;
+  loader->queries = NEW(char *, loader->queries_allocated);
+
+  loader->num_threads = 1;
+  loader->deferred = 0;
+  loader->num_clause_data = loader->clause_data_allocated = 0;
+  loader->clause_data = NULL;
+  loader->num_rules = loader->rules_allocated = 0;
+  loader->rules = NULL;
+  loader->rule_offsets = NULL;
 }
 
-void symbol_table_add(symbol_table_t *table, symbol_table_node_t *node) {
-  if (table->num_symbols >= table->num_allocated) {
-    symbol_table_enlarge(table);
+void destroy_loader(loader_t *loader) {
+  int i;
+
+  for (i=0; i<loader->num_queries; ++i) {
+    FREE(loader->queries[i]);
   }
 
-  table->symbols[table->num_symbols++] = node;
-}
+  for (i=0; i<loader->num_rules; ++i) {
+    FREE(loader->rules[i]);
+  }
 
-void symbol_table_enlarge(symbol_table_t *table) {
-  table->num_allocated *= ENLARGE_FACTOR;
-  table->symbols = RENEW(table->symbols,
-			 symbol_table_node_t *,
-			 table->num_allocated);
+  FREE(loader->queries);
+  FREE(loader->rules);
+  FREE(loader->rule_offsets);
+  FREE(loader->idents);
+  FREE(loader->symbols);
+  FREE(loader->clause_data);
+  loader->queries = NULL;
+  loader->idents = NULL;
+  loader->symbols = NULL;
+  loader->clause_data = NULL;
+  loader->rules = NULL;
+  loader->rule_offsets = NULL;
+  loader->num_clause_data = loader->clause_data_allocated = 0;
+  loader->num_rules = loader->rules_allocated = 0;
+  loader->num_queries = loader->queries_allocated = 0;
+  loader->num_idents = loader->idents_allocated = 0;
 }
 
-void destroy_symbol_table(symbol_table_t *table) {
-  int i;
-
-  for (i=0; i<table->num_symbols; ++i) {
-    destroy_symbol_table_node(table->symbols[i]);
-    free(table->symbols[i]);
+/* Regular files are mapped and read in place; anything else (and stdin,
+ * when filename is NULL) goes through load_stream. */
+int load_file(loader_t *loader, const char *filename) {
+  struct stat st;
+  FILE *file;
+  void *data;
+  int fd,
+      return_value;
+
+  if (filename == NULL) {
+    return load_stream(loader, stdin);
   }
 
-  table->num_symbols = table->num_allocated = 0;
-  free(table->symbols);
-  table->symbols = NULL;
-}
-
-symbol_table_node_t *symbol_table_find(symbol_table_t *table,
-				       const char *name) {
-  int i;
-  symbol_table_node_t *node;
+  loader->filename = filename;
+  loader->line = 1;
 
-  for (i=0; i<table->num_symbols; ++i) {
-    node = table->symbols[i];
-    if (strcmp(name, node->name) == 0) {
-      return node;
+  fd = open(filename, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(filename);
+    if (fd >= 0) {
+      close(fd);
     }
+    return 0;
   }
 
-  return NULL;
-}
+  if (!S_ISREG(st.st_mode)) {
+    file = fdopen(fd, "r");
+    return_value = load_stream(loader, file);
+    fclose(file);
+    return return_value;
+  }
 
-symbol_table_node_t *symbol_table_find_or_add(symbol_table_t *table,
-					      const char *name) {
-  symbol_table_node_t *node = symbol_table_find(table, name);
+  if (st.st_size == 0) {
+    close(fd);
+    return 1;
+  }
 
-  if (node == NULL) {
-    node = NEW(symbol_table_node_t, 1);
-    initialize_symbol_table_node(node, name);
-    symbol_table_add(table, node);
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror(filename);
+    return 0;
   }
 
-  return node;
+  if (loader->num_threads > 1) {
+    return_value = load_parallel(loader, (const char *)data, st.st_size);
+  } else {
+    return_value = load_buffer(loader, (const char *)data, st.st_size);
+  }
+  munmap(data, st.st_size);
+
+  return return_value;
 }
 
-/* ==== Symbol Table Node ==== */
-void initialize_symbol_table_node(symbol_table_node_t *node, const char *name) {
-  node->num_link = 0;
-  node->num_allocated = 1;
-  node->links = NEW(symbol_table_to_predicate_t *, node->num_allocated);
-  node->name = name;
+/* Reads the stream in chunks and hands every complete clause to
+ * load_buffer.  A '.' only ever ends a clause, so whatever follows the
+ * last one in the buffer is carried over to the next read. */
+int load_stream(loader_t *loader, FILE *file) {
+  size_t num_buffer = 0,
+         buffer_allocated = LOADER_CHUNK_SIZE,
+         num_read,
+         complete;
+  char *buffer = NEW(char, buffer_allocated);
+  int return_value = 1;
+
+  do {
+    if (buffer_allocated - num_buffer < LOADER_CHUNK_SIZE) {
+      buffer_allocated *= ENLARGE_FACTOR;
+      buffer = RENEW(buffer, char, buffer_allocated);
+    }
+
+    num_read = fread(buffer + num_buffer,
+		     1,
+		     buffer_allocated - num_buffer,
+		     file);
+    num_buffer += num_read;
+
+    for (complete=num_buffer; complete>0; --complete) {
+      if (buffer[complete - 1] == '.') {
+	break;
+      }
+    }
+
+    if (num_read == 0) {
+      complete = num_buffer;
+    }
+
+    return_value = load_buffer(loader, buffer, complete);
+    memmove(buffer, buffer + complete, num_buffer - complete);
+    num_buffer -= complete;
+  } while (return_value && num_read > 0);
+
+  FREE(buffer);
+  return return_value;
 }
 
-void symbol_table_node_enlarge(symbol_table_node_t *node) {
-  node->num_allocated *= ENLARGE_FACTOR;
-  node->links = RENEW(node->links,
-		      symbol_table_to_predicate_t *,
-		      node->num_allocated);
+/* Loads every clause in the length bytes at text.  Returns 0 and reports
+ * the offending line on a syntax error. */
+int load_buffer(loader_t *loader, const char *text, size_t length) {
+  loader->cursor = text;
+  loader->end = text + length;
+
+  for (;;) {
+    loader_skip_space(loader);
+    if (loader->cursor == loader->end) {
+      return 1;
+    }
+
+    if (loader->end - loader->cursor >= 2 &&
+	loader->cursor[0] == '?' && loader->cursor[1] == '-') {
+      loader->cursor += 2;
+      if (!loader_query(loader)) {
+	return 0;
+      }
+    } else if (!loader_fact(loader)) {
+      return 0;
+    }
+  }
 }
 
-void destroy_symbol_table_node(symbol_table_node_t *node) {
-  int i;
+/* Splits text at clause boundaries into one chunk per thread.  Each chunk
+ * is lexed and interned on its own thread into private tables, and the
+ * chunks are then merged into the loader's tables in order, so symbol ids
+ * and clause order come out exactly as a serial load would leave them.
+ * Rules are compiled as the merge reaches them.  If any chunk has a
+ * syntax error the text is loaded serially instead, which reports it. */
+int load_parallel(loader_t *loader, const char *text, size_t length) {
+  loader_chunk_t *chunks,
+                 *chunk;
+  pthread_t *threads;
+  int *started,
+      num_chunks = loader->num_threads,
+      return_value = 1,
+      i;
+  size_t start = 0,
+         end;
 
-  for (i=0; i<node->num_link; ++i) {
-    destroy_symbol_table_to_predicate(node->links[i]);
-    free(node->links[i]);
+  if ((size_t)num_chunks > length / LOADER_CHUNK_SIZE) {
+    num_chunks = (int)(length / LOADER_CHUNK_SIZE);
   }
 
-  free(node->links);
-  node->num_link = node->num_allocated = 0;
-  node->name = NULL;
-}
+  if (num_chunks < 2) {
+    return load_buffer(loader, text, length);
+  }
 
-void symbol_table_node_add(symbol_table_node_t *node,
-			   int pos,
-			   predicate_table_node_t *predicate,
-			   predicate_table_to_symbol_t *ref) {
-  symbol_table_to_predicate_t *link = NEW(symbol_table_to_predicate_t, 1);
+  chunks = NEW(loader_chunk_t, num_chunks);
+  threads = NEW(pthread_t, num_chunks);
+  started = NEW(int, num_chunks);
 
-  initialize_symbol_table_to_predicate(link, pos, predicate, ref);
+  for (i=0; i<num_chunks; ++i) {
+    chunk = &chunks[i];
 
-  if (node->num_link >= node->num_allocated) {
-    symbol_table_node_enlarge(node);
+    end = i == num_chunks - 1 ? length : length / num_chunks * (i + 1);
+    if (end < start) {
+      end = start;
+    }
+    while (end < length && (end == 0 || text[end - 1] != '.')) {
+      end++;
+    }
+
+    chunk->text = text + start;
+    chunk->length = end - start;
+    start = end;
+
+    initialize_symbol_table(&chunk->symbol_table);
+    initialize_predicate_table(&chunk->predicate_table);
+    initialize_loader(&chunk->loader,
+		      &chunk->symbol_table,
+		      &chunk->predicate_table);
+    chunk->loader.filename = loader->filename;
+    chunk->loader.deferred = 1;
+
+    started[i] = pthread_create(&threads[i],
+				NULL,
+				loader_chunk_run,
+				chunk) == 0;
+    if (!started[i]) {
+      loader_chunk_run(chunk);
+    }
   }
 
-  node->links[node->num_link++] = link;
-}
+  for (i=0; i<num_chunks; ++i) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
 
-/* ==== Symbol Table to Predicate ==== */
-void initialize_symbol_table_to_predicate(symbol_table_to_predicate_t *link,
-					  int pos,
-					  predicate_table_node_t *predicate,
-					  predicate_table_to_symbol_t *ref) {
-  link->position = pos;
-  link->predicate = predicate;
-  link->link = ref;
-}
+    return_value = return_value && chunks[i].return_value;
+  }
 
-void destroy_symbol_table_to_predicate(symbol_table_to_predicate_t *link) {
-  link->position = 0;
-  link->predicate = NULL;
-  link->link = NULL;
-}
+  for (i=0; i<num_chunks; ++i) {
+    chunk = &chunks[i];
+    if (return_value) {
+      loader_merge_chunk(loader, chunk);
+    }
 
-/*****************************************
- * Predicate Table Functions
- *****************************************/
+    destroy_loader(&chunk->loader);
+    destroy_symbol_table(&chunk->symbol_table);
+    destroy_predicate_table(&chunk->predicate_table);
+  }
 
-/* ==== Predicate Table ==== */
-void initialize_predicate_table(predicate_table_t *table) {
-  table->num_predicates = 0;
-  table->num_allocated = 1;
-  table->predicates = NEW(predicate_table_node_t *, table->num_allocated);
-}
+  FREE(chunks);
+  FREE(threads);
+  FREE(started);
 
-predicate_table_node_t *predicate_table_add(predicate_table_t *table,
-					    predicate_table_node_t *node) {
-  if (table->num_predicates >= table->num_allocated) {
-    predicate_table_enlarge(table);
+  if (!return_value) {
+    return_value = load_buffer(loader, text, length);
   }
 
-  table->predicates[table->num_predicates++] = node;
-  return node;
+  return return_value;
 }
 
-void predicate_table_enlarge(predicate_table_t *table) {
-  table->num_allocated *= ENLARGE_FACTOR;
-  table->predicates = RENEW(table->predicates,
-			    predicate_table_node_t *,
-			    table->num_allocated);
+void *loader_chunk_run(void *data) {
+  loader_chunk_t *chunk = (loader_chunk_t *)data;
+
+  chunk->return_value = load_buffer(&chunk->loader, chunk->text, chunk->length);
+
+  return NULL;
 }
 
-void destroy_predicate_table(predicate_table_t *table) {
-  int i;
+/* Interns the chunk's symbols and functors in the loader's tables, in the
+ * chunk's id order, then replays its facts, compiles its rules where they
+ * stood among them and takes over its queries. */
+void loader_merge_chunk(loader_t *loader, loader_chunk_t *chunk) {
+  symbol_table_t *symbol_table = &chunk->symbol_table;
+  predicate_table_t *predicate_table = &chunk->predicate_table;
+  symbol_table_node_t **symbols,
+                      **args,
+                      *symbol;
+  predicate_table_node_t **predicates,
+                         *predicate;
+  const int *data = chunk->loader.clause_data;
+  size_t i = 0;
+  int max_arity = 0,
+      r = 0,
+      j;
 
-  for (i=0; i<table->num_predicates; ++i) {
-    destroy_predicate_table_node(table->predicates[i]);
-    free(table->predicates[i]);
+  symbols = NEW(symbol_table_node_t *, symbol_table->num_symbols + 1);
+  for (j=0; j<symbol_table->num_symbols; ++j) {
+    symbol = symbol_table->symbols[j];
+    symbols[j] = symbol_table_find_or_add_hashed(loader->symbol_table,
+						 symbol->name,
+						 symbol->length,
+						 symbol->hash);
   }
 
-  table->num_allocated = table->num_predicates = 0;
-  free(table->predicates);
-  table->predicates = NULL;
-}
+  predicates = NEW(predicate_table_node_t *,
+		   predicate_table->num_predicates + 1);
+  for (j=0; j<predicate_table->num_predicates; ++j) {
+    predicate = predicate_table->predicates[j];
+    predicates[j] = predicate_table_find_or_add_n(loader->predicate_table,
+						  predicate->name,
+						  predicate->length,
+						  predicate->arity);
+    if (predicate->arity > max_arity) {
+      max_arity = predicate->arity;
+    }
+  }
 
-predicate_table_node_t *predicate_table_find(predicate_table_t *table,
-					     const char *name) {
-  int i;
-  predicate_table_node_t *node;
+  args = NEW(symbol_table_node_t *, max_arity + 1);
+  for (;;) {
+    while (r < chunk->loader.num_rules &&
+	   chunk->loader.rule_offsets[r] == i) {
+      load_buffer(loader,
+		  chunk->loader.rules[r],
+		  strlen(chunk->loader.rules[r]));
+      r++;
+    }
 
-  for (i=0; i<table->num_predicates; ++i) {
-    node = table->predicates[i];
-    if (strcmp(name, node->name) == 0) {
-      return node;
+    if (i == chunk->loader.num_clause_data) {
+      break;
+    }
+
+    predicate = predicates[data[i++]];
+    for (j=0; j<predicate->arity; ++j) {
+      args[j] = symbols[data[i++]];
     }
+
+    rule_add_symbols(loader->symbol_table, predicate, args);
   }
 
-  return NULL;
+  for (j=0; j<chunk->loader.num_queries; ++j) {
+    if (loader->num_queries >= loader->queries_allocated) {
+      loader->queries_allocated *= ENLARGE_FACTOR;
+      loader->queries = RENEW(loader->queries,
+			      char *,
+			      loader->queries_allocated);
+    }
+    loader->queries[loader->num_queries++] = chunk->loader.queries[j];
+  }
+  chunk->loader.num_queries = 0;
+
+  FREE(symbols);
+  FREE(predicates);
+  FREE(args);
 }
 
-predicate_table_node_t *predicate_table_find_or_add(predicate_table_t *table,
-						    const char *name) {
-  predicate_table_node_t *node = predicate_table_find(table, name);
+void loader_skip_space(loader_t *loader) {
+  while (loader->cursor < loader->end &&
+	 isspace((unsigned char)*loader->cursor)) {
+    if (*loader->cursor == '\n') {
+      loader->line++;
+    }
+    loader->cursor++;
+  }
+}
 
-  if (node == NULL) {
-    node = NEW(predicate_table_node_t, 1);
-    assert(node != NULL);
-    initialize_predicate_table_node(node, name);
-    predicate_table_add(table, node);
+/* Reads a constant ([a-z0-9_]+) or a variable ([A-Z][a-z0-9_]*) and
+ * appends it to loader->idents. */
+loader_token_t loader_ident(loader_t *loader) {
+  const char *start;
+  loader_ident_t *ident;
+  loader_token_t type;
+
+  loader_skip_space(loader);
+  start = loader->cursor;
+
+  if (start == loader->end) {
+    return TOKEN_NONE;
+  } else if (isupper((unsigned char)*start)) {
+    type = TOKEN_VARIABLE;
+    loader->cursor++;
+  } else {
+    type = TOKEN_CONSTANT;
   }
 
-  return node;
-}
+  while (loader->cursor < loader->end &&
+	 (islower((unsigned char)*loader->cursor) ||
+	  isdigit((unsigned char)*loader->cursor) ||
+	  *loader->cursor == '_')) {
+    loader->cursor++;
+  }
 
-/* ==== Predicate Table Node ==== */
-void initialize_predicate_table_node(predicate_table_node_t *node,
-				     const char *name) {
-  node->num_link = 0;
-  node->num_allocated = 1;
-  node->name = name;
-  node->links = NEW(predicate_table_to_symbol_t *, node->num_allocated);
+  if (loader->cursor == start) {
+    return TOKEN_NONE;
+  }
+
+  if (loader->num_idents >= loader->idents_allocated) {
+    loader->idents_allocated *= ENLARGE_FACTOR;
+    loader->idents = RENEW(loader->idents,
+			   loader_ident_t,
+			   loader->idents_allocated);
+    loader->symbols = RENEW(loader->symbols,
+			    symbol_table_node_t *,
+			    loader->idents_allocated);
+  }
+
+  ident = &loader->idents[loader->num_idents++];
+  ident->name = start;
+  ident->length = (int)(loader->cursor - start);
+  ident->type = type;
+
+  return type;
 }
 
-predicate_table_to_symbol_t *predicate_table_node_add(
-    predicate_table_node_t *node,
-    int arity,
-    symbol_table_node_t **nodes) {
-  predicate_table_to_symbol_t *link = NEW(predicate_table_to_symbol_t, 1);
-  int i;
+/* Reads ident '(' ident (',' ident)* ')' into loader->idents. */
+int loader_predicate(loader_t *loader) {
+  loader->num_idents = 0;
 
-  link->arity = arity;
-  link->nodes = NEW(symbol_table_node_t *, arity);
+  if (loader_ident(loader) == TOKEN_NONE) {
+    return loader_error(loader, "predicate name");
+  }
 
-  for (i=0; i<arity; ++i) {
-    link->nodes[i] = nodes[i];
+  loader_skip_space(loader);
+  if (loader->cursor == loader->end || *loader->cursor != '(') {
+    return loader_error(loader, "'('");
   }
+  loader->cursor++;
 
-  if (node->num_link >= node->num_allocated) {
-    predicate_table_node_enlarge(node);
+  do {
+    if (loader_ident(loader) == TOKEN_NONE) {
+      return loader_error(loader, "constant or variable");
+    }
+
+    loader_skip_space(loader);
+  } while (loader->cursor < loader->end && *loader->cursor++ == ',');
+
+  if (loader->cursor[-1] != ')') {
+    return loader_error(loader, "')'");
   }
 
-  node->links[node->num_link++] = link;
-  return link;
+  return 1;
 }
 
-void predicate_table_node_enlarge(predicate_table_node_t *node) {
-  node->num_allocated *= ENLARGE_FACTOR;
-  node->links = RENEW(node->links,
-		      predicate_table_to_symbol_t *,
-		      node->num_allocated);
+/* Reads a comma-separated list of facts, or a rule: a single predicate
+ * followed by ":-" and its body. */
+int loader_fact(loader_t *loader) {
+  predicate_table_node_t *predicate;
+  loader_ident_t *ident;
+  const char *start = loader->cursor;
+  int first = 1,
+      i;
+
+  do {
+    if (!loader_predicate(loader)) {
+      return 0;
+    }
+
+    if (first) {
+      loader_skip_space(loader);
+      if (loader->end - loader->cursor >= 2 &&
+	  loader->cursor[0] == ':' && loader->cursor[1] == '-') {
+	loader->cursor += 2;
+	return loader->deferred
+	  ? loader_defer_rule(loader, start)
+	  : loader_rule(loader);
+      }
+      first = 0;
+    }
+
+    ident = loader->idents;
+    predicate = predicate_table_find_or_add_n(loader->predicate_table,
+					      ident->name,
+					      ident->length,
+					      loader->num_idents - 1);
+
+    for (i=1; i<loader->num_idents; ++i) {
+      loader->symbols[i] = symbol_table_find_or_add_n(loader->symbol_table,
+						      loader->idents[i].name,
+						      loader->idents[i].length);
+    }
+
+    if (loader->deferred) {
+      loader_defer_fact(loader, predicate);
+    } else {
+      rule_add_symbols(loader->symbol_table, predicate, loader->symbols + 1);
+    }
+
+    loader_skip_space(loader);
+  } while (loader->cursor < loader->end && *loader->cursor++ == ',');
+
+  if (loader->cursor[-1] != '.') {
+    return loader_error(loader, "',' or '.'");
+  }
+
+  return 1;
 }
 
-void destroy_predicate_table_node(predicate_table_node_t *node) {
+/* Records the fact just read by loader_fact for a later merge. */
+void loader_defer_fact(loader_t *loader, predicate_table_node_t *predicate) {
+  size_t needed = loader->num_clause_data + predicate->arity + 1;
   int i;
 
-  for (i=0; i<node->num_link; ++i) {
-    destroy_predicate_table_to_symbol(node->links[i]);
-    free(node->links[i]);
+  if (needed > loader->clause_data_allocated) {
+    loader->clause_data_allocated = loader->clause_data_allocated > 0
+      ? loader->clause_data_allocated * ENLARGE_FACTOR
+      : LOADER_CHUNK_SIZE;
+    if (loader->clause_data_allocated < needed) {
+      loader->clause_data_allocated = needed;
+    }
+    loader->clause_data = RENEW(loader->clause_data,
+				int,
+				loader->clause_data_allocated);
   }
 
-  node->num_link = node->num_allocated = 0;
-  free(node->links);
-  node->links = NULL;
+  loader->clause_data[loader->num_clause_data++] = predicate->id;
+  for (i=1; i<=predicate->arity; ++i) {
+    loader->clause_data[loader->num_clause_data++] = loader->symbols[i]->id;
+  }
 }
 
-/* ==== Predicate Table to Symbol ==== */
-void initialize_predicate_table_to_symbol(predicate_table_to_symbol_t *link,
-					  int arity) {
-  link->arity = arity;
-  link->nodes = NEW(symbol_table_node_t *, arity);
-}
+/* Reads the body of a rule whose head loader_fact has just read, from
+ * start, interning its names in the order loader_rule would.  Rules are
+ * compiled against the shared tables, so only the text is kept, for
+ * loader_merge_chunk to compile once the facts before it are in. */
+int loader_defer_rule(loader_t *loader, const char *start) {
+  char *text;
+
+  loader_defer_goal(loader);
+  do {
+    if (!loader_predicate(loader)) {
+      return 0;
+    }
 
-void destroy_predicate_table_to_symbol(predicate_table_to_symbol_t *link) {
-  free(link->nodes);
-  link->arity = 0;
-}
+    loader_defer_goal(loader);
+    loader_skip_space(loader);
+  } while (loader->cursor < loader->end && *loader->cursor++ == ',');
 
-/*****************************************
- * Solve Functions
- *****************************************/
-void initialize_solve(solve_t *solve) {
-  solve->num_goals = 0;
-  solve->num_allocated = 1;
-  solve->goals = NEW(solve_goal_t *, solve->num_allocated);
-  solve->states = NEW(solve_goal_state_t *, solve->num_allocated);
-}
+  if (loader->cursor[-1] != '.') {
+    return loader_error(loader, "',' or '.'");
+  }
 
-void solve_add(solve_t *solve, solve_goal_t *goal) {
-  if (solve->num_goals >= solve->num_allocated) {
-    solve_enlarge(solve);
+  if (loader->num_rules >= loader->rules_allocated) {
+    loader->rules_allocated = loader->rules_allocated > 0
+      ? loader->rules_allocated * ENLARGE_FACTOR
+      : 1;
+    loader->rules = RENEW(loader->rules, char *, loader->rules_allocated);
+    loader->rule_offsets = RENEW(loader->rule_offsets,
+				 size_t,
+				 loader->rules_allocated);
   }
 
-  solve->goals[solve->num_goals] = goal;
-  initialize_solve_goal_state(solve->states[solve->num_goals], goal);
-  solve->num_goals++;
-}
+  text = NEW(char, loader->cursor - start + 1);
+  memcpy(text, start, loader->cursor - start);
+  text[loader->cursor - start] = '\0';
 
-void solve_enlarge(solve_t *solve) {
-  solve->num_allocated *= ENLARGE_FACTOR;
-  solve->goals = RENEW(solve->goals,
-		       solve_goal_t *,
-		       solve->num_allocated);
-  solve->states = RENEW(solve->states,
-			solve_goal_state_t *,
-			solve->num_allocated);
+  loader->rule_offsets[loader->num_rules] = loader->num_clause_data;
+  loader->rules[loader->num_rules++] = text;
+  return 1;
 }
 
-void initialize_solve_goal_state(solve_goal_state_t *state,
-				 solve_goal_t *goal) {
-  state->goal = goal;
-  state->subgoal_index = 0;
-  state->candidate = NULL;
-  state->candidate_index = 0;
+/* Interns the functor and constants of the predicate last read by
+ * loader_predicate, as loader_rule_goal does. */
+void loader_defer_goal(loader_t *loader) {
+  int i;
+
+  predicate_table_find_or_add_n(loader->predicate_table,
+				loader->idents[0].name,
+				loader->idents[0].length,
+				loader->num_idents - 1);
+
+  for (i=1; i<loader->num_idents; ++i) {
+    if (loader->idents[i].type == TOKEN_CONSTANT) {
+      symbol_table_find_or_add_n(loader->symbol_table,
+				 loader->idents[i].name,
+				 loader->idents[i].length);
+    }
+  }
 }
 
-void initialize_solve_goal(solve_goal_t *goal,
-			   predicate_table_node_t *predicate) {
-  goal->predicate = predicate;
+/* Reads the body of a rule whose head loader_fact has just read, and
+ * compiles the rule into the head's predicate. */
+int loader_rule(loader_t *loader) {
+  solve_variable_table_t variables;
+  machine_clause_t *clause = NEW(machine_clause_t, 1);
+  int return_value = 1;
+
+  assert(clause != NULL);
+  initialize_machine_clause(clause);
+  initialize_solve_variable_table(&variables);
+  loader_rule_goal(loader, clause, &variables);
+
+  do {
+    if (!loader_predicate(loader)) {
+      return_value = 0;
+      break;
+    }
+
+    loader_rule_goal(loader, clause, &variables);
+    loader_skip_space(loader);
+  } while (loader->cursor < loader->end && *loader->cursor++ == ',');
+
+  if (return_value && loader->cursor[-1] != '.') {
+    return_value = loader_error(loader, "',' or '.'");
+  }
+
+  if (return_value) {
+    clause->num_variables = variables.num_variables;
+    machine_clause_compile(clause, 0);
+    predicate_table_node_add_rule(clause->goals[0].predicate, clause);
+  } else {
+    destroy_machine_clause(clause);
+    FREE(clause);
+  }
+
+  destroy_solve_variable_table(&variables);
+  return return_value;
+}
+
+/* Adds the predicate last read by loader_predicate to clause as a goal,
+ * numbering its variables through variables. */
+void loader_rule_goal(loader_t *loader,
+		      machine_clause_t *clause,
+		      solve_variable_table_t *variables) {
+  machine_goal_t *goal;
+  loader_ident_t *ident;
+  int i;
+
+  goal = machine_clause_add_goal(
+      clause,
+      predicate_table_find_or_add_n(loader->predicate_table,
+				    loader->idents[0].name,
+				    loader->idents[0].length,
+				    loader->num_idents - 1));
+
+  for (i=1; i<loader->num_idents; ++i) {
+    ident = &loader->idents[i];
+    if (ident->type == TOKEN_VARIABLE) {
+      goal->args[i - 1] = -1 - solve_variable_table_find_or_add_n(
+	  variables,
+	  ident->name,
+	  ident->length)->index;
+    } else {
+      goal->args[i - 1] = symbol_table_find_or_add_n(loader->symbol_table,
+						     ident->name,
+						     ident->length)->id;
+    }
+  }
+}
+
+/* Checks the query's syntax and keeps a copy of its text, from just after
+ * the "?-" up to its terminating '.', for loader_execute_queries. */
+int loader_query(loader_t *loader) {
+  const char *start = loader->cursor;
+  char *text;
+  int limit;
+
+  do {
+    if (!loader_predicate(loader)) {
+      return 0;
+    }
+
+    loader_skip_space(loader);
+  } while (loader->cursor < loader->end && *loader->cursor++ == ',');
+
+  if (loader->cursor[-1] != '.') {
+    loader->cursor--;
+    if (!loader_limit(loader, &limit)) {
+      return 0;
+    }
+
+    if (limit < 0 || loader->cursor == loader->end ||
+	*loader->cursor++ != '.') {
+      return loader_error(loader, "',' or '.'");
+    }
+  }
+
+  text = NEW(char, loader->cursor - start + 1);
+  memcpy(text, start, loader->cursor - start);
+  text[loader->cursor - start] = '\0';
+
+  if (loader->num_queries >= loader->queries_allocated) {
+    loader->queries_allocated *= ENLARGE_FACTOR;
+    loader->queries = RENEW(loader->queries, char *, loader->queries_allocated);
+  }
+  loader->queries[loader->num_queries++] = text;
+
+  return 1;
+}
+
+/* Reads the "limit N" that may end a query into *limit, or leaves -1
+ * there if the query has none. */
+int loader_limit(loader_t *loader, int *limit) {
+  const char *start;
+
+  *limit = -1;
+  if (loader->end - loader->cursor < 5 ||
+      strncmp(loader->cursor, "limit", 5) != 0) {
+    return 1;
+  }
+
+  loader->cursor += 5;
+  loader_skip_space(loader);
+  start = loader->cursor;
+  *limit = 0;
+  while (loader->cursor < loader->end &&
+	 isdigit((unsigned char)*loader->cursor)) {
+    *limit = *limit <= (INT_MAX - 9) / 10
+      ? *limit * 10 + (*loader->cursor - '0')
+      : INT_MAX;
+    loader->cursor++;
+  }
+
+  if (loader->cursor == start) {
+    return loader_error(loader, "number");
+  }
+
+  loader_skip_space(loader);
+  return 1;
+}
+
+int loader_error(loader_t *loader, const char *expected) {
+  if (loader->deferred) {
+    return 0;
+  }
+
+  fprintf(stderr, "%s:%d: syntax error, expected %s\n",
+	  loader->filename,
+	  loader->line,
+	  expected);
+  return 0;
+}
+
+/* Builds a goal from the predicate last read by loader_predicate. */
+solve_goal_t *loader_goal(loader_t *loader,
+			  solve_variable_table_t *variables) {
+  solve_goal_t *goal = NEW(solve_goal_t, 1);
+  solve_subgoal_t *subgoal;
+  solve_condition_t *condition;
+  loader_ident_t *ident;
+  int i;
+
+  assert(goal != NULL);
+  initialize_solve_goal(goal,
+			predicate_table_find_or_add_n(loader->predicate_table,
+						      loader->idents[0].name,
+						      loader->idents[0].length,
+						      loader->num_idents - 1));
+
+  for (i=1; i<loader->num_idents; ++i) {
+    ident = &loader->idents[i];
+    if (ident->type == TOKEN_VARIABLE) {
+      condition = solve_variable_table_find_or_add_n(variables,
+						     ident->name,
+						     ident->length);
+    } else {
+      condition = NEW(solve_condition_t, 1);
+      assert(condition != NULL);
+      initialize_solve_condition_constant(
+	  condition,
+	  symbol_table_find_or_add_n(loader->symbol_table,
+				     ident->name,
+				     ident->length));
+    }
+
+    subgoal = NEW(solve_subgoal_t, 1);
+    assert(subgoal != NULL);
+    initialize_solve_subgoal(subgoal, i - 1, condition);
+    solve_goal_add(goal, subgoal);
+  }
+
+  return goal;
+}
+
+/* Runs the queries collected while loading, in source order. */
+void loader_execute_queries(loader_t *loader) {
+  solve_variable_table_t variables;
+  solve_t solve;
+  int i;
+
+  if (loader->num_threads > 1 && loader->num_queries > 1) {
+    loader_execute_parallel(loader);
+    return;
+  }
+
+  for (i=0; i<loader->num_queries; ++i) {
+    loader_build_query(loader, loader->queries[i], &solve, &variables);
+    execute_solve(&solve);
+
+    destroy_solve(&solve);
+    destroy_solve_variable_table(&variables);
+  }
+}
+
+/* Runs the queries on loader->num_threads workers.  All goals are built
+ * up front, since that interns their constants; after that the tables are
+ * only read.  Answers are printed as soon as every earlier query's are. */
+void loader_execute_parallel(loader_t *loader) {
+  loader_query_pool_t pool;
+  pthread_t *threads = NEW(pthread_t, loader->num_threads);
+  int num_started = 0,
+      i;
+
+  pool.num_queries = loader->num_queries;
+  pool.next = 0;
+  pool.solves = NEW(solve_t, pool.num_queries);
+  pool.variables = NEW(solve_variable_table_t, pool.num_queries);
+  pool.outputs = NEW(char *, pool.num_queries);
+  pool.lengths = NEW(size_t, pool.num_queries);
+  pool.done = NEW(int, pool.num_queries);
+  pthread_mutex_init(&pool.lock, NULL);
+  pthread_cond_init(&pool.finished, NULL);
+
+  for (i=0; i<pool.num_queries; ++i) {
+    loader_build_query(loader,
+		       loader->queries[i],
+		       &pool.solves[i],
+		       &pool.variables[i]);
+    pool.outputs[i] = NULL;
+    pool.lengths[i] = 0;
+    pool.done[i] = 0;
+  }
+
+  for (i=0; i<loader->num_threads; ++i) {
+    if (pthread_create(&threads[num_started],
+		       NULL,
+		       loader_query_worker,
+		       &pool) == 0) {
+      num_started++;
+    }
+  }
+
+  if (num_started == 0) {
+    loader_query_worker(&pool);
+  }
+
+  for (i=0; i<pool.num_queries; ++i) {
+    pthread_mutex_lock(&pool.lock);
+    while (!pool.done[i]) {
+      pthread_cond_wait(&pool.finished, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    fwrite(pool.outputs[i], 1, pool.lengths[i], stdout);
+    free(pool.outputs[i]);
+  }
+
+  for (i=0; i<num_started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (i=0; i<pool.num_queries; ++i) {
+    destroy_solve(&pool.solves[i]);
+    destroy_solve_variable_table(&pool.variables[i]);
+  }
+
+  pthread_mutex_destroy(&pool.lock);
+  pthread_cond_destroy(&pool.finished);
+  FREE(pool.solves);
+  FREE(pool.variables);
+  FREE(pool.outputs);
+  FREE(pool.lengths);
+  FREE(pool.done);
+  FREE(threads);
+}
+
+void *loader_query_worker(void *data) {
+  loader_query_pool_t *pool = (loader_query_pool_t *)data;
+  solve_t *solve;
+  int i;
+
+  for (;;) {
+    pthread_mutex_lock(&pool->lock);
+    i = pool->next < pool->num_queries ? pool->next++ : -1;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (i < 0) {
+      return NULL;
+    }
+
+    solve = &pool->solves[i];
+    solve->output = open_memstream(&pool->outputs[i], &pool->lengths[i]);
+    assert(solve->output != NULL);
+    execute_solve(solve);
+    fclose(solve->output);
+    solve->output = stdout;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->done[i] = 1;
+    pthread_cond_broadcast(&pool->finished);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+/* Parses the query text saved by loader_query into a fresh solve. */
+void loader_build_query(loader_t *loader,
+			const char *text,
+			solve_t *solve,
+			solve_variable_table_t *variables) {
+  loader->cursor = text;
+  loader->end = text + strlen(text);
+
+  initialize_solve_variable_table(variables);
+  initialize_solve(solve, variables);
+  solve->symbol_table = loader->symbol_table;
+
+  do {
+    loader_predicate(loader);
+    solve_add(solve, loader_goal(loader, variables));
+    loader_skip_space(loader);
+  } while (*loader->cursor++ == ',');
+
+  if (loader->cursor[-1] != '.') {
+    loader->cursor--;
+    loader_limit(loader, &solve->limit);
+  }
+}
+
+void loader_clear_queries(loader_t *loader) {
+  int i;
+
+  for (i=0; i<loader->num_queries; ++i) {
+    FREE(loader->queries[i]);
+  }
+
+  loader->num_queries = 0;
+}
+
+/*****************************************
+ * Snapshot Functions
+ *****************************************/
+void initialize_snapshot(snapshot_t *snapshot) {
+  snapshot->data = NULL;
+  snapshot->size = 0;
+  snapshot->offset = 0;
+}
+
+void destroy_snapshot(snapshot_t *snapshot) {
+  if (snapshot->data != NULL) {
+    munmap((void *)snapshot->data, snapshot->size);
+  }
+
+  initialize_snapshot(snapshot);
+}
+
+int snapshot_is_image(const char *filename) {
+  snapshot_header_t header;
+  FILE *file = fopen(filename, "rb");
+  int return_value;
+
+  if (file == NULL) {
+    return 0;
+  }
+
+  return_value =
+    fread(header.magic, 1, sizeof(header.magic), file) ==
+    sizeof(header.magic) &&
+    memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0;
+  fclose(file);
+
+  return return_value;
+}
+
+/* Writes both tables to filename.  Reverse links and postings are not
+ * stored; they are cheap to rebuild from the columns on load. */
+int snapshot_save(const char *filename,
+		  symbol_table_t *symbol_table,
+		  predicate_table_t *predicate_table) {
+  snapshot_header_t header;
+  snapshot_symbol_t symbol;
+  snapshot_predicate_t record;
+  snapshot_index_t index_record;
+  snapshot_bucket_t bucket;
+  predicate_table_node_t *predicate;
+  predicate_index_t *index;
+  FILE *file;
+  long pool_size = 0,
+       offset,
+       num_clauses;
+  int return_value,
+      i,
+      j,
+      k;
+
+  for (i=0; i<predicate_table->num_predicates; ++i) {
+    if (predicate_table->predicates[i]->num_rules > 0) {
+      fprintf(stderr, "%s: rules cannot be saved in a snapshot\n", filename);
+      return 0;
+    }
+  }
+
+  file = fopen(filename, "wb");
+  if (file == NULL) {
+    perror(filename);
+    return 0;
+  }
+
+  for (i=0; i<symbol_table->num_symbols; ++i) {
+    pool_size += symbol_table->symbols[i]->length + 1;
+  }
+  for (i=0; i<predicate_table->num_predicates; ++i) {
+    pool_size += predicate_table->predicates[i]->length + 1;
+  }
+
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+  header.version = SNAPSHOT_VERSION;
+  header.byte_order = SNAPSHOT_BYTE_ORDER;
+  header.word_size = (int)sizeof(long);
+  header.num_symbols = symbol_table->num_symbols;
+  header.num_symbol_buckets = symbol_table->num_buckets;
+  header.num_predicates = predicate_table->num_predicates;
+  header.pool_size = pool_size;
+  return_value = snapshot_write(file, &header, sizeof(header));
+
+  /* ==== Symbols ==== */
+  offset = 0;
+  for (i=0; i<symbol_table->num_symbols && return_value; ++i) {
+    memset(&symbol, 0, sizeof(symbol));
+    symbol.name = offset;
+    symbol.length = symbol_table->symbols[i]->length;
+    symbol.hash = (unsigned int)symbol_table->symbols[i]->hash;
+    return_value = fwrite(&symbol, sizeof(symbol), 1, file) == 1;
+    offset += symbol.length + 1;
+  }
+
+  return_value = return_value &&
+    snapshot_write(file,
+		   symbol_table->buckets,
+		   sizeof(int) * symbol_table->num_buckets);
+
+  /* ==== String Pool ==== */
+  for (i=0; i<symbol_table->num_symbols && return_value; ++i) {
+    return_value = fwrite(symbol_table->symbols[i]->name,
+			  symbol_table->symbols[i]->length + 1,
+			  1,
+			  file) == 1;
+  }
+  for (i=0; i<predicate_table->num_predicates && return_value; ++i) {
+    return_value = fwrite(predicate_table->predicates[i]->name,
+			  predicate_table->predicates[i]->length + 1,
+			  1,
+			  file) == 1;
+  }
+  return_value = return_value &&
+    snapshot_write(file, NULL, pool_size);
+
+  /* ==== Predicates ==== */
+  for (i=0; i<predicate_table->num_predicates && return_value; ++i) {
+    predicate = predicate_table->predicates[i];
+
+    memset(&record, 0, sizeof(record));
+    record.name = offset;
+    record.length = predicate->length;
+    record.arity = predicate->arity;
+    record.num_clauses = predicate->num_link;
+    record.num_indexes = predicate->num_indexes;
+    offset += predicate->length + 1;
+    return_value = snapshot_write(file, &record, sizeof(record));
+
+    for (j=0; j<predicate->arity && return_value; ++j) {
+      return_value = snapshot_write(file,
+				    predicate->columns[j],
+				    sizeof(atom_t) * predicate->num_link);
+    }
+
+    for (j=0; j<predicate->num_indexes && return_value; ++j) {
+      index = predicate->indexes[j];
+
+      index_record.num_positions = index->num_positions;
+      index_record.num_keys = index->num_keys;
+      index_record.num_buckets = index->num_buckets;
+      index_record.num_clauses = predicate->num_link;
+      return_value =
+	snapshot_write(file, &index_record, sizeof(index_record)) &&
+	snapshot_write(file,
+		       index->positions,
+		       sizeof(int) * index->num_positions);
+
+      /* Every clause sits in exactly one bucket, so the clause lists laid
+       * end to end hold num_link ordinals. */
+      num_clauses = 0;
+      for (k=0; k<index->num_buckets && return_value; ++k) {
+	memset(&bucket, 0, sizeof(bucket));
+	bucket.hash = (unsigned int)index->buckets[k].hash;
+	bucket.num_clauses = index->buckets[k].num_clauses;
+	bucket.clauses = num_clauses;
+	num_clauses += bucket.num_clauses;
+	return_value = fwrite(&bucket, sizeof(bucket), 1, file) == 1;
+      }
+
+      for (k=0; k<index->num_buckets && return_value; ++k) {
+	if (index->buckets[k].num_clauses > 0) {
+	  return_value = fwrite(index->buckets[k].clauses,
+				sizeof(int),
+				index->buckets[k].num_clauses,
+				file) == (size_t)index->buckets[k].num_clauses;
+	}
+      }
+
+      return_value = return_value &&
+	snapshot_write(file, NULL, sizeof(int) * num_clauses);
+    }
+  }
+
+  if (fclose(file) != 0 || !return_value) {
+    perror(filename);
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Writes size bytes of data padded so that whatever follows starts on an
+ * 8-byte boundary.  With data NULL only the padding is written, for a
+ * section of size bytes written piecemeal. */
+int snapshot_write(FILE *file, const void *data, size_t size) {
+  static const char zeroes[8] = { 0 };
+  size_t padded = SNAPSHOT_ALIGN(size),
+         chunk;
+
+  if (data != NULL && size > 0 && fwrite(data, 1, size, file) != size) {
+    return 0;
+  }
+
+  for (; size<padded; size+=chunk) {
+    chunk = padded - size < sizeof(zeroes) ? padded - size : sizeof(zeroes);
+    if (fwrite(zeroes, 1, chunk, file) != chunk) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Maps filename and loads it into the given tables, which must be empty.
+ * Symbol names and index clause lists are used straight from the mapping;
+ * reverse links and postings are rebuilt from the columns without hashing
+ * a single string. */
+int snapshot_load(snapshot_t *snapshot,
+		  const char *filename,
+		  symbol_table_t *symbol_table,
+		  predicate_table_t *predicate_table) {
+  const snapshot_header_t *header;
+  const snapshot_symbol_t *symbols;
+  const int *buckets;
+  const char *pool;
+  symbol_table_node_t *nodes;
+  struct stat st;
+  void *data;
+  int fd,
+      i;
+
+  if (symbol_table->num_symbols > 0 || predicate_table->num_predicates > 0) {
+    fprintf(stderr, "%s: a snapshot must be loaded first\n", filename);
+    return 0;
+  }
+
+  fd = open(filename, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    perror(filename);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return 0;
+  }
+
+  data = st.st_size > 0
+    ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)
+    : MAP_FAILED;
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror(filename);
+    return 0;
+  }
+
+  snapshot->data = (const char *)data;
+  snapshot->size = st.st_size;
+  snapshot->offset = 0;
+
+  header = (const snapshot_header_t *)snapshot_read(snapshot,
+						     sizeof(*header));
+  if (header == NULL ||
+      memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+      header->byte_order != SNAPSHOT_BYTE_ORDER ||
+      header->word_size != (int)sizeof(long)) {
+    fprintf(stderr, "%s: not a snapshot image for this machine\n", filename);
+    return 0;
+  }
+
+  if (header->version != SNAPSHOT_VERSION) {
+    fprintf(stderr, "%s: snapshot version %d, expected %d\n",
+	    filename, header->version, SNAPSHOT_VERSION);
+    return 0;
+  }
+
+  if (header->num_symbols < 0 || header->num_predicates < 0 ||
+      header->num_symbol_buckets < INITIAL_BUCKETS ||
+      (header->num_symbol_buckets & (header->num_symbol_buckets - 1)) != 0 ||
+      header->num_symbols * 2 > header->num_symbol_buckets) {
+    return snapshot_load_error(filename);
+  }
+
+  symbols = (const snapshot_symbol_t *)
+    snapshot_read(snapshot, sizeof(*symbols) * header->num_symbols);
+  buckets = (const int *)
+    snapshot_read(snapshot, sizeof(int) * header->num_symbol_buckets);
+  pool = (const char *)snapshot_read(snapshot, header->pool_size);
+  if (symbols == NULL || buckets == NULL || pool == NULL) {
+    return snapshot_load_error(filename);
+  }
+
+  /* ==== Symbols ==== */
+  FREE(symbol_table->symbols);
+  symbol_table->num_allocated = header->num_symbols > 0
+    ? header->num_symbols
+    : 1;
+  symbol_table->symbols = NEW(symbol_table_node_t *,
+			      symbol_table->num_allocated);
+
+  FREE(symbol_table->buckets);
+  symbol_table->num_buckets = header->num_symbol_buckets;
+  symbol_table->buckets = NEW(int, symbol_table->num_buckets);
+  memcpy(symbol_table->buckets,
+	 buckets,
+	 sizeof(int) * symbol_table->num_buckets);
+
+  nodes = ARENA_NEW(&symbol_table->arena,
+		    symbol_table_node_t,
+		    header->num_symbols);
+  for (i=0; i<header->num_symbols; ++i) {
+    if (symbols[i].name < 0 || symbols[i].length < 0 ||
+	symbols[i].name + symbols[i].length >= header->pool_size ||
+	pool[symbols[i].name + symbols[i].length] != '\0') {
+      symbol_table->num_symbols = i;
+      return snapshot_load_error(filename);
+    }
+
+    initialize_symbol_table_node_hashed(&nodes[i],
+					pool + symbols[i].name,
+					symbols[i].length,
+					symbols[i].hash);
+    nodes[i].id = i;
+    symbol_table->symbols[i] = &nodes[i];
+  }
+  symbol_table->num_symbols = header->num_symbols;
+
+  for (i=0; i<symbol_table->num_buckets; ++i) {
+    if (symbol_table->buckets[i] < -1 ||
+	symbol_table->buckets[i] >= symbol_table->num_symbols) {
+      return snapshot_load_error(filename);
+    }
+  }
+
+  /* ==== Predicates ==== */
+  for (i=0; i<header->num_predicates; ++i) {
+    if (!snapshot_load_predicate(snapshot,
+				 pool,
+				 header->pool_size,
+				 symbol_table,
+				 predicate_table)) {
+      return snapshot_load_error(filename);
+    }
+  }
+
+  return 1;
+}
+
+int snapshot_load_error(const char *filename) {
+  fprintf(stderr, "%s: corrupt snapshot image\n", filename);
+  return 0;
+}
+
+/* Returns the next size bytes of the image and moves past them and their
+ * padding, or NULL if the image is too short. */
+const void *snapshot_read(snapshot_t *snapshot, size_t size) {
+  const char *data = snapshot->data + snapshot->offset;
+
+  if (size > snapshot->size - snapshot->offset ||
+      SNAPSHOT_ALIGN(size) > snapshot->size - snapshot->offset) {
+    return NULL;
+  }
+
+  snapshot->offset += SNAPSHOT_ALIGN(size);
+  return data;
+}
+
+int snapshot_load_predicate(snapshot_t *snapshot,
+			    const char *pool,
+			    long pool_size,
+			    symbol_table_t *symbol_table,
+			    predicate_table_t *predicate_table) {
+  const snapshot_predicate_t *record;
+  const snapshot_index_t *index_record;
+  const snapshot_bucket_t *buckets;
+  const atom_t **columns;
+  const int *positions,
+            *clauses;
+  predicate_table_node_t *predicate;
+  predicate_index_t *index;
+  symbol_table_node_t **args;
+  int return_value = 1,
+      ordinal,
+      i,
+      j;
+
+  record = (const snapshot_predicate_t *)
+    snapshot_read(snapshot, sizeof(*record));
+  if (record == NULL || record->arity < 0 || record->num_clauses < 0 ||
+      record->name < 0 || record->length < 0 ||
+      record->name + record->length >= pool_size) {
+    return 0;
+  }
+
+  predicate = predicate_table_find_or_add_n(predicate_table,
+					    pool + record->name,
+					    record->length,
+					    record->arity);
+  if (predicate->num_link > 0) {
+    return 0;
+  }
+
+  columns = NEW(const atom_t *, record->arity + 1);
+  for (i=0; i<record->arity && return_value; ++i) {
+    columns[i] = (const atom_t *)
+      snapshot_read(snapshot, sizeof(atom_t) * record->num_clauses);
+    return_value = columns[i] != NULL;
+    for (j=0; j<record->num_clauses && return_value; ++j) {
+      return_value = columns[i][j] < (atom_t)symbol_table->num_symbols;
+    }
+  }
+
+  /* The indexes are restored while the predicate is still empty, so adding
+   * one costs nothing; its buckets are then taken over from the image. */
+  for (i=0; i<record->num_indexes && return_value; ++i) {
+    index_record = (const snapshot_index_t *)
+      snapshot_read(snapshot, sizeof(*index_record));
+    return_value = index_record != NULL &&
+      index_record->num_clauses == record->num_clauses &&
+      index_record->num_buckets >= INITIAL_BUCKETS &&
+      (index_record->num_buckets & (index_record->num_buckets - 1)) == 0;
+    if (!return_value) {
+      break;
+    }
+
+    positions = (const int *)
+      snapshot_read(snapshot, sizeof(int) * index_record->num_positions);
+    buckets = (const snapshot_bucket_t *)
+      snapshot_read(snapshot, sizeof(*buckets) * index_record->num_buckets);
+    clauses = (const int *)
+      snapshot_read(snapshot, sizeof(int) * index_record->num_clauses);
+    index = positions == NULL || buckets == NULL || clauses == NULL
+      ? NULL
+      : predicate_table_node_add_index(predicate,
+				       index_record->num_positions,
+				       positions);
+    return_value = index != NULL;
+
+    for (j=0; j<index_record->num_clauses && return_value; ++j) {
+      return_value = clauses[j] >= 0 && clauses[j] < record->num_clauses;
+    }
+
+    if (!return_value) {
+      break;
+    }
+
+    FREE(index->buckets);
+    index->num_keys = index_record->num_keys;
+    index->num_buckets = index_record->num_buckets;
+    index->buckets = NEW(predicate_index_bucket_t, index->num_buckets);
+    for (j=0; j<index->num_buckets && return_value; ++j) {
+      index->buckets[j].hash = buckets[j].hash;
+      index->buckets[j].num_clauses = buckets[j].num_clauses;
+      index->buckets[j].num_allocated = buckets[j].num_clauses;
+      index->buckets[j].clauses = (int *)(clauses + buckets[j].clauses);
+      return_value = buckets[j].num_clauses >= 0 && buckets[j].clauses >= 0 &&
+	buckets[j].clauses + buckets[j].num_clauses <= record->num_clauses;
+    }
+
+    /* A bucket keeps pointing into the read-only image only until a clause
+     * is added to it: num_allocated == num_clauses forces a copy first. */
+  }
+
+  if (return_value) {
+    args = NEW(symbol_table_node_t *, record->arity + 1);
+    for (i=0; i<record->num_clauses; ++i) {
+      for (j=0; j<record->arity; ++j) {
+	args[j] = symbol_table->symbols[columns[j][i]];
+      }
+
+      ordinal = predicate_table_node_append(predicate, record->arity, args);
+      for (j=0; j<record->arity; ++j) {
+	symbol_table_node_add(args[j],
+			      &symbol_table->arena,
+			      j,
+			      predicate,
+			      ordinal);
+      }
+    }
+    FREE(args);
+  }
+
+  FREE(columns);
+  return return_value;
+}
+
+/*****************************************
+ * Session Functions
+ *****************************************/
+void initialize_session(session_t *session,
+			symbol_table_t *symbol_table,
+			predicate_table_t *predicate_table,
+			loader_t *loader,
+			grammar_t *grammar,
+			snapshot_t *snapshot) {
+  session->symbol_table = symbol_table;
+  session->predicate_table = predicate_table;
+  session->loader = loader;
+  session->grammar = grammar;
+  session->snapshot = snapshot;
+  session->interactive = 0;
+
+  session->num_buffer = 0;
+  session->buffer_allocated = SESSION_LINE_SIZE;
+  session->buffer = NEW(char, session->buffer_allocated);
+}
+
+void destroy_session(session_t *session) {
+  FREE(session->buffer);
+  session->buffer = NULL;
+  session->num_buffer = session->buffer_allocated = 0;
+}
+
+/* Reads statements from file until end of input or halt.  A statement may
+ * span lines; it is complete once a line ends in '.'. */
+void session_run(session_t *session, FILE *file) {
+  size_t length;
+  char *end;
+
+  for (;;) {
+    if (session->interactive) {
+      printf(session->num_buffer == 0 ? "?- " : "|    ");
+      fflush(stdout);
+    }
+
+    if (session->buffer_allocated - session->num_buffer < SESSION_LINE_SIZE) {
+      session->buffer_allocated *= ENLARGE_FACTOR;
+      session->buffer = RENEW(session->buffer,
+			      char,
+			      session->buffer_allocated);
+    }
+
+    if (fgets(session->buffer + session->num_buffer,
+	      (int)(session->buffer_allocated - session->num_buffer),
+	      file) == NULL) {
+      break;
+    }
+
+    length = strlen(session->buffer + session->num_buffer);
+    session->num_buffer += length;
+    if (length == 0 || session->buffer[session->num_buffer - 1] != '\n') {
+      if (!feof(file)) {
+	continue;
+      }
+    }
+
+    for (end=session->buffer + session->num_buffer;
+	 end>session->buffer && isspace((unsigned char)end[-1]);
+	 --end) {
+    }
+
+    if (end == session->buffer) {
+      session->num_buffer = 0;
+    } else if (end[-1] == '.') {
+      *end = '\0';
+      session->num_buffer = 0;
+      if (!session_statement(session, session->buffer)) {
+	return;
+      }
+      fflush(stdout);
+    }
+  }
+
+  if (session->num_buffer > 0) {
+    session->buffer[session->num_buffer] = '\0';
+    session->num_buffer = 0;
+    session_statement(session, session->buffer);
+  }
+
+  if (session->interactive) {
+    printf("\n");
+  }
+}
+
+/* Runs every statement in text: halt, listing, consult(File) with File
+ * bare or quoted, a rule to add, or else a query, with or without a
+ * leading "?-".  Returns 0 on halt. */
+int session_statement(session_t *session, const char *text) {
+  loader_t *loader = session->loader;
+  const char *end,
+             *prefix,
+             *start,
+             *stop;
+  char *query;
+  int length;
+
+  for (;;) {
+    while (isspace((unsigned char)*text)) {
+      text++;
+    }
+
+    if (*text == '\0') {
+      return 1;
+    }
+
+    if (text[0] == '?' && text[1] == '-') {
+      text += 2;
+      while (isspace((unsigned char)*text)) {
+	text++;
+      }
+    }
+
+    if ((length = session_command(text, "halt")) > 0) {
+      return 0;
+    } else if ((length = session_command(text, "listing")) > 0) {
+      print_rules(session->symbol_table, session->predicate_table);
+      text += length;
+    } else if (strncmp(text, "consult(", 8) == 0 &&
+	       (end = strchr(text, ')')) != NULL &&
+	       (length = session_command(end + 1, "")) > 0) {
+      start = text + 8;
+      stop = end;
+      /* consult('file.pl'). names the file as an atom; one layer of
+       * quotes is not part of the path. */
+      if (stop - start >= 2 && (*start == '\'' || *start == '"') &&
+	  stop[-1] == *start) {
+	start++;
+	stop--;
+      }
+
+      query = NEW(char, stop - start + 1);
+      memcpy(query, start, stop - start);
+      query[stop - start] = '\0';
+      session_consult(session, query);
+      FREE(query);
+      text = end + 1 + length;
+    } else {
+      prefix = "?-";
+      for (end=text; *end!='\0' && *end!='.'; ++end) {
+	if (end[0] == ':' && end[1] == '-') {
+	  prefix = "";
+	}
+      }
+
+      /* The loader only runs queries it has read itself, so the statement
+       * is handed to it as one, unless it is a rule. */
+      length = (int)strlen(prefix) + (int)(end - text) + (*end == '.');
+      query = NEW(char, length + 1);
+      strcpy(query, prefix);
+      memcpy(query + strlen(prefix), text, length - strlen(prefix));
+      query[length] = '\0';
+
+      loader->filename = "<stdin>";
+      loader->line = 1;
+      if (load_buffer(loader, query, length)) {
+	if (materialize && *prefix == '\0') {
+	  predicate_table_materialize(session->predicate_table,
+				      session->symbol_table);
+	}
+	loader_execute_queries(loader);
+      }
+      loader_clear_queries(loader);
+
+      FREE(query);
+      text += length - strlen(prefix);
+    }
+  }
+}
+
+/* Loads a text file or, into an empty database, a snapshot image, and runs
+ * any queries the file contains. */
+int session_consult(session_t *session, const char *filename) {
+  mpc_result_t r;
+  int return_value;
+
+  if (snapshot_is_image(filename)) {
+    return snapshot_load(session->snapshot,
+			 filename,
+			 session->symbol_table,
+			 session->predicate_table);
+  }
+
+  return_value = load_file(session->loader, filename);
+  if (return_value) {
+    if (materialize) {
+      predicate_table_materialize(session->predicate_table,
+				  session->symbol_table);
+    }
+    loader_execute_queries(session->loader);
+  } else if (parse_file(session->grammar, &r, filename)) {
+    mpc_ast_delete(r.output);
+  }
+  loader_clear_queries(session->loader);
+
+  return return_value;
+}
+
+/* Returns the length of the command name with its terminating '.' if
+ * text starts with it, or 0. */
+int session_command(const char *text, const char *name) {
+  const char *cursor = text + strlen(name);
+
+  if (strncmp(text, name, strlen(name)) != 0) {
+    return 0;
+  }
+
+  while (isspace((unsigned char)*cursor)) {
+    cursor++;
+  }
+
+  return *cursor == '.' ? (int)(cursor - text) + 1 : 0;
+}
+
+/*****************************************
+ * Arena Functions
+ *****************************************/
+void initialize_arena(arena_t *arena, size_t block_size) {
+  arena->blocks = NULL;
+  arena->last = NULL;
+  arena->block_size = block_size;
+  arena->reserved = 0;
+  memset(arena->used, 0, sizeof(arena->used));
+  memset(arena->abandoned, 0, sizeof(arena->abandoned));
+}
+
+void *arena_alloc(arena_t *arena, memory_category_t category, size_t size) {
+  arena_block_t *block = arena->blocks;
+  size_t header = ARENA_ALIGN(sizeof(arena_block_t));
+  char *memory;
+
+  size = ARENA_ALIGN(size);
+  arena->used[category] += size;
+
+  if (block == NULL || block->used + size > block->size) {
+    block = (arena_block_t *)malloc(header + (size > arena->block_size
+					      ? size
+					      : arena->block_size));
+    assert(block != NULL);
+    block->size = size > arena->block_size ? size : arena->block_size;
+    block->used = 0;
+    arena->reserved += block->size;
+
+    /* An oversized block is slotted in behind the current one so that the
+     * current block's free space is not abandoned. */
+    if (size > arena->block_size && arena->blocks != NULL) {
+      block->next = arena->blocks->next;
+      arena->blocks->next = block;
+      block->used = size;
+      return (char *)block + header;
+    }
+
+    block->next = arena->blocks;
+    arena->blocks = block;
+  }
+
+  memory = (char *)block + header + block->used;
+  block->used += size;
+  arena->last = memory;
+
+  return memory;
+}
+
+/* Grows an allocation made from arena.  The most recent allocation is
+ * extended in place when its block has room; anything else is copied and
+ * its old space is simply left behind until the arena is destroyed. */
+void *arena_realloc(arena_t *arena,
+		    memory_category_t category,
+		    void *orig,
+		    size_t old_size,
+		    size_t new_size) {
+  arena_block_t *block = arena->blocks;
+  void *memory;
+
+  if (orig != NULL && orig == arena->last &&
+      (char *)orig + ARENA_ALIGN(new_size) <=
+      (char *)block + ARENA_ALIGN(sizeof(arena_block_t)) + block->size) {
+    block->used += ARENA_ALIGN(new_size) - ARENA_ALIGN(old_size);
+    arena->used[category] += ARENA_ALIGN(new_size) - ARENA_ALIGN(old_size);
+    return orig;
+  }
+
+  memory = arena_alloc(arena, category, new_size);
+  if (orig != NULL) {
+    memcpy(memory, orig, old_size);
+    arena->abandoned[category] += ARENA_ALIGN(old_size);
+  }
+
+  return memory;
+}
+
+char *arena_strndup(arena_t *arena,
+		    memory_category_t category,
+		    const char *string,
+		    int length) {
+  char *copy = (char *)arena_alloc(arena, category, length + 1);
+
+  memcpy(copy, string, length);
+  copy[length] = '\0';
+
+  return copy;
+}
+
+void destroy_arena(arena_t *arena) {
+  arena_block_t *block,
+                *next;
+
+  for (block=arena->blocks; block!=NULL; block=next) {
+    next = block->next;
+    free(block);
+  }
+
+  arena->blocks = NULL;
+  arena->last = NULL;
+  arena->reserved = 0;
+}
+
+/*****************************************
+ * Bitmap Functions
+ *****************************************/
+#undef MEMORY_CATEGORY
+#define MEMORY_CATEGORY MEMORY_LINKS
+
+void initialize_bitmap(bitmap_t *bitmap) {
+  bitmap->cardinality = 0;
+  bitmap->num_containers = 0;
+  bitmap->num_allocated = 0;
+  bitmap->containers = NULL;
+}
+
+/* Adds value, which must be larger than every value already present, so
+ * only the last container ever changes.  A container's sorted array is
+ * converted to a bitmap once it would exceed BITMAP_ARRAY_MAX values. */
+void bitmap_append(bitmap_t *bitmap, arena_t *arena, int value) {
+  bitmap_container_t *container = NULL;
+  int key = value >> 16,
+      low = value & 0xffff,
+      num_allocated = bitmap->num_allocated,
+      i;
+
+  if (bitmap->num_containers > 0) {
+    container = &bitmap->containers[bitmap->num_containers - 1];
+    assert(container->key <= key);
+  }
+
+  if (container == NULL || container->key != key) {
+    if (bitmap->num_containers >= bitmap->num_allocated) {
+      bitmap->num_allocated = num_allocated > 0
+	? num_allocated * ENLARGE_FACTOR
+	: 1;
+      bitmap->containers = ARENA_RENEW(arena,
+				       bitmap->containers,
+				       bitmap_container_t,
+				       num_allocated,
+				       bitmap->num_allocated);
+    }
+
+    container = &bitmap->containers[bitmap->num_containers++];
+    container->key = key;
+    container->cardinality = 0;
+    container->num_allocated = 0;
+    container->values = NULL;
+    container->bits = NULL;
+  }
+
+  if (container->bits == NULL && container->cardinality >= BITMAP_ARRAY_MAX) {
+    container->bits = ARENA_NEW(arena, unsigned int, BITMAP_WORDS);
+    memset(container->bits, 0, sizeof(unsigned int) * BITMAP_WORDS);
+    for (i=0; i<container->cardinality; ++i) {
+      container->bits[container->values[i] >> 5] |=
+	1U << (container->values[i] & 31);
+    }
+    container->values = NULL;
+    container->num_allocated = 0;
+  }
+
+  if (container->bits != NULL) {
+    container->bits[low >> 5] |= 1U << (low & 31);
+  } else {
+    if (container->cardinality >= container->num_allocated) {
+      num_allocated = container->num_allocated;
+      container->num_allocated = num_allocated > 0
+	? num_allocated * ENLARGE_FACTOR
+	: 1;
+      container->values = ARENA_RENEW(arena,
+				      container->values,
+				      unsigned short,
+				      num_allocated,
+				      container->num_allocated);
+    }
+    container->values[container->cardinality] = (unsigned short)low;
+  }
+
+  container->cardinality++;
+  bitmap->cardinality++;
+}
+
+bitmap_container_t *bitmap_find_container(const bitmap_t *bitmap, int key) {
+  int low = 0,
+      high = bitmap->num_containers - 1,
+      middle;
+
+  while (low <= high) {
+    middle = (low + high) / 2;
+    if (bitmap->containers[middle].key < key) {
+      low = middle + 1;
+    } else if (bitmap->containers[middle].key > key) {
+      high = middle - 1;
+    } else {
+      return &bitmap->containers[middle];
+    }
+  }
+
+  return NULL;
+}
+
+int bitmap_container_contains(const bitmap_container_t *container, int low) {
+  int first = 0,
+      last = container->cardinality - 1,
+      middle;
+
+  if (container->bits != NULL) {
+    return (container->bits[low >> 5] >> (low & 31)) & 1;
+  }
+
+  while (first <= last) {
+    middle = (first + last) / 2;
+    if (container->values[middle] < low) {
+      first = middle + 1;
+    } else if (container->values[middle] > low) {
+      last = middle - 1;
+    } else {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* Writes the values common to all num_bitmaps bitmaps to out in increasing
+ * order and returns their count; out needs room for the smallest bitmap.
+ * Containers are matched by key.  When the smallest container of a key is
+ * an array, its values are probed in the others; when every container is
+ * a bitmap, the words are ANDed together. */
+int bitmap_intersect(bitmap_t **bitmaps, int num_bitmaps, int *out) {
+  bitmap_t *smallest = bitmaps[0];
+  bitmap_container_t **containers = NEW(bitmap_container_t *, num_bitmaps),
+                     *probe;
+  unsigned int word;
+  int num_out = 0,
+      i,
+      j,
+      k,
+      w;
+
+  for (i=1; i<num_bitmaps; ++i) {
+    if (bitmaps[i]->cardinality < smallest->cardinality) {
+      smallest = bitmaps[i];
+    }
+  }
+
+  for (i=0; i<smallest->num_containers; ++i) {
+    probe = &smallest->containers[i];
+    for (j=0; j<num_bitmaps; ++j) {
+      containers[j] = bitmap_find_container(bitmaps[j], probe->key);
+      if (containers[j] == NULL) {
+	break;
+      }
+      if (containers[j]->cardinality < probe->cardinality) {
+	probe = containers[j];
+      }
+    }
+
+    if (j < num_bitmaps) {
+      continue;
+    }
+
+    if (probe->bits == NULL) {
+      for (k=0; k<probe->cardinality; ++k) {
+	for (j=0; j<num_bitmaps; ++j) {
+	  if (containers[j] != probe &&
+	      !bitmap_container_contains(containers[j], probe->values[k])) {
+	    break;
+	  }
+	}
+
+	if (j == num_bitmaps) {
+	  out[num_out++] = (probe->key << 16) | probe->values[k];
+	}
+      }
+    } else {
+      for (w=0; w<BITMAP_WORDS; ++w) {
+	word = probe->bits[w];
+	for (j=0; j<num_bitmaps && word; ++j) {
+	  word &= containers[j]->bits[w];
+	}
+
+	for (k=0; word; ++k, word >>= 1) {
+	  if (word & 1) {
+	    out[num_out++] = (probe->key << 16) | (w << 5) | k;
+	  }
+	}
+      }
+    }
+  }
+
+  FREE(containers);
+  return num_out;
+}
+
+/*****************************************
+ * Answer Table Functions
+ *****************************************/
+#undef MEMORY_CATEGORY
+#define MEMORY_CATEGORY MEMORY_INDEXES
+
+void initialize_answer_table(answer_table_t *table) {
+  int i;
+
+  table->num_entries = 0;
+  table->num_allocated = 1;
+  table->entries = NEW(answer_entry_t *, table->num_allocated);
+
+  table->num_buckets = INITIAL_BUCKETS;
+  table->buckets = NEW(int, table->num_buckets);
+  for (i=0; i<table->num_buckets; ++i) {
+    table->buckets[i] = -1;
+  }
+
+  table->hits = table->misses = 0;
+  pthread_mutex_init(&table->lock, NULL);
+}
+
+void destroy_answer_table(answer_table_t *table) {
+  answer_table_clear(table);
+  pthread_mutex_destroy(&table->lock);
+
+  table->num_allocated = table->num_buckets = 0;
+  FREE(table->entries);
+  FREE(table->buckets);
+  table->entries = NULL;
+  table->buckets = NULL;
+}
+
+/* Drops every entry; the counters are kept. */
+void answer_table_clear(answer_table_t *table) {
+  int i;
+
+  for (i=0; i<table->num_entries; ++i) {
+    FREE(table->entries[i]->key);
+    FREE(table->entries[i]->answers);
+    FREE(table->entries[i]);
+  }
+  table->num_entries = 0;
+
+  for (i=0; i<table->num_buckets; ++i) {
+    table->buckets[i] = -1;
+  }
+}
+
+answer_entry_t *answer_table_find(answer_table_t *table,
+				  const int *key,
+				  int arity,
+				  unsigned long hash) {
+  answer_entry_t *entry;
+  int mask = table->num_buckets - 1,
+      i;
+
+  i = (int)(hash & (unsigned long)mask);
+  while (table->buckets[i] != -1) {
+    entry = table->entries[table->buckets[i]];
+    if (entry->hash == hash &&
+	memcmp(entry->key, key, sizeof(int) * arity) == 0) {
+      return entry;
+    }
+    i = (i + 1) & mask;
+  }
+
+  return NULL;
+}
+
+void answer_table_add(answer_table_t *table, answer_entry_t *entry) {
+  int mask,
+      i;
+
+  if (table->num_entries >= table->num_allocated) {
+    table->num_allocated *= ENLARGE_FACTOR;
+    table->entries = RENEW(table->entries,
+			   answer_entry_t *,
+			   table->num_allocated);
+  }
+
+  if ((table->num_entries + 1) * 2 > table->num_buckets) {
+    answer_table_rehash(table);
+  }
+
+  mask = table->num_buckets - 1;
+  i = (int)(entry->hash & (unsigned long)mask);
+  while (table->buckets[i] != -1) {
+    i = (i + 1) & mask;
+  }
+  table->buckets[i] = table->num_entries;
+  table->entries[table->num_entries++] = entry;
+}
+
+void answer_table_rehash(answer_table_t *table) {
+  int mask,
+      i,
+      j;
+
+  table->num_buckets *= ENLARGE_FACTOR;
+  table->buckets = RENEW(table->buckets, int, table->num_buckets);
+  for (i=0; i<table->num_buckets; ++i) {
+    table->buckets[i] = -1;
+  }
+
+  mask = table->num_buckets - 1;
+  for (i=0; i<table->num_entries; ++i) {
+    j = (int)(table->entries[i]->hash & (unsigned long)mask);
+    while (table->buckets[j] != -1) {
+      j = (j + 1) & mask;
+    }
+    table->buckets[j] = i;
+  }
+}
+
+unsigned long answer_table_hash(const int *key, int arity) {
+  unsigned long hash = 2166136261UL;
+  int i;
+
+  for (i=0; i<arity; ++i) {
+    hash ^= (unsigned long)(unsigned int)key[i];
+    hash = (hash * 16777619UL) & 0xffffffffUL;
+  }
+
+  return hash ^ (hash >> 15);
+}
+
+void print_answer_statistics(predicate_table_t *table) {
+  answer_table_t *answers;
+  long hits = 0,
+       misses = 0,
+       entries = 0;
+  int i;
+
+  for (i=0; i<table->num_predicates; ++i) {
+    answers = &table->predicates[i]->answers;
+    hits += answers->hits;
+    misses += answers->misses;
+    entries += answers->num_entries;
+  }
+
+  fprintf(stderr, "%% tabling: %ld hits, %ld misses, %ld tables\n",
+	  hits, misses, entries);
+}
+
+/*****************************************
+ * Machine Functions
+ *****************************************/
+#undef MEMORY_CATEGORY
+#define MEMORY_CATEGORY MEMORY_CLAUSES
+
+/* ==== Machine Clause ==== */
+void initialize_machine_clause(machine_clause_t *clause) {
+  clause->num_goals = 0;
+  clause->goals_allocated = 1;
+  clause->goals = NEW(machine_goal_t, clause->goals_allocated);
+  clause->num_variables = 0;
+  clause->num_temporaries = 0;
+  clause->num_permanents = 0;
+  clause->num_registers = 0;
+  clause->num_code = 0;
+  clause->code_allocated = 1;
+  clause->code = NEW(int, clause->code_allocated);
+  clause->position = 0;
+}
+
+void destroy_machine_clause(machine_clause_t *clause) {
+  int i;
+
+  for (i=0; i<clause->num_goals; ++i) {
+    FREE(clause->goals[i].args);
+  }
+
+  clause->num_goals = clause->goals_allocated = 0;
+  clause->num_code = clause->code_allocated = 0;
+  FREE(clause->goals);
+  FREE(clause->code);
+  clause->goals = NULL;
+  clause->code = NULL;
+}
+
+/* Appends a goal on predicate, or the missing head of a query when
+ * predicate is NULL.  The caller fills in its arguments. */
+machine_goal_t *machine_clause_add_goal(machine_clause_t *clause,
+					predicate_table_node_t *predicate) {
+  machine_goal_t *goal;
+  int arity = predicate != NULL ? predicate->arity : 0;
+
+  if (clause->num_goals >= clause->goals_allocated) {
+    clause->goals_allocated *= ENLARGE_FACTOR;
+    clause->goals = RENEW(clause->goals,
+			  machine_goal_t,
+			  clause->goals_allocated);
+  }
+
+  goal = &clause->goals[clause->num_goals++];
+  goal->predicate = predicate;
+  goal->args = NEW(int, arity + 1);
+
+  if (arity > clause->num_registers) {
+    clause->num_registers = arity;
+  }
+
+  return goal;
+}
+
+/* Compiles the goals of the clause.  The head and the first body goal
+ * form one chunk and every later goal one of its own; a variable that
+ * occurs in two chunks must survive a call, so it is permanent and gets a
+ * Y slot, and the others get X registers.  A rule only allocates an
+ * environment when its body has more than one goal, and calls its last
+ * goal with OP_EXECUTE once the environment is gone, so a recursive call
+ * in last position runs in constant space.  A query (query nonzero) keeps
+ * variable v in slot v, where its solutions are read, and ends in
+ * OP_ANSWER instead. */
+void machine_clause_compile(machine_clause_t *clause, int query) {
+  machine_goal_t *goal;
+  int *chunks = NEW(int, clause->num_variables + 1),
+      *counts = NEW(int, clause->num_variables + 1),
+      *registers = NEW(int, clause->num_variables + 1);
+  char *permanent = NEW(char, clause->num_variables + 1),
+       *seen = NEW(char, clause->num_variables + 1);
+  int environment = query || clause->num_goals > 2,
+      chunk,
+      arity,
+      arg,
+      v,
+      i,
+      j;
+
+  for (v=0; v<clause->num_variables; ++v) {
+    chunks[v] = -1;
+    counts[v] = 0;
+    permanent[v] = (char)query;
+    seen[v] = 0;
+  }
+
+  for (i=0; i<clause->num_goals; ++i) {
+    goal = &clause->goals[i];
+    chunk = i > 0 ? i - 1 : 0;
+    arity = goal->predicate != NULL ? goal->predicate->arity : 0;
+
+    for (j=0; j<arity; ++j) {
+      if (goal->args[j] >= 0) {
+	continue;
+      }
+
+      v = -1 - goal->args[j];
+      counts[v]++;
+      if (chunks[v] >= 0 && chunks[v] != chunk) {
+	permanent[v] = 1;
+      }
+      chunks[v] = chunk;
+    }
+  }
+
+  clause->num_temporaries = clause->num_permanents = 0;
+  for (v=0; v<clause->num_variables; ++v) {
+    registers[v] = permanent[v]
+      ? clause->num_permanents++
+      : clause->num_temporaries++;
+  }
+
+  clause->num_code = 0;
+  if (environment) {
+    machine_clause_emit(clause, OP_ALLOCATE, clause->num_permanents, 0);
+  }
+
+  goal = &clause->goals[0];
+  arity = goal->predicate != NULL ? goal->predicate->arity : 0;
+  for (j=0; j<arity; ++j) {
+    arg = goal->args[j];
+    if (arg >= 0) {
+      machine_clause_emit(clause, OP_GET_CONSTANT, arg, j);
+      continue;
+    }
+
+    /* A variable that occurs only here matches anything. */
+    v = -1 - arg;
+    if (counts[v] == 1) {
+      continue;
+    }
+
+    if (!seen[v]) {
+      machine_clause_emit(clause,
+			  permanent[v] ? OP_GET_VARIABLE_Y : OP_GET_VARIABLE_X,
+			  registers[v],
+			  j);
+      seen[v] = 1;
+    } else {
+      machine_clause_emit(clause,
+			  permanent[v] ? OP_GET_VALUE_Y : OP_GET_VALUE_X,
+			  registers[v],
+			  j);
+    }
+  }
+
+  for (i=1; i<clause->num_goals; ++i) {
+    goal = &clause->goals[i];
+    for (j=0; j<goal->predicate->arity; ++j) {
+      arg = goal->args[j];
+      if (arg >= 0) {
+	machine_clause_emit(clause, OP_PUT_CONSTANT, arg, j);
+	continue;
+      }
+
+      v = -1 - arg;
+      if (!seen[v]) {
+	machine_clause_emit(clause,
+			    permanent[v] ? OP_PUT_VARIABLE_Y : OP_PUT_VARIABLE_X,
+			    registers[v],
+			    j);
+	seen[v] = 1;
+      } else {
+	machine_clause_emit(clause,
+			    permanent[v] ? OP_PUT_VALUE_Y : OP_PUT_VALUE_X,
+			    registers[v],
+			    j);
+      }
+    }
+
+    if (i < clause->num_goals - 1 || query) {
+      machine_clause_emit(clause, OP_CALL, i, 0);
+    } else {
+      if (environment) {
+	machine_clause_emit(clause, OP_DEALLOCATE, 0, 0);
+      }
+      machine_clause_emit(clause, OP_EXECUTE, i, 0);
+    }
+  }
+
+  if (query) {
+    machine_clause_emit(clause, OP_ANSWER, 0, 0);
+  } else if (clause->num_goals == 1) {
+    machine_clause_emit(clause, OP_PROCEED, 0, 0);
+  }
+
+  FREE(chunks);
+  FREE(counts);
+  FREE(registers);
+  FREE(permanent);
+  FREE(seen);
+}
+
+/* Every instruction takes three ints: its opcode and two operands. */
+void machine_clause_emit(machine_clause_t *clause, int op, int a, int b) {
+  if (clause->num_code + 3 > clause->code_allocated) {
+    while (clause->num_code + 3 > clause->code_allocated) {
+      clause->code_allocated *= ENLARGE_FACTOR;
+    }
+    clause->code = RENEW(clause->code, int, clause->code_allocated);
+  }
+
+  clause->code[clause->num_code++] = op;
+  clause->code[clause->num_code++] = a;
+  clause->code[clause->num_code++] = b;
+}
+
+/* ==== Machine Switch ==== */
+#undef MEMORY_CATEGORY
+#define MEMORY_CATEGORY MEMORY_INDEXES
+
+/* The buckets are only allocated once a rule has a symbol as its first
+ * argument. */
+void initialize_machine_switch(machine_switch_t *dispatch) {
+  dispatch->num_keys = 0;
+  dispatch->num_buckets = 0;
+  dispatch->buckets = NULL;
+  dispatch->num_rules = 0;
+  dispatch->num_allocated = 0;
+  dispatch->rules = NULL;
+}
+
+void destroy_machine_switch(machine_switch_t *dispatch) {
+  int i;
+
+  for (i=0; i<dispatch->num_buckets; ++i) {
+    FREE(dispatch->buckets[i].rules);
+  }
+
+  FREE(dispatch->buckets);
+  FREE(dispatch->rules);
+  dispatch->buckets = NULL;
+  dispatch->rules = NULL;
+  dispatch->num_keys = dispatch->num_buckets = 0;
+  dispatch->num_rules = dispatch->num_allocated = 0;
+}
+
+/* Returns the bucket of key, or the empty bucket where it would go. */
+machine_switch_bucket_t *machine_switch_probe(machine_switch_t *dispatch,
+					      int key) {
+  int mask = dispatch->num_buckets - 1,
+      i;
+
+  i = (int)((((unsigned long)key ^ 2166136261UL) * 16777619UL) &
+	    (unsigned long)mask);
+  while (dispatch->buckets[i].key != -1 && dispatch->buckets[i].key != key) {
+    i = (i + 1) & mask;
+  }
+
+  return &dispatch->buckets[i];
+}
+
+/* Adds rule number rule, whose first argument is the symbol key, or a
+ * variable when key is -1. */
+void machine_switch_add(machine_switch_t *dispatch, int key, int rule) {
+  machine_switch_bucket_t *bucket;
+  int i;
+
+  if (key < 0) {
+    if (dispatch->num_rules >= dispatch->num_allocated) {
+      dispatch->num_allocated = dispatch->num_allocated > 0
+	? dispatch->num_allocated * ENLARGE_FACTOR
+	: 1;
+      dispatch->rules = RENEW(dispatch->rules, int, dispatch->num_allocated);
+    }
+    dispatch->rules[dispatch->num_rules++] = rule;
+
+    for (i=0; i<dispatch->num_buckets; ++i) {
+      if (dispatch->buckets[i].key != -1) {
+	machine_switch_bucket_add(&dispatch->buckets[i], rule);
+      }
+    }
+    return;
+  }
+
+  if ((dispatch->num_keys + 1) * 2 > dispatch->num_buckets) {
+    machine_switch_rehash(dispatch);
+  }
+
+  bucket = machine_switch_probe(dispatch, key);
+  if (bucket->key == -1) {
+    bucket->key = key;
+    bucket->num_rules = dispatch->num_rules;
+    bucket->num_allocated = dispatch->num_rules + 1;
+    bucket->rules = NEW(int, bucket->num_allocated);
+    memcpy(bucket->rules, dispatch->rules, sizeof(int) * dispatch->num_rules);
+    dispatch->num_keys++;
+  }
+
+  machine_switch_bucket_add(bucket, rule);
+}
+
+void machine_switch_rehash(machine_switch_t *dispatch) {
+  machine_switch_bucket_t *old = dispatch->buckets,
+                          *bucket;
+  int num_old = dispatch->num_buckets,
+      i;
+
+  dispatch->num_buckets = num_old > 0
+    ? num_old * ENLARGE_FACTOR
+    : INITIAL_BUCKETS;
+  dispatch->buckets = NEW(machine_switch_bucket_t, dispatch->num_buckets);
+  for (i=0; i<dispatch->num_buckets; ++i) {
+    dispatch->buckets[i].key = -1;
+    dispatch->buckets[i].num_rules = 0;
+    dispatch->buckets[i].num_allocated = 0;
+    dispatch->buckets[i].rules = NULL;
+  }
+
+  for (i=0; i<num_old; ++i) {
+    if (old[i].key != -1) {
+      bucket = machine_switch_probe(dispatch, old[i].key);
+      *bucket = old[i];
+    }
+  }
+
+  FREE(old);
+}
+
+void machine_switch_bucket_add(machine_switch_bucket_t *bucket, int rule) {
+  if (bucket->num_rules >= bucket->num_allocated) {
+    bucket->num_allocated *= ENLARGE_FACTOR;
+    bucket->rules = RENEW(bucket->rules, int, bucket->num_allocated);
+  }
+
+  bucket->rules[bucket->num_rules++] = rule;
+}
+
+/* ==== Machine ==== */
+#undef MEMORY_CATEGORY
+#define MEMORY_CATEGORY MEMORY_QUERY
+
+void initialize_machine(machine_t *machine, symbol_table_t *symbol_table) {
+  machine->symbol_table = symbol_table;
+  machine->clause = machine->continuation = NULL;
+  machine->pc = machine->continuation_pc = 0;
+  machine->env = -1;
+
+  machine->num_registers = machine->num_temporaries = 0;
+  machine->registers = machine->temporaries = NULL;
+  machine->args = NULL;
+
+  machine->num_frames = 0;
+  machine->frames_allocated = 1;
+  machine->frames = NEW(machine_frame_t, machine->frames_allocated);
+
+  machine->num_slots = machine->num_heap = 0;
+  machine->num_trail = machine->num_saved = 0;
+  machine->slots_allocated = machine->heap_allocated = 1;
+  machine->trail_allocated = machine->saved_allocated = 1;
+  machine->slots = NEW(int, machine->slots_allocated);
+  machine->heap = NEW(int, machine->heap_allocated);
+  machine->trail = NEW(int, machine->trail_allocated);
+  machine->saved = NEW(int, machine->saved_allocated);
+
+  machine->num_choicepoints = 0;
+  machine->choicepoints_allocated = 1;
+  machine->choicepoints = NEW(machine_choicepoint_t,
+			      machine->choicepoints_allocated);
+}
+
+void destroy_machine(machine_t *machine) {
+  FREE(machine->registers);
+  FREE(machine->temporaries);
+  FREE(machine->args);
+  FREE(machine->frames);
+  FREE(machine->slots);
+  FREE(machine->heap);
+  FREE(machine->trail);
+  FREE(machine->saved);
+  FREE(machine->choicepoints);
+  machine->registers = machine->temporaries = NULL;
+  machine->args = NULL;
+  machine->frames = NULL;
+  machine->slots = machine->heap = machine->trail = machine->saved = NULL;
+  machine->choicepoints = NULL;
+  machine->num_choicepoints = machine->choicepoints_allocated = 0;
+}
+
+/* Runs the code from machine->pc until the query reaches OP_ANSWER, and
+ * returns 1 then, or 0 once every alternative has failed. */
+int machine_run(machine_t *machine) {
+  machine_frame_t *frame;
+  const int *code;
+  int a,
+      b;
+
+  for (;;) {
+    code = machine->clause->code + machine->pc;
+    machine->pc += 3;
+    a = code[1];
+    b = code[2];
+
+    switch (code[0]) {
+    case OP_GET_VARIABLE_X:
+      machine->temporaries[a] = machine->registers[b];
+      continue;
+    case OP_GET_VARIABLE_Y:
+      MACHINE_SLOT(machine, a) = machine->registers[b];
+      continue;
+    case OP_GET_VALUE_X:
+      if (machine_unify(machine,
+			machine->temporaries[a],
+			machine->registers[b])) {
+	continue;
+      }
+      break;
+    case OP_GET_VALUE_Y:
+      if (machine_unify(machine,
+			MACHINE_SLOT(machine, a),
+			machine->registers[b])) {
+	continue;
+      }
+      break;
+    case OP_GET_CONSTANT:
+      if (machine_unify(machine, a, machine->registers[b])) {
+	continue;
+      }
+      break;
+    case OP_PUT_VARIABLE_X:
+      machine->temporaries[a] = machine->registers[b] =
+	machine_new_variable(machine);
+      continue;
+    case OP_PUT_VARIABLE_Y:
+      MACHINE_SLOT(machine, a) = machine->registers[b] =
+	machine_new_variable(machine);
+      continue;
+    case OP_PUT_VALUE_X:
+      machine->registers[b] = machine->temporaries[a];
+      continue;
+    case OP_PUT_VALUE_Y:
+      machine->registers[b] = MACHINE_SLOT(machine, a);
+      continue;
+    case OP_PUT_CONSTANT:
+      machine->registers[b] = a;
+      continue;
+    case OP_ALLOCATE:
+      machine_allocate(machine, a);
+      continue;
+    case OP_DEALLOCATE:
+      frame = &machine->frames[machine->env];
+      machine->continuation = frame->continuation;
+      machine->continuation_pc = frame->continuation_pc;
+      machine->env = frame->parent;
+      continue;
+    case OP_CALL:
+      machine->continuation = machine->clause;
+      machine->continuation_pc = machine->pc;
+      if (machine_call(machine, machine->clause->goals[a].predicate)) {
+	continue;
+      }
+      break;
+    case OP_EXECUTE:
+      if (machine_call(machine, machine->clause->goals[a].predicate)) {
+	continue;
+      }
+      break;
+    case OP_PROCEED:
+      machine->clause = machine->continuation;
+      machine->pc = machine->continuation_pc;
+      continue;
+    case OP_ANSWER:
+      return 1;
+    default:
+      assert(0);
+      break;
+    }
+
+    if (!machine_backtrack(machine)) {
+      return 0;
+    }
+  }
+}
+
+/* Calls predicate on the argument registers.  Returns 0 if no clause
+ * matches; otherwise the machine is left at the rule entered, or at the
+ * continuation when a fact matched. */
+int machine_call(machine_t *machine, predicate_table_node_t *predicate) {
+  machine_alternatives_t alternatives;
+  machine_switch_bucket_t *bucket;
+  int cell;
+
+  alternatives.predicate = predicate;
+  machine_select_facts(machine, &alternatives, predicate);
+
+  /* A materialized predicate's facts already hold what its rules derive. */
+  alternatives.rules = NULL;
+  alternatives.num_rules = predicate->materialized ? 0 : predicate->num_rules;
+  alternatives.rule_index = 0;
+
+  if (!predicate->materialized && predicate->dispatch.num_buckets > 0 &&
+      (cell = machine_deref(machine, machine->registers[0])) >= 0) {
+    bucket = machine_switch_probe(&predicate->dispatch, cell);
+    if (bucket->key == cell) {
+      alternatives.rules = bucket->rules;
+      alternatives.num_rules = bucket->num_rules;
+    } else {
+      alternatives.rules = predicate->dispatch.rules;
+      alternatives.num_rules = predicate->dispatch.num_rules;
+    }
+  }
+
+  return machine_resume(machine, &alternatives, 0);
+}
+
+/* Tries the alternatives of a call until one matches.  When
+ * has_choicepoint is set, the call's choicepoint is on top of the stack
+ * and its registers have been restored.  A choicepoint is pushed before
+ * trying any alternative but the last and popped before the last, so a
+ * call with one clause left to try leaves nothing to backtrack into. */
+int machine_resume(machine_t *machine,
+		   machine_alternatives_t *alternatives,
+		   int has_choicepoint) {
+  predicate_table_node_t *predicate = alternatives->predicate;
+  int base = has_choicepoint
+    ? machine->choicepoints[machine->num_choicepoints - 1].num_saved
+    : alternatives->facts_offset >= 0
+    ? alternatives->facts_offset
+    : machine->num_saved;
+  int mark = machine->num_trail,
+      kind,
+      which;
+
+  while ((kind = machine_alternatives_next(alternatives,
+					   machine,
+					   &which)) != 0) {
+    STATS_COUNT(STATS_CANDIDATES);
+    STATS_COUNT(STATS_UNIFICATIONS);
+    if (machine_alternatives_more(alternatives)) {
+      if (!has_choicepoint) {
+	machine_push_choicepoint(machine, alternatives);
+	has_choicepoint = 1;
+      } else {
+	machine->choicepoints[machine->num_choicepoints - 1].alternatives =
+	  *alternatives;
+      }
+    } else if (has_choicepoint) {
+      machine->num_choicepoints--;
+      has_choicepoint = 0;
+    }
+
+    if (kind == 1) {
+      if (!predicate->unify_registers(machine, predicate, which)) {
+	machine_undo(machine, mark);
+	continue;
+      }
+
+      machine->clause = machine->continuation;
+      machine->pc = machine->continuation_pc;
+    } else {
+      machine_enter(machine, predicate->rules[which]);
+    }
+
+    if (!has_choicepoint) {
+      machine->num_saved = base;
+    }
+    return 1;
+  }
+
+  if (has_choicepoint) {
+    machine->num_choicepoints--;
+  }
+  machine->num_saved = base;
+  return 0;
+}
+
+/* Resumes the most recent choicepoint with its next alternative.  Returns
+ * 0 if none of its alternatives match either. */
+int machine_retry(machine_t *machine) {
+  machine_choicepoint_t *choicepoint =
+    &machine->choicepoints[machine->num_choicepoints - 1];
+  machine_alternatives_t alternatives = choicepoint->alternatives;
+  int arity = alternatives.predicate->arity;
+
+  STATS_COUNT(STATS_BACKTRACKS);
+  machine_undo(machine, choicepoint->num_trail);
+  machine->num_heap = choicepoint->num_heap;
+  machine->env = choicepoint->env;
+  machine->continuation = choicepoint->continuation;
+  machine->continuation_pc = choicepoint->continuation_pc;
+  machine->num_saved = choicepoint->args + arity;
+  memcpy(machine->registers,
+	 machine->saved + choicepoint->args,
+	 sizeof(int) * arity);
+
+  return machine_resume(machine, &alternatives, 1);
+}
+
+/* Backtracks until some choicepoint yields a matching alternative.
+ * Returns 0 when they are all exhausted. */
+int machine_backtrack(machine_t *machine) {
+  do {
+    if (machine->num_choicepoints == 0) {
+      return 0;
+    }
+  } while (!machine_retry(machine));
+
+  return 1;
+}
+
+/* Takes the next alternative in clause order: the next fact, unless the
+ * next rule was loaded before it.  Stores the fact's ordinal or the
+ * rule's number in which, and returns 1 for a fact, 2 for a rule and 0
+ * when there is nothing left. */
+int machine_alternatives_next(machine_alternatives_t *alternatives,
+			      machine_t *machine,
+			      int *which) {
+  const int *facts = alternatives->facts_offset >= 0
+    ? machine->saved + alternatives->facts_offset
+    : alternatives->facts;
+  int fact = -1,
+      rule = -1;
+
+  if (alternatives->fact_index < alternatives->num_facts) {
+    fact = facts != NULL
+      ? facts[alternatives->fact_index]
+      : alternatives->fact_index;
+  }
+
+  if (alternatives->rule_index < alternatives->num_rules) {
+    rule = alternatives->rules != NULL
+      ? alternatives->rules[alternatives->rule_index]
+      : alternatives->rule_index;
+  }
+
+  if (fact >= 0 &&
+      (rule < 0 || fact < alternatives->predicate->rules[rule]->position)) {
+    alternatives->fact_index++;
+    *which = fact;
+    return 1;
+  } else if (rule >= 0) {
+    alternatives->rule_index++;
+    *which = rule;
+    return 2;
+  }
+
+  return 0;
+}
+
+int machine_alternatives_more(machine_alternatives_t *alternatives) {
+  return alternatives->fact_index < alternatives->num_facts ||
+    alternatives->rule_index < alternatives->num_rules;
+}
+
+/* Sets the facts of alternatives to those of predicate that can match
+ * the bound argument registers: the clauses of the best index on them,
+ * or else those found by scanning the fact columns, which go on the
+ * saved stack.  With nothing bound, every fact is a candidate. */
+void machine_select_facts(machine_t *machine,
+			  machine_alternatives_t *alternatives,
+			  predicate_table_node_t *predicate) {
+  predicate_index_t *index;
+  int num_bound = 0,
+      cell,
+      i;
+
+  alternatives->facts = NULL;
+  alternatives->facts_offset = -1;
+  alternatives->num_facts = predicate->num_link;
+  alternatives->fact_index = 0;
+
+  if (predicate->num_link == 0) {
+    return;
+  }
+
+  for (i=0; i<predicate->arity; ++i) {
+    cell = machine_deref(machine, machine->registers[i]);
+    machine->args[i] = cell >= 0
+      ? symbol_table_get(machine->symbol_table, cell)
+      : NULL;
+    num_bound += cell >= 0;
+  }
+
+  if (num_bound == 0) {
+    return;
+  }
+
+  index = predicate_table_node_select_index(predicate, machine->args);
+  if (index != NULL) {
+    alternatives->facts = predicate_index_lookup(index,
+						 predicate,
+						 machine->args,
+						 &alternatives->num_facts);
+  } else {
+    machine_reserve(&machine->saved,
+		    &machine->saved_allocated,
+		    machine->num_saved + predicate->num_link);
+    alternatives->facts_offset = machine->num_saved;
+    alternatives->num_facts = predicate_table_node_scan(
+	predicate,
+	machine->args,
+	machine->saved + machine->num_saved);
+    machine->num_saved += alternatives->num_facts;
+  }
+}
+
+/* Records the machine's state and the call's registers so that the call
+ * can be resumed with the rest of alternatives. */
+void machine_push_choicepoint(machine_t *machine,
+			      machine_alternatives_t *alternatives) {
+  machine_choicepoint_t *choicepoint;
+  int arity = alternatives->predicate->arity;
+
+  if (machine->num_choicepoints >= machine->choicepoints_allocated) {
+    machine->choicepoints_allocated *= ENLARGE_FACTOR;
+    machine->choicepoints = RENEW(machine->choicepoints,
+				  machine_choicepoint_t,
+				  machine->choicepoints_allocated);
+  }
+
+  choicepoint = &machine->choicepoints[machine->num_choicepoints];
+  machine_frame_top(machine, &choicepoint->num_frames, &choicepoint->num_slots);
+  choicepoint->alternatives = *alternatives;
+  choicepoint->env = machine->env;
+  choicepoint->continuation = machine->continuation;
+  choicepoint->continuation_pc = machine->continuation_pc;
+  choicepoint->num_trail = machine->num_trail;
+  choicepoint->num_heap = machine->num_heap;
+  choicepoint->num_saved = alternatives->facts_offset >= 0
+    ? alternatives->facts_offset
+    : machine->num_saved;
+
+  machine_reserve(&machine->saved,
+		  &machine->saved_allocated,
+		  machine->num_saved + arity);
+  choicepoint->args = machine->num_saved;
+  memcpy(machine->saved + machine->num_saved,
+	 machine->registers,
+	 sizeof(int) * arity);
+  machine->num_saved += arity;
+  machine->num_choicepoints++;
+}
+
+/* Starts running clause, making room for its registers. */
+void machine_enter(machine_t *machine, const machine_clause_t *clause) {
+  if (clause->num_registers > machine->num_registers) {
+    machine->num_registers = clause->num_registers;
+    machine->registers = RENEW(machine->registers,
+			       int,
+			       machine->num_registers);
+    machine->args = RENEW(machine->args,
+			  symbol_table_node_t *,
+			  machine->num_registers);
+  }
+
+  if (clause->num_temporaries > machine->num_temporaries) {
+    machine->num_temporaries = clause->num_temporaries;
+    machine->temporaries = RENEW(machine->temporaries,
+				 int,
+				 machine->num_temporaries);
+  }
+
+  machine->clause = clause;
+  machine->pc = 0;
+}
+
+/* Pushes a frame of num_slots slots for the rule being entered. */
+void machine_allocate(machine_t *machine, int num_slots) {
+  machine_frame_t *frame;
+  int top,
+      slots;
+
+  machine_frame_top(machine, &top, &slots);
+
+  if (top >= machine->frames_allocated) {
+    while (top >= machine->frames_allocated) {
+      machine->frames_allocated *= ENLARGE_FACTOR;
+    }
+    machine->frames = RENEW(machine->frames,
+			    machine_frame_t,
+			    machine->frames_allocated);
+  }
+  machine_reserve(&machine->slots, &machine->slots_allocated, slots + num_slots);
+
+  frame = &machine->frames[top];
+  frame->parent = machine->env;
+  frame->continuation = machine->continuation;
+  frame->continuation_pc = machine->continuation_pc;
+  frame->slots = slots;
+  frame->num_slots = num_slots;
+
+  machine->env = top;
+  machine->num_frames = top + 1;
+  machine->num_slots = slots + num_slots;
+}
+
+/* Finds where the next frame and its slots may go: above the current
+ * frame, and above every frame the newest choicepoint may return to. */
+void machine_frame_top(machine_t *machine, int *top, int *slots) {
+  machine_choicepoint_t *choicepoint;
+  machine_frame_t *frame;
+
+  *top = *slots = 0;
+  if (machine->env >= 0) {
+    frame = &machine->frames[machine->env];
+    *top = machine->env + 1;
+    *slots = frame->slots + frame->num_slots;
+  }
+
+  if (machine->num_choicepoints > 0) {
+    choicepoint = &machine->choicepoints[machine->num_choicepoints - 1];
+    if (choicepoint->num_frames > *top) {
+      *top = choicepoint->num_frames;
+    }
+    if (choicepoint->num_slots > *slots) {
+      *slots = choicepoint->num_slots;
+    }
+  }
+}
+
+int machine_new_variable(machine_t *machine) {
+  int cell = machine->num_heap;
+
+  machine_reserve(&machine->heap, &machine->heap_allocated, cell + 1);
+  machine->heap[machine->num_heap++] = -1 - cell;
+
+  return -1 - cell;
+}
+
+/* Follows references until a symbol or an unbound variable, which refers
+ * to itself. */
+int machine_deref(machine_t *machine, int cell) {
+  while (cell < 0 && machine->heap[-1 - cell] != cell) {
+    cell = machine->heap[-1 - cell];
+  }
+
+  return cell;
+}
+
+/* Of two unbound variables the newer one is bound to the older. */
+int machine_unify(machine_t *machine, int a, int b) {
+  a = machine_deref(machine, a);
+  b = machine_deref(machine, b);
+
+  if (a == b) {
+    return 1;
+  } else if (a < 0 && (b >= 0 || a < b)) {
+    machine_bind(machine, a, b);
+  } else if (b < 0) {
+    machine_bind(machine, b, a);
+  } else {
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Unifies cell with atom, binding it if it derefs to a free variable. */
+int machine_unify_atom(machine_t *machine, int cell, atom_t atom) {
+  cell = machine_deref(machine, cell);
+
+  if (cell >= 0) {
+    return cell == (int)atom;
+  }
+
+  machine_bind(machine, cell, (int)atom);
+  return 1;
+}
+
+/* Unify the argument registers with the atoms of the fact at ordinal of
+ * predicate, read from its columns. */
+int machine_unify_fact_1(machine_t *machine,
+			 const predicate_table_node_t *predicate,
+			 int ordinal) {
+  return machine_unify_atom(machine,
+			    machine->registers[0],
+			    predicate->columns[0][ordinal]);
+}
+
+int machine_unify_fact_2(machine_t *machine,
+			 const predicate_table_node_t *predicate,
+			 int ordinal) {
+  atom_t * const *columns = predicate->columns;
+
+  return
+    machine_unify_atom(machine, machine->registers[0], columns[0][ordinal]) &&
+    machine_unify_atom(machine, machine->registers[1], columns[1][ordinal]);
+}
+
+int machine_unify_fact_3(machine_t *machine,
+			 const predicate_table_node_t *predicate,
+			 int ordinal) {
+  atom_t * const *columns = predicate->columns;
+
+  return
+    machine_unify_atom(machine, machine->registers[0], columns[0][ordinal]) &&
+    machine_unify_atom(machine, machine->registers[1], columns[1][ordinal]) &&
+    machine_unify_atom(machine, machine->registers[2], columns[2][ordinal]);
+}
+
+int machine_unify_fact_n(machine_t *machine,
+			 const predicate_table_node_t *predicate,
+			 int ordinal) {
+  int i;
+
+  for (i=0; i<predicate->arity; ++i) {
+    if (!machine_unify_atom(machine,
+			    machine->registers[i],
+			    predicate->columns[i][ordinal])) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Only variables older than the newest choicepoint need to be trailed;
+ * backtracking discards the others anyway. */
+void machine_bind(machine_t *machine, int variable, int value) {
+  int cell = -1 - variable;
+
+  machine->heap[cell] = value;
+
+  if (machine->num_choicepoints > 0 &&
+      cell < machine->choicepoints[machine->num_choicepoints - 1].num_heap) {
+    machine_reserve(&machine->trail,
+		    &machine->trail_allocated,
+		    machine->num_trail + 1);
+    machine->trail[machine->num_trail++] = cell;
+  }
+}
+
+void machine_undo(machine_t *machine, int mark) {
+  int cell;
+
+  while (machine->num_trail > mark) {
+    cell = machine->trail[--machine->num_trail];
+    machine->heap[cell] = -1 - cell;
+  }
+}
+
+/* Grows the int array at *array to hold at least needed entries. */
+void machine_reserve(int **array, int *allocated, int needed) {
+  if (needed <= *allocated) {
+    return;
+  }
+
+  while (needed > *allocated) {
+    *allocated *= ENLARGE_FACTOR;
+  }
+  *array = RENEW(*array, int, *allocated);
+}
+
+/* Prints the clause as a rule, naming its variables A, B, ... */
+void print_machine_clause(symbol_table_t *symbol_table,
+			  const machine_clause_t *clause) {
+  machine_goal_t *goal;
+  int arg,
+      i,
+      j;
+
+  for (i=0; i<clause->num_goals; ++i) {
+    goal = &clause->goals[i];
+    printf(i == 0 ? "" : i == 1 ? " :- " : ", ");
+    printf("%s(", goal->predicate->name);
+
+    for (j=0; j<goal->predicate->arity; ++j) {
+      arg = goal->args[j];
+      if (j != 0) {
+	printf(",");
+      }
+
+      if (arg >= 0) {
+	printf("%s", symbol_table_get(symbol_table, arg)->name);
+      } else if (-1 - arg < 26) {
+	printf("%c", 'A' + (-1 - arg));
+      } else {
+	printf("%c%d", 'A' + (-1 - arg) % 26, (-1 - arg) / 26);
+      }
+    }
+    printf(")");
+  }
+  printf(".\n");
+}
+
+/*****************************************
+ * Materialize Functions
+ *****************************************/
+#undef MEMORY_CATEGORY
+#define MEMORY_CATEGORY MEMORY_QUERY
+
+/* Derives every fact the rules imply by semi-naive evaluation: each round
+ * only joins the facts new in the previous round against the others, and
+ * the evaluation stops once a round derives nothing new.  The results are
+ * added as ordinary facts and every predicate with rules is marked
+ * materialized, so queries read its facts instead of running its rules.
+ *
+ * Evaluation picks up where the last fixpoint left off: the first round's
+ * delta is the facts added since, and only rules added since are joined
+ * against every fact.  Predicates materialize_check skips are left to
+ * top-down evaluation.  Returns 0 if there are any.
+ *
+ * A derived fact is only added if it is not there yet, so queries see set
+ * semantics: --materialize implies --set, which drops duplicate base facts
+ * the same way. */
+int predicate_table_materialize(predicate_table_t *predicate_table,
+				symbol_table_t *symbol_table) {
+  materialize_t state;
+  predicate_table_node_t *predicate;
+  char *skipped;
+  int num_predicates = predicate_table->num_predicates,
+      return_value,
+      changed,
+      i,
+      j;
+
+  skipped = NEW(char, num_predicates + 1);
+  return_value = materialize_check(predicate_table, skipped);
+
+  state.symbol_table = symbol_table;
+  state.predicate_table = predicate_table;
+  state.delta_start = NEW(int, num_predicates + 1);
+  state.delta_end = NEW(int, num_predicates + 1);
+  state.num_bindings = 0;
+  state.num_depths = 0;
+  state.max_arity = 0;
+
+  for (i=0; i<num_predicates; ++i) {
+    predicate = predicate_table->predicates[i];
+    if (predicate->arity > state.max_arity) {
+      state.max_arity = predicate->arity;
+    }
+
+    for (j=0; j<predicate->num_rules; ++j) {
+      if (predicate->rules[j]->num_variables > state.num_bindings) {
+	state.num_bindings = predicate->rules[j]->num_variables;
+      }
+      if (predicate->rules[j]->num_goals > state.num_depths) {
+	state.num_depths = predicate->rules[j]->num_goals;
+      }
+    }
+  }
+
+  for (i=0; i<num_predicates; ++i) {
+    state.delta_start[i] = predicate_table->predicates[i]->fixpoint_facts;
+    state.delta_end[i] = predicate_table->predicates[i]->num_link;
+  }
+
+  state.bindings = NEW(symbol_table_node_t *, state.num_bindings + 1);
+  state.args = NEW(symbol_table_node_t *, state.max_arity + 1);
+  state.join_args = NEW(symbol_table_node_t *,
+			state.num_depths * (state.max_arity + 1) + 1);
+  state.join_fresh = NEW(int, state.num_depths * (state.max_arity + 1) + 1);
+  state.join_scratch = NEW(int *, state.num_depths + 1);
+  state.scratch_allocated = NEW(int, state.num_depths + 1);
+  for (i=0; i<state.num_depths; ++i) {
+    state.join_scratch[i] = NULL;
+    state.scratch_allocated[i] = 0;
+  }
+  state.num_pending = state.pending_allocated = 0;
+  state.pending = NULL;
+  state.num_derived = 0;
+  state.num_rounds = 0;
+
+  do {
+    materialize_reserve(&state);
+    for (i=0; i<num_predicates; ++i) {
+      predicate = predicate_table->predicates[i];
+      if (skipped[i]) {
+	continue;
+      }
+
+      for (j=0; j<predicate->num_rules; ++j) {
+	materialize_rule(&state,
+			 predicate->rules[j],
+			 state.num_rounds == 0 && j >= predicate->fixpoint_rules);
+      }
+    }
+
+    materialize_flush(&state);
+    state.num_rounds++;
+
+    changed = 0;
+    for (i=0; i<num_predicates; ++i) {
+      state.delta_start[i] = state.delta_end[i];
+      state.delta_end[i] = predicate_table->predicates[i]->num_link;
+      changed = changed || state.delta_start[i] < state.delta_end[i];
+    }
+  } while (changed);
+
+  for (i=0; i<num_predicates; ++i) {
+    predicate = predicate_table->predicates[i];
+    predicate->fixpoint_facts = predicate->num_link;
+    predicate->materialized = !skipped[i] && predicate->num_rules > 0;
+    if (!skipped[i]) {
+      predicate->fixpoint_rules = predicate->num_rules;
+    }
+  }
+
+  if (debug_output) {
+    fprintf(stderr, "%% materialized %ld facts in %d rounds\n",
+	    state.num_derived, state.num_rounds);
+  }
+
+  FREE(state.delta_start);
+  FREE(state.delta_end);
+  FREE(state.bindings);
+  FREE(state.args);
+  FREE(state.join_args);
+  FREE(state.join_fresh);
+  for (i=0; i<state.num_depths; ++i) {
+    FREE(state.join_scratch[i]);
+  }
+  FREE(state.join_scratch);
+  FREE(state.scratch_allocated);
+  FREE(state.pending);
+  FREE(skipped);
+  return return_value;
+}
+
+/* Marks in skipped, by predicate id, the predicates to leave to top-down
+ * evaluation: those with a rule that has a head variable missing from its
+ * body, which would derive facts that are not ground, and then those with
+ * a rule calling a skipped predicate.  Returns 0 if any are skipped. */
+int materialize_check(predicate_table_t *predicate_table, char *skipped) {
+  predicate_table_node_t *predicate;
+  machine_clause_t *clause;
+  machine_goal_t *goal;
+  char *seen;
+  int return_value = 1,
+      changed,
+      arg,
+      i,
+      j,
+      k,
+      p;
+
+  memset(skipped, 0, predicate_table->num_predicates);
+
+  /* ==== Unsafe Rules ==== */
+  for (p=0; p<predicate_table->num_predicates; ++p) {
+    predicate = predicate_table->predicates[p];
+    for (i=0; i<predicate->num_rules && !skipped[p]; ++i) {
+      clause = predicate->rules[i];
+      seen = NEW(char, clause->num_variables + 1);
+      memset(seen, 0, clause->num_variables + 1);
+
+      for (j=1; j<clause->num_goals; ++j) {
+	goal = &clause->goals[j];
+	for (k=0; k<goal->predicate->arity; ++k) {
+	  if (goal->args[k] < 0) {
+	    seen[-1 - goal->args[k]] = 1;
+	  }
+	}
+      }
+
+      for (k=0; k<predicate->arity; ++k) {
+	arg = clause->goals[0].args[k];
+	if (arg < 0 && !seen[-1 - arg]) {
+	  fprintf(stderr,
+		  "%s/%d: a head variable does not occur in the body, "
+		  "left to top-down evaluation\n",
+		  predicate->name,
+		  predicate->arity);
+	  skipped[p] = 1;
+	  return_value = 0;
+	  break;
+	}
+      }
+
+      FREE(seen);
+    }
+  }
+
+  /* ==== Dependents ==== */
+  do {
+    changed = 0;
+    for (p=0; p<predicate_table->num_predicates; ++p) {
+      predicate = predicate_table->predicates[p];
+      for (i=0; i<predicate->num_rules && !skipped[p]; ++i) {
+	clause = predicate->rules[i];
+	for (j=1; j<clause->num_goals; ++j) {
+	  if (skipped[clause->goals[j].predicate->id]) {
+	    skipped[p] = 1;
+	    changed = 1;
+	    break;
+	  }
+	}
+      }
+    }
+  } while (changed);
+
+  return return_value;
+}
+
+/* Grows the scan buffer of every join depth to hold all the facts of the
+ * widest predicate called at that depth.  Facts are only added between
+ * rounds, so this holds for the whole round. */
+void materialize_reserve(materialize_t *state) {
+  predicate_table_t *predicate_table = state->predicate_table;
+  machine_clause_t *clause;
+  int needed,
+      i,
+      j,
+      k;
+
+  for (i=0; i<predicate_table->num_predicates; ++i) {
+    for (j=0; j<predicate_table->predicates[i]->num_rules; ++j) {
+      clause = predicate_table->predicates[i]->rules[j];
+      for (k=1; k<clause->num_goals; ++k) {
+	needed = clause->goals[k].predicate->num_link + 1;
+	if (needed > state->scratch_allocated[k]) {
+	  FREE(state->join_scratch[k]);
+	  state->join_scratch[k] = NEW(int, needed);
+	  state->scratch_allocated[k] = needed;
+	}
+      }
+    }
+  }
+}
+
+/* Joins the body of clause once for every goal whose predicate gained
+ * facts in the previous round, with that goal reading only those, or if
+ * full is set just once against every fact, as a new rule needs. */
+void materialize_rule(materialize_t *state,
+		      machine_clause_t *clause,
+		      int full) {
+  int id,
+      k,
+      v;
+
+  for (v=0; v<clause->num_variables; ++v) {
+    state->bindings[v] = NULL;
+  }
+
+  if (full) {
+    materialize_join(state, clause, 0, 1);
+    return;
+  }
+
+  for (k=1; k<clause->num_goals; ++k) {
+    id = clause->goals[k].predicate->id;
+    if (state->delta_start[id] < state->delta_end[id]) {
+      materialize_join(state, clause, k, 1);
+    }
+  }
+}
+
+/* Matches body goal i of clause, and the goals after it, under the current
+ * bindings, and queues the head for every match.  Goal k reads only the
+ * facts new in the previous round, the goals before it only older ones
+ * and the goals after it all those known when the round began, so each
+ * combination of facts is joined once. */
+void materialize_join(materialize_t *state,
+		      machine_clause_t *clause,
+		      int k,
+		      int i) {
+  machine_goal_t *goal;
+  predicate_table_node_t *predicate;
+  predicate_index_t *index;
+  symbol_table_node_t **args,
+                      *bound;
+  const int *candidates;
+  int *fresh,
+      num_candidates,
+      num_fresh,
+      num_bound = 0,
+      lo = 0,
+      hi,
+      ordinal,
+      arg,
+      c,
+      j;
+
+  if (i == clause->num_goals) {
+    materialize_queue(state, clause);
+    return;
+  }
+
+  goal = &clause->goals[i];
+  predicate = goal->predicate;
+  hi = state->delta_end[predicate->id];
+  if (i == k) {
+    lo = state->delta_start[predicate->id];
+  } else if (i < k) {
+    hi = state->delta_start[predicate->id];
+  }
+
+  if (lo >= hi) {
+    return;
+  }
+
+  args = state->join_args + i * (state->max_arity + 1);
+  fresh = state->join_fresh + i * (state->max_arity + 1);
+  for (j=0; j<predicate->arity; ++j) {
+    arg = goal->args[j];
+    args[j] = arg >= 0
+      ? symbol_table_get(state->symbol_table, arg)
+      : state->bindings[-1 - arg];
+    num_bound += args[j] != NULL;
+  }
+
+  index = num_bound > 0
+    ? predicate_table_node_select_index(predicate, args)
+    : NULL;
+  if (index != NULL) {
+    candidates = predicate_index_lookup(index,
+					predicate,
+					args,
+					&num_candidates);
+  } else if (num_bound > 0) {
+    num_candidates = predicate_table_node_scan(predicate,
+					       args,
+					       state->join_scratch[i]);
+    candidates = state->join_scratch[i];
+  } else {
+    candidates = NULL;
+    num_candidates = hi;
+  }
+
+  for (c=candidates == NULL ? lo : 0; c<num_candidates; ++c) {
+    ordinal = candidates == NULL ? c : candidates[c];
+    if (ordinal < lo) {
+      continue;
+    } else if (ordinal >= hi) {
+      break;
+    }
+
+    num_fresh = 0;
+    for (j=0; j<predicate->arity; ++j) {
+      arg = goal->args[j];
+      bound = arg >= 0 ? args[j] : state->bindings[-1 - arg];
+      if (bound == NULL) {
+	state->bindings[-1 - arg] =
+	  state->symbol_table->symbols[predicate->columns[j][ordinal]];
+	fresh[num_fresh++] = -1 - arg;
+      } else if ((atom_t)bound->id != predicate->columns[j][ordinal]) {
+	break;
+      }
+    }
+
+    if (j == predicate->arity) {
+      materialize_join(state, clause, k, i + 1);
+    }
+
+    while (num_fresh > 0) {
+      state->bindings[fresh[--num_fresh]] = NULL;
+    }
+  }
+}
+
+/* Queues the head of clause under the current bindings. */
+void materialize_queue(materialize_t *state, machine_clause_t *clause) {
+  machine_goal_t *head = &clause->goals[0];
+  size_t needed = state->num_pending + head->predicate->arity + 1;
+  int arg,
+      j;
+
+  if (needed > state->pending_allocated) {
+    state->pending_allocated = state->pending_allocated > 0
+      ? state->pending_allocated * ENLARGE_FACTOR
+      : LOADER_CHUNK_SIZE;
+    if (state->pending_allocated < needed) {
+      state->pending_allocated = needed;
+    }
+    state->pending = RENEW(state->pending, int, state->pending_allocated);
+  }
+
+  state->pending[state->num_pending++] = head->predicate->id;
+  for (j=0; j<head->predicate->arity; ++j) {
+    arg = head->args[j];
+    state->pending[state->num_pending++] = arg >= 0
+      ? arg
+      : state->bindings[-1 - arg]->id;
+  }
+}
+
+/* Adds the queued heads that are not facts yet, in the order they were
+ * derived. */
+void materialize_flush(materialize_t *state) {
+  predicate_table_node_t *predicate;
+  size_t i = 0;
+  int j;
+
+  while (i < state->num_pending) {
+    predicate = state->predicate_table->predicates[state->pending[i++]];
+    for (j=0; j<predicate->arity; ++j) {
+      state->args[j] = symbol_table_get(state->symbol_table,
+					state->pending[i++]);
+    }
+
+    if (!predicate_table_node_contains(predicate, state->args)) {
+      rule_add_symbols(state->symbol_table, predicate, state->args);
+      state->num_derived++;
+    }
+  }
+
+  state->num_pending = 0;
+}
+
+/*****************************************
+ * Symbol Table Functions
+ *****************************************/
+
+/* ==== Symbol Table ==== */
+#undef MEMORY_CATEGORY
+#define MEMORY_CATEGORY MEMORY_ATOMS
+
+/* FNV-1a over the first length bytes of name. */
+unsigned long hash_string(const char *name, int length) {
+  unsigned long hash = 2166136261UL;
+  int i;
+
+  for (i=0; i<length; ++i) {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619UL;
+  }
+
+  return hash & 0xffffffffUL;
+}
+
+void initialize_symbol_table(symbol_table_t *table) {
+  int i;
+
+  table->num_symbols = 0;
+  table->num_allocated = 1;
+  table->symbols = NEW(symbol_table_node_t *, table->num_allocated);
+
+  table->num_buckets = INITIAL_BUCKETS;
+  table->buckets = NEW(int, table->num_buckets);
+  for (i=0; i<table->num_buckets; ++i) {
+    table->buckets[i] = -1;
+  }
+
+  initialize_arena(&table->arena, ARENA_BLOCK_SIZE);
+}
+
+/* Symbols are numbered densely in insertion order; the id doubles as the
+ * index into table->symbols.  The bucket array is an open-addressing
+ * (linear probing) table of those ids, kept at most half full. */
+void symbol_table_add(symbol_table_t *table, symbol_table_node_t *node) {
+  int mask,
+      i;
+
+  if (table->num_symbols >= table->num_allocated) {
+    symbol_table_enlarge(table);
+  }
+
+  if ((table->num_symbols + 1) * 2 > table->num_buckets) {
+    symbol_table_rehash(table);
+  }
+
+  node->id = table->num_symbols;
+  table->symbols[table->num_symbols++] = node;
+
+  mask = table->num_buckets - 1;
+  i = (int)(node->hash & (unsigned long)mask);
+  while (table->buckets[i] != -1) {
+    i = (i + 1) & mask;
+  }
+  table->buckets[i] = node->id;
+}
+
+void symbol_table_enlarge(symbol_table_t *table) {
+  table->num_allocated *= ENLARGE_FACTOR;
+  table->symbols = RENEW(table->symbols,
+			 symbol_table_node_t *,
+			 table->num_allocated);
+}
+
+void symbol_table_rehash(symbol_table_t *table) {
+  int mask,
+      i,
+      j;
+
+  table->num_buckets *= ENLARGE_FACTOR;
+  table->buckets = RENEW(table->buckets, int, table->num_buckets);
+  for (i=0; i<table->num_buckets; ++i) {
+    table->buckets[i] = -1;
+  }
+
+  mask = table->num_buckets - 1;
+  for (i=0; i<table->num_symbols; ++i) {
+    j = (int)(table->symbols[i]->hash & (unsigned long)mask);
+    while (table->buckets[j] != -1) {
+      j = (j + 1) & mask;
+    }
+    table->buckets[j] = i;
+  }
+}
+
+/* Symbols, their names and their reverse links all live in the table's
+ * arena, so they are released together. */
+void destroy_symbol_table(symbol_table_t *table) {
+  destroy_arena(&table->arena);
+
+  table->num_symbols = table->num_allocated = 0;
+  FREE(table->symbols);
+  table->symbols = NULL;
+
+  table->num_buckets = 0;
+  FREE(table->buckets);
+  table->buckets = NULL;
+}
+
+symbol_table_node_t *symbol_table_get(symbol_table_t *table, int id) {
+  if (id < 0 || id >= table->num_symbols) {
+    return NULL;
+  }
+
+  return table->symbols[id];
+}
+
+symbol_table_node_t *symbol_table_find(symbol_table_t *table,
+				       const char *name) {
+  return symbol_table_find_n(table, name, (int)strlen(name));
+}
+
+symbol_table_node_t *symbol_table_find_n(symbol_table_t *table,
+					 const char *name,
+					 int length) {
+  return symbol_table_find_hashed(table,
+				  name,
+				  length,
+				  hash_string(name, length));
+}
+
+symbol_table_node_t *symbol_table_find_hashed(symbol_table_t *table,
+					      const char *name,
+					      int length,
+					      unsigned long hash) {
+  int mask = table->num_buckets - 1,
+      i;
+  symbol_table_node_t *node;
+
+  i = (int)(hash & (unsigned long)mask);
+  while (table->buckets[i] != -1) {
+    STATS_COUNT(STATS_SYMBOL_PROBES);
+    node = table->symbols[table->buckets[i]];
+    if (node->hash == hash &&
+	node->length == length &&
+	memcmp(name, node->name, length) == 0) {
+      return node;
+    }
+    i = (i + 1) & mask;
+  }
+
+  return NULL;
+}
+
+symbol_table_node_t *symbol_table_find_or_add(symbol_table_t *table,
+					      const char *name) {
+  return symbol_table_find_or_add_n(table, name, (int)strlen(name));
+}
+
+/* Interns the first length bytes of name, which need not be terminated. */
+symbol_table_node_t *symbol_table_find_or_add_n(symbol_table_t *table,
+						const char *name,
+						int length) {
+  return symbol_table_find_or_add_hashed(table,
+					 name,
+					 length,
+					 hash_string(name, length));
+}
+
+symbol_table_node_t *symbol_table_find_or_add_hashed(symbol_table_t *table,
+						     const char *name,
+						     int length,
+						     unsigned long hash) {
+  symbol_table_node_t *node = symbol_table_find_hashed(table,
+						       name,
+						       length,
+						       hash);
+
+  STATS_COUNT(STATS_SYMBOL_LOOKUPS);
+  if (node != NULL) {
+    STATS_COUNT(STATS_SYMBOL_HITS);
+  } else {
+    node = ARENA_NEW(&table->arena, symbol_table_node_t, 1);
+    initialize_symbol_table_node_hashed(node,
+					arena_strndup(&table->arena,
+						      MEMORY_CATEGORY,
+						      name,
+						      length),
+					length,
+					hash);
+    symbol_table_add(table, node);
+  }
+
+  return node;
+}
+
+/* ==== Symbol Table Node ==== */
+#undef MEMORY_CATEGORY
+#define MEMORY_CATEGORY MEMORY_LINKS
+
+void initialize_symbol_table_node(symbol_table_node_t *node, const char *name) {
+  int length = (int)strlen(name);
+
+  initialize_symbol_table_node_hashed(node,
+				      name,
+				      length,
+				      hash_string(name, length));
+}
+
+/* For callers that already know the hash of name, such as snapshot_load. */
+void initialize_symbol_table_node_hashed(symbol_table_node_t *node,
+					 const char *name,
+					 int length,
+					 unsigned long hash) {
+  node->num_link = 0;
+  node->num_allocated = 0;
+  node->links = NULL;
+  node->num_postings = 0;
+  node->postings_allocated = 0;
+  node->postings = NULL;
+  node->name = name;
+  node->id = -1;
+  node->length = length;
+  node->hash = hash;
+}
+
+void symbol_table_node_enlarge(symbol_table_node_t *node, arena_t *arena) {
+  int num_allocated = node->num_allocated;
+
+  node->num_allocated = num_allocated > 0 ? num_allocated * ENLARGE_FACTOR : 1;
+  node->links = ARENA_RENEW(arena,
+			    node->links,
+			    symbol_table_to_predicate_t,
+			    num_allocated,
+			    node->num_allocated);
+}
+
+/* The links of a node are owned by the arena they were added with; this
+ * only resets the node. */
+void destroy_symbol_table_node(symbol_table_node_t *node) {
+  int i;
+
+  for (i=0; i<node->num_link; ++i) {
+    destroy_symbol_table_to_predicate(&node->links[i]);
+  }
+
+  node->links = NULL;
+  node->num_link = node->num_allocated = 0;
+  node->postings = NULL;
+  node->num_postings = node->postings_allocated = 0;
+  node->name = NULL;
+}
+
+void symbol_table_node_add(symbol_table_node_t *node,
+			   arena_t *arena,
+			   int pos,
+			   predicate_table_node_t *predicate,
+			   int ordinal) {
+  symbol_table_posting_t *posting;
+  int num_allocated;
+
+  if (node->num_link >= node->num_allocated) {
+    symbol_table_node_enlarge(node, arena);
+  }
+
+  initialize_symbol_table_to_predicate(&node->links[node->num_link++],
+				       pos,
+				       predicate,
+				       ordinal);
+
+  posting = symbol_table_node_find_posting(node, predicate, pos);
+  if (posting == NULL) {
+    if (node->num_postings >= node->postings_allocated) {
+      num_allocated = node->postings_allocated;
+      node->postings_allocated = num_allocated > 0
+	? num_allocated * ENLARGE_FACTOR
+	: 1;
+      node->postings = ARENA_RENEW(arena,
+				   node->postings,
+				   symbol_table_posting_t,
+				   num_allocated,
+				   node->postings_allocated);
+    }
+
+    posting = &node->postings[node->num_postings++];
+    posting->position = pos;
+    posting->predicate = predicate;
+    initialize_bitmap(&posting->clauses);
+  }
+
+  bitmap_append(&posting->clauses, arena, ordinal);
+}
+
+/* Facts of one predicate tend to arrive together, so the most recently
+ * created posting is checked first. */
+symbol_table_posting_t *symbol_table_node_find_posting(
+    symbol_table_node_t *node,
+    predicate_table_node_t *predicate,
+    int pos) {
+  symbol_table_posting_t *posting;
+  int i;
+
+  for (i=node->num_postings - 1; i>=0; --i) {
+    posting = &node->postings[i];
+    if (posting->predicate == predicate && posting->position == pos) {
+      return posting;
+    }
+  }
+
+  return NULL;
+}
+
+/* ==== Symbol Table to Predicate ==== */
+void initialize_symbol_table_to_predicate(symbol_table_to_predicate_t *link,
+					  int pos,
+					  predicate_table_node_t *predicate,
+					  int ordinal) {
+  link->predicate = predicate->id;
+  link->clause = ordinal;
+  link->position = pos;
+}
+
+void destroy_symbol_table_to_predicate(symbol_table_to_predicate_t *link) {
+  link->predicate = -1;
+  link->clause = -1;
+  link->position = 0;
+}
+
+/*****************************************
+ * Predicate Table Functions
+ *****************************************/
+
+/* ==== Predicate Table ==== */
+#undef MEMORY_CATEGORY
+#define MEMORY_CATEGORY MEMORY_CLAUSES
+
+/* Predicates are keyed by functor, so foo/1 and foo/2 are distinct. */
+unsigned long hash_functor(const char *name, int length, int arity) {
+  unsigned long hash = hash_string(name, length);
+
+  hash ^= (unsigned long)arity;
+  hash *= 16777619UL;
+
+  return hash & 0xffffffffUL;
+}
+
+void initialize_predicate_table(predicate_table_t *table) {
+  int i;
+
+  table->num_predicates = 0;
+  table->num_allocated = 1;
+  table->predicates = NEW(predicate_table_node_t *, table->num_allocated);
+
+  table->num_buckets = INITIAL_BUCKETS;
+  table->buckets = NEW(int, table->num_buckets);
+  for (i=0; i<table->num_buckets; ++i) {
+    table->buckets[i] = -1;
+  }
+
+  initialize_arena(&table->arena, ARENA_BLOCK_SIZE);
+}
+
+predicate_table_node_t *predicate_table_add(predicate_table_t *table,
+					    predicate_table_node_t *node) {
+  int mask,
+      i;
+
+  if (table->num_predicates >= table->num_allocated) {
+    predicate_table_enlarge(table);
+  }
+
+  if ((table->num_predicates + 1) * 2 > table->num_buckets) {
+    predicate_table_rehash(table);
+  }
+
+  node->id = table->num_predicates;
+  table->predicates[table->num_predicates++] = node;
+
+  mask = table->num_buckets - 1;
+  i = (int)(node->hash & (unsigned long)mask);
+  while (table->buckets[i] != -1) {
+    i = (i + 1) & mask;
+  }
+  table->buckets[i] = node->id;
+
+  return node;
+}
+
+void predicate_table_enlarge(predicate_table_t *table) {
+  table->num_allocated *= ENLARGE_FACTOR;
+  table->predicates = RENEW(table->predicates,
+			    predicate_table_node_t *,
+			    table->num_allocated);
+}
+
+void predicate_table_rehash(predicate_table_t *table) {
+  int mask,
+      i,
+      j;
+
+  table->num_buckets *= ENLARGE_FACTOR;
+  table->buckets = RENEW(table->buckets, int, table->num_buckets);
+  for (i=0; i<table->num_buckets; ++i) {
+    table->buckets[i] = -1;
+  }
+
+  mask = table->num_buckets - 1;
+  for (i=0; i<table->num_predicates; ++i) {
+    j = (int)(table->predicates[i]->hash & (unsigned long)mask);
+    while (table->buckets[j] != -1) {
+      j = (j + 1) & mask;
+    }
+    table->buckets[j] = i;
+  }
+}
+
+void destroy_predicate_table(predicate_table_t *table) {
+  int i;
+
+  for (i=0; i<table->num_predicates; ++i) {
+    destroy_predicate_table_node(table->predicates[i]);
+  }
+  destroy_arena(&table->arena);
+
+  table->num_allocated = table->num_predicates = 0;
+  FREE(table->predicates);
+  table->predicates = NULL;
+
+  table->num_buckets = 0;
+  FREE(table->buckets);
+  table->buckets = NULL;
+}
+
+predicate_table_node_t *predicate_table_find(predicate_table_t *table,
+					     const char *name,
+					     int arity) {
+  return predicate_table_find_n(table, name, (int)strlen(name), arity);
+}
+
+predicate_table_node_t *predicate_table_find_n(predicate_table_t *table,
+					       const char *name,
+					       int length,
+					       int arity) {
+  int mask = table->num_buckets - 1,
+      i;
+  unsigned long hash = hash_functor(name, length, arity);
+  predicate_table_node_t *node;
+
+  i = (int)(hash & (unsigned long)mask);
+  while (table->buckets[i] != -1) {
+    STATS_COUNT(STATS_PREDICATE_PROBES);
+    node = table->predicates[table->buckets[i]];
+    if (node->hash == hash &&
+	node->arity == arity &&
+	node->length == length &&
+	memcmp(name, node->name, length) == 0) {
+      return node;
+    }
+    i = (i + 1) & mask;
+  }
+
+  return NULL;
+}
+
+predicate_table_node_t *predicate_table_find_or_add(predicate_table_t *table,
+						    const char *name,
+						    int arity) {
+  return predicate_table_find_or_add_n(table,
+				       name,
+				       (int)strlen(name),
+				       arity);
+}
+
+predicate_table_node_t *predicate_table_find_or_add_n(predicate_table_t *table,
+						      const char *name,
+						      int length,
+						      int arity) {
+  predicate_table_node_t *node = predicate_table_find_n(table,
+							name,
+							length,
+							arity);
+
+  STATS_COUNT(STATS_PREDICATE_LOOKUPS);
+  if (node != NULL) {
+    STATS_COUNT(STATS_PREDICATE_HITS);
+  } else {
+    node = ARENA_NEW(&table->arena, predicate_table_node_t, 1);
+    initialize_predicate_table_node(node,
+				    &table->arena,
+				    arena_strndup(&table->arena,
+						  MEMORY_CATEGORY,
+						  name,
+						  length),
+				    arity);
+    predicate_table_add(table, node);
+  }
+
+  return node;
+}
+
+/* Declares an extra index from a spec of the form name/arity:p1,p2,...
+ * where the positions are 1-based argument numbers.  Returns 0 if the spec
+ * is malformed. */
+int predicate_table_add_index_spec(predicate_table_t *table,
+				   const char *spec) {
+  const char *slash = strchr(spec, '/');
+  char *name,
+       *end;
+  long arity,
+       position;
+  int *positions,
+      num_positions = 0;
+  predicate_table_node_t *node;
+  predicate_index_t *index = NULL;
+
+  if (slash == NULL || slash == spec) {
+    return 0;
+  }
+
+  arity = strtol(slash + 1, &end, 10);
+  if (end == slash + 1 || *end != ':' || arity <= 0) {
+    return 0;
+  }
+
+  positions = NEW(int, arity);
+  do {
+    position = strtol(end + 1, &end, 10);
+    if (position < 1 || position > arity || num_positions >= arity) {
+      FREE(positions);
+      return 0;
+    }
+    positions[num_positions++] = (int)position - 1;
+  } while (*end == ',');
+
+  if (*end == '\0') {
+    name = NEW(char, slash - spec + 1);
+    memcpy(name, spec, slash - spec);
+    name[slash - spec] = '\0';
+
+    node = predicate_table_find_or_add(table, name, (int)arity);
+    FREE(name);
+
+    index = predicate_table_node_add_index(node, num_positions, positions);
+  }
+
+  FREE(positions);
+  return index != NULL;
+}
+
+/* ==== Predicate Table Node ==== */
+static const int first_argument = 0;
+
+/* The node keeps a reference to the arena its indexes are allocated
+ * from; only its columns and index array live on the heap.  A fact is
+ * stored as nothing but its atoms, column by column (one array of symbol
+ * ids per argument), and is named by its ordinal, its row in them. */
+void initialize_predicate_table_node(predicate_table_node_t *node,
+				     arena_t *arena,
+				     const char *name,
+				     int arity) {
+  int i;
+
+  node->num_link = 0;
+  node->num_allocated = 1;
+  node->name = name;
+  node->arity = arity;
+  node->id = -1;
+  node->length = (int)strlen(name);
+  node->hash = hash_functor(name, node->length, arity);
+  node->num_indexes = 0;
+  node->indexes = NULL;
+  node->arena = arena;
+
+  node->columns = NEW(atom_t *, arity);
+  for (i=0; i<arity; ++i) {
+    node->columns[i] = NEW(atom_t, node->num_allocated);
+  }
+
+  initialize_answer_table(&node->answers);
+
+  node->num_rules = node->rules_allocated = 0;
+  node->rules = NULL;
+  initialize_machine_switch(&node->dispatch);
+  node->materialized = 0;
+  node->fixpoint_facts = node->fixpoint_rules = 0;
+  node->tuples = NULL;
+  predicate_table_node_select_unify(node);
+
+  if (arity > 0) {
+    predicate_table_node_add_index(node, 1, &first_argument);
+  }
+}
+
+/* Nearly every fact is a relation of one to three arguments, which get
+ * the unrolled kernels; any other arity gets the loop. */
+void predicate_table_node_select_unify(predicate_table_node_t *node) {
+  switch (node->arity) {
+  case 1:
+    node->unify_goal = solve_unify_fact_1;
+    node->unify_registers = machine_unify_fact_1;
+    break;
+  case 2:
+    node->unify_goal = solve_unify_fact_2;
+    node->unify_registers = machine_unify_fact_2;
+    break;
+  case 3:
+    node->unify_goal = solve_unify_fact_3;
+    node->unify_registers = machine_unify_fact_3;
+    break;
+  default:
+    node->unify_goal = solve_unify_fact_n;
+    node->unify_registers = machine_unify_fact_n;
+    break;
+  }
+}
+
+/* Adds a fact and returns its ordinal. */
+int predicate_table_node_add(predicate_table_node_t *node,
+			     int arity,
+			     symbol_table_node_t **nodes) {
+  int ordinal = predicate_table_node_append(node, arity, nodes),
+      i;
+
+  for (i=0; i<node->num_indexes; ++i) {
+    predicate_index_add(node->indexes[i], node, ordinal);
+  }
+
+  return ordinal;
+}
+
+/* Adds a clause without updating the node's indexes; used when they are
+ * restored wholesale, as from a snapshot.  A fact is nothing but its row
+ * in the columns, so its ordinal is all that identifies it. */
+int predicate_table_node_append(predicate_table_node_t *node,
+				int arity,
+				symbol_table_node_t **nodes) {
+  int i;
+
+  assert(arity == node->arity);
+
+  if (node->num_link >= node->num_allocated) {
+    predicate_table_node_enlarge(node);
+  }
+
+  for (i=0; i<arity; ++i) {
+    node->columns[i][node->num_link] = (atom_t)nodes[i]->id;
+  }
+
+  if (node->answers.num_entries > 0) {
+    answer_table_clear(&node->answers);
+  }
+
+  return node->num_link++;
+}
+
+void predicate_table_node_enlarge(predicate_table_node_t *node) {
+  int i;
+
+  node->num_allocated *= ENLARGE_FACTOR;
+
+  for (i=0; i<node->arity; ++i) {
+    node->columns[i] = RENEW(node->columns[i], atom_t, node->num_allocated);
+  }
+}
+
+/* Adds a compiled rule for node, which takes its place in clause order
+ * after the facts loaded so far. */
+void predicate_table_node_add_rule(predicate_table_node_t *node,
+				   machine_clause_t *clause) {
+  int key = -1;
+
+  if (node->num_rules >= node->rules_allocated) {
+    node->rules_allocated = node->rules_allocated > 0
+      ? node->rules_allocated * ENLARGE_FACTOR
+      : 1;
+    node->rules = RENEW(node->rules, machine_clause_t *, node->rules_allocated);
+  }
+
+  if (node->arity > 0 && clause->goals[0].args[0] >= 0) {
+    key = clause->goals[0].args[0];
+  }
+
+  clause->position = node->num_link;
+  node->materialized = 0;
+  machine_switch_add(&node->dispatch, key, node->num_rules);
+  node->rules[node->num_rules++] = clause;
+}
+
+/* Index entries belong to the node's arena; only the arrays that grow by
+ * reallocation, and the rules, are freed here. */
+void destroy_predicate_table_node(predicate_table_node_t *node) {
+  int i;
+
+  node->num_link = node->num_allocated = 0;
+
+  for (i=0; i<node->arity; ++i) {
+    FREE(node->columns[i]);
+  }
+  FREE(node->columns);
+  node->columns = NULL;
+
+  for (i=0; i<node->num_indexes; ++i) {
+    destroy_predicate_index(node->indexes[i]);
+  }
+
+  node->num_indexes = 0;
+  FREE(node->indexes);
+  node->indexes = NULL;
+
+  destroy_answer_table(&node->answers);
+
+  for (i=0; i<node->num_rules; ++i) {
+    destroy_machine_clause(node->rules[i]);
+    FREE(node->rules[i]);
+  }
+
+  node->num_rules = node->rules_allocated = 0;
+  FREE(node->rules);
+  node->rules = NULL;
+  destroy_machine_switch(&node->dispatch);
+}
+
+/* Indexes the clauses of node on the arguments at positions (0-based), in
+ * addition to the default first-argument index.  Clauses already present
+ * are indexed immediately; later ones as predicate_table_node_add sees them. */
+predicate_index_t *predicate_table_node_add_index(predicate_table_node_t *node,
+						  int num_positions,
+						  const int *positions) {
+  predicate_index_t *index;
+  int i;
+
+  for (i=0; i<num_positions; ++i) {
+    if (positions[i] < 0 || positions[i] >= node->arity) {
+      return NULL;
+    }
+  }
+
+  index = predicate_table_node_find_index(node, num_positions, positions);
+  if (index != NULL) {
+    return index;
+  }
+
+  index = ARENA_NEW(node->arena, predicate_index_t, 1);
+  initialize_predicate_index(index, node->arena, num_positions, positions);
+
+  for (i=0; i<node->num_link; ++i) {
+    predicate_index_add(index, node, i);
+  }
+
+  node->indexes = RENEW(node->indexes,
+			predicate_index_t *,
+			node->num_indexes + 1);
+  node->indexes[node->num_indexes++] = index;
+
+  return index;
+}
+
+predicate_index_t *predicate_table_node_find_index(predicate_table_node_t *node,
+						   int num_positions,
+						   const int *positions) {
+  predicate_index_t *index;
+  int i;
+
+  for (i=0; i<node->num_indexes; ++i) {
+    index = node->indexes[i];
+    if (index->num_positions == num_positions &&
+	memcmp(index->positions, positions, sizeof(int) * num_positions) == 0) {
+      return index;
+    }
+  }
+
+  return NULL;
+}
+
+/* Picks the index covering the most arguments that are bound in args (one
+ * symbol per argument, NULL when unbound), or NULL if none applies. */
+predicate_index_t *predicate_table_node_select_index(
+    predicate_table_node_t *node,
+    symbol_table_node_t **args) {
+  predicate_index_t *index,
+                    *best = NULL;
+  int i,
+      j;
+
+  for (i=0; i<node->num_indexes; ++i) {
+    index = node->indexes[i];
+    for (j=0; j<index->num_positions; ++j) {
+      if (args[index->positions[j]] == NULL) {
+	break;
+      }
+    }
+
+    if (j == index->num_positions &&
+	(best == NULL || index->num_positions > best->num_positions)) {
+      best = index;
+    }
+  }
+
+  return best;
+}
+
+/* Returns the index on every argument of node, creating it if need be.
+ * Its keys are whole facts, so one probe tells whether a fact is there. */
+predicate_index_t *predicate_table_node_tuple_index(
+    predicate_table_node_t *node) {
+  int *positions;
+  int i;
+
+  if (node->tuples == NULL && node->arity > 0) {
+    positions = NEW(int, node->arity);
+    for (i=0; i<node->arity; ++i) {
+      positions[i] = i;
+    }
+
+    node->tuples = predicate_table_node_add_index(node,
+						  node->arity,
+						  positions);
+    FREE(positions);
+  }
+
+  return node->tuples;
+}
+
+int predicate_table_node_contains(predicate_table_node_t *node,
+				  symbol_table_node_t **args) {
+  predicate_index_t *index = predicate_table_node_tuple_index(node);
+  int num_clauses;
+
+  if (index == NULL) {
+    return node->num_link > 0;
+  }
+
+  predicate_index_lookup(index, node, args, &num_clauses);
+  return num_clauses > 0;
+}
+
+/* ==== Predicate Columns ==== */
+
+/* Stores in ordinals the clauses of node whose arguments equal the bound
+ * entries of args (NULL entries are unconstrained) and returns how many
+ * there are.  ordinals must have room for node->num_link entries. */
+int predicate_table_node_scan(predicate_table_node_t *node,
+			      symbol_table_node_t **args,
+			      int *ordinals) {
+  const atom_t **columns = NEW(const atom_t *, node->arity);
+  atom_t *keys = NEW(atom_t, node->arity);
+  int num_keys = 0,
+      num_ordinals,
+      i;
+
+  for (i=0; i<node->arity; ++i) {
+    if (args[i] != NULL) {
+      columns[num_keys] = node->columns[i];
+      keys[num_keys++] = (atom_t)args[i]->id;
+    }
+  }
+
+  num_ordinals = column_filter(columns,
+			       keys,
+			       num_keys,
+			       node->num_link,
+			       ordinals);
+
+  FREE(columns);
+  FREE(keys);
+  return num_ordinals;
+}
+
+/* Writes to out the row numbers below num_rows at which every one of the
+ * num_keys columns holds its key, in increasing order, and returns their
+ * count.  Rows are compared eight (AVX2) or four (SSE2) at a time, with a
+ * scalar loop for the remainder and for builds without either. */
+int column_filter(const atom_t **columns,
+		  const atom_t *keys,
+		  int num_keys,
+		  int num_rows,
+		  int *out) {
+  int num_out = 0,
+      row = 0,
+      mask,
+      bit,
+      k;
+
+#if defined(__AVX2__)
+  __m256i values;
+
+  for (; row + 8 <= num_rows; row += 8) {
+    mask = 0xff;
+    for (k=0; k<num_keys && mask; ++k) {
+      values = _mm256_loadu_si256((const __m256i *)(columns[k] + row));
+      values = _mm256_cmpeq_epi32(values, _mm256_set1_epi32((int)keys[k]));
+      mask &= _mm256_movemask_ps(_mm256_castsi256_ps(values));
+    }
+
+    for (bit=0; mask; ++bit, mask >>= 1) {
+      if (mask & 1) {
+	out[num_out++] = row + bit;
+      }
+    }
+  }
+#elif defined(__SSE2__)
+  __m128i values;
+
+  for (; row + 4 <= num_rows; row += 4) {
+    mask = 0xf;
+    for (k=0; k<num_keys && mask; ++k) {
+      values = _mm_loadu_si128((const __m128i *)(columns[k] + row));
+      values = _mm_cmpeq_epi32(values, _mm_set1_epi32((int)keys[k]));
+      mask &= _mm_movemask_ps(_mm_castsi128_ps(values));
+    }
+
+    for (bit=0; mask; ++bit, mask >>= 1) {
+      if (mask & 1) {
+	out[num_out++] = row + bit;
+      }
+    }
+  }
+#endif
+
+  for (; row < num_rows; ++row) {
+    mask = 1;
+    for (k=0; k<num_keys && mask; ++k) {
+      mask = columns[k][row] == keys[k];
+    }
+
+    if (mask) {
+      out[num_out++] = row;
+    }
+  }
+
+  (void)bit;
+  return num_out;
+}
+
+/* ==== Predicate Index ==== */
+#undef MEMORY_CATEGORY
+#define MEMORY_CATEGORY MEMORY_INDEXES
+
+void initialize_predicate_index(predicate_index_t *index,
+				arena_t *arena,
+				int num_positions,
+				const int *positions) {
+  int i;
+
+  index->num_positions = num_positions;
+  index->positions = ARENA_NEW(arena, int, num_positions);
+  for (i=0; i<num_positions; ++i) {
+    index->positions[i] = positions[i];
+  }
+
+  index->num_keys = 0;
+  index->num_buckets = INITIAL_BUCKETS;
+  index->buckets = NEW(predicate_index_bucket_t, index->num_buckets);
+  for (i=0; i<index->num_buckets; ++i) {
+    index->buckets[i].num_clauses = 0;
+  }
+}
+
+/* Bucket clause lists and positions are arena memory; only the bucket
+ * array itself, which is rebuilt on every rehash, is on the heap. */
+void destroy_predicate_index(predicate_index_t *index) {
+  FREE(index->buckets);
+  index->buckets = NULL;
+  index->positions = NULL;
+  index->num_buckets = index->num_keys = index->num_positions = 0;
+}
+
+/* Hashes the key of a call, read from the ids of args, or when args is
+ * NULL that of the clause at ordinal, read from the columns of node. */
+unsigned long predicate_index_hash(predicate_index_t *index,
+				   symbol_table_node_t **args,
+				   const predicate_table_node_t *node,
+				   int ordinal) {
+  unsigned long hash = 2166136261UL;
+  int i;
+
+  for (i=0; i<index->num_positions; ++i) {
+    hash ^= (unsigned long)INDEX_KEY(args,
+				     node->columns,
+				     ordinal,
+				     index->positions[i]);
+    hash = (hash * 16777619UL) & 0xffffffffUL;
+  }
+
+  return hash ^ (hash >> 15);
+}
+
+/* Returns the bucket holding the key of args (or of the clause at ordinal,
+ * as for predicate_index_hash), or the empty bucket where it would be
+ * inserted. */
+predicate_index_bucket_t *predicate_index_probe(predicate_index_t *index,
+						predicate_table_node_t *node,
+						symbol_table_node_t **args,
+						int ordinal,
+						unsigned long hash) {
+  predicate_index_bucket_t *bucket;
+  int mask = index->num_buckets - 1,
+      pos,
+      i,
+      j;
+
+  i = (int)(hash & (unsigned long)mask);
+  for (;;) {
+    bucket = &index->buckets[i];
+    if (bucket->num_clauses == 0) {
+      return bucket;
+    }
+
+    if (bucket->hash == hash) {
+      for (j=0; j<index->num_positions; ++j) {
+	pos = index->positions[j];
+	if (node->columns[pos][bucket->clauses[0]]
+	    != INDEX_KEY(args, node->columns, ordinal, pos)) {
+	  break;
+	}
+      }
+
+      if (j == index->num_positions) {
+	return bucket;
+      }
+    }
+
+    i = (i + 1) & mask;
+  }
+}
+
+void predicate_index_add(predicate_index_t *index,
+			 predicate_table_node_t *node,
+			 int ordinal) {
+  unsigned long hash = predicate_index_hash(index, NULL, node, ordinal);
+  predicate_index_bucket_t *bucket;
+
+  bucket = predicate_index_probe(index, node, NULL, ordinal, hash);
+  if (bucket->num_clauses == 0) {
+    if ((index->num_keys + 1) * 2 > index->num_buckets) {
+      predicate_index_rehash(index);
+      bucket = predicate_index_probe(index, node, NULL, ordinal, hash);
+    }
+
+    bucket->hash = hash;
+    bucket->num_allocated = 1;
+    bucket->clauses = ARENA_NEW(node->arena, int, bucket->num_allocated);
+    index->num_keys++;
+  } else if (bucket->num_clauses >= bucket->num_allocated) {
+    bucket->num_allocated *= ENLARGE_FACTOR;
+    bucket->clauses = ARENA_RENEW(node->arena,
+				  bucket->clauses,
+				  int,
+				  bucket->num_clauses,
+				  bucket->num_allocated);
+  }
+
+  bucket->clauses[bucket->num_clauses++] = ordinal;
+}
+
+void predicate_index_rehash(predicate_index_t *index) {
+  predicate_index_bucket_t *old = index->buckets;
+  int num_old = index->num_buckets,
+      mask,
+      i,
+      j;
+
+  index->num_buckets *= ENLARGE_FACTOR;
+  index->buckets = NEW(predicate_index_bucket_t, index->num_buckets);
+  for (i=0; i<index->num_buckets; ++i) {
+    index->buckets[i].num_clauses = 0;
+  }
+
+  mask = index->num_buckets - 1;
+  for (i=0; i<num_old; ++i) {
+    if (old[i].num_clauses == 0) {
+      continue;
+    }
+
+    j = (int)(old[i].hash & (unsigned long)mask);
+    while (index->buckets[j].num_clauses != 0) {
+      j = (j + 1) & mask;
+    }
+    index->buckets[j] = old[i];
+  }
+
+  FREE(old);
+}
+
+/* Returns the ordinals of the clauses matching args on every indexed
+ * position, in clause order, and stores their count in num_clauses. */
+const int *predicate_index_lookup(predicate_index_t *index,
+				  predicate_table_node_t *node,
+				  symbol_table_node_t **args,
+				  int *num_clauses) {
+  predicate_index_bucket_t *bucket;
+
+  bucket = predicate_index_probe(index,
+				 node,
+				 args,
+				 -1,
+				 predicate_index_hash(index, args, node, -1));
+  *num_clauses = bucket->num_clauses;
+  return bucket->num_clauses > 0 ? bucket->clauses : NULL;
+}
+
+/*****************************************
+ * Solve Functions
+ *****************************************/
+#undef MEMORY_CATEGORY
+#define MEMORY_CATEGORY MEMORY_QUERY
+
+void initialize_solve(solve_t *solve, solve_variable_table_t *variables) {
+  solve->num_goals = 0;
+  solve->num_allocated = 1;
+  solve->variables = variables;
+  solve->goals = NEW(solve_goal_t *, solve->num_allocated);
+  solve->states = NEW(solve_goal_state_t *, solve->num_allocated);
+  solve->depth = -1;
+
+  solve->num_trail = 0;
+  solve->trail_allocated = 1;
+  solve->trail = NEW(int, solve->trail_allocated);
+
+  solve->num_choicepoints = 0;
+  solve->choicepoints_allocated = 1;
+  solve->choicepoints = NEW(int, solve->choicepoints_allocated);
+
+  solve->output = stdout;
+  solve->worker = NULL;
+  solve->symbol_table = NULL;
+  solve->limit = -1;
+}
+
+void solve_add(solve_t *solve, solve_goal_t *goal) {
+  solve_goal_state_t *state = NEW(solve_goal_state_t, 1);
+
+  assert(state != NULL);
+  initialize_solve_goal_state(state, goal);
+
+  if (solve->num_goals >= solve->num_allocated) {
+    solve_enlarge(solve);
+  }
+
+  solve->goals[solve->num_goals] = goal;
+  solve->states[solve->num_goals] = state;
+  solve->num_goals++;
+}
+
+void solve_enlarge(solve_t *solve) {
+  solve->num_allocated *= ENLARGE_FACTOR;
+  solve->goals = RENEW(solve->goals,
+		       solve_goal_t *,
+		       solve->num_allocated);
+  solve->states = RENEW(solve->states,
+			solve_goal_state_t *,
+			solve->num_allocated);
+}
+
+void destroy_solve(solve_t *solve) {
+  int i;
+
+  for (i=0; i<solve->num_goals; ++i) {
+    destroy_solve_goal(solve->goals[i]);
+    FREE(solve->goals[i]);
+    destroy_solve_goal_state(solve->states[i]);
+    FREE(solve->states[i]);
+  }
+
+  solve->num_goals = solve->num_allocated = 0;
+  FREE(solve->goals);
+  FREE(solve->states);
+  FREE(solve->trail);
+  FREE(solve->choicepoints);
+  solve->goals = NULL;
+  solve->states = NULL;
+  solve->trail = solve->choicepoints = NULL;
+  solve->variables = NULL;
+}
+
+void solve_bind(solve_t *solve,
+		solve_condition_t *variable,
+		symbol_table_node_t *symbol) {
+  if (solve->num_trail >= solve->trail_allocated) {
+    solve->trail_allocated *= ENLARGE_FACTOR;
+    solve->trail = RENEW(solve->trail, int, solve->trail_allocated);
+  }
+
+  solve->variables->bindings[variable->index] = symbol;
+  solve->trail[solve->num_trail++] = variable->index;
+}
+
+/* Unbinds every variable bound since the trail was mark entries high. */
+void solve_undo(solve_t *solve, int mark) {
+  symbol_table_node_t **bindings = solve->variables->bindings;
+
+  while (solve->num_trail > mark) {
+    bindings[solve->trail[--solve->num_trail]] = NULL;
+  }
+}
+
+void solve_push_choicepoint(solve_t *solve, int depth) {
+  if (solve->num_choicepoints >= solve->choicepoints_allocated) {
+    solve->choicepoints_allocated *= ENLARGE_FACTOR;
+    solve->choicepoints = RENEW(solve->choicepoints,
+				int,
+				solve->choicepoints_allocated);
+  }
+
+  solve->choicepoints[solve->num_choicepoints++] = depth;
+}
+
+/* Resumes the most recent goal with untried candidates, discarding the
+ * bindings made since it last succeeded.  Returns 0 once none are left. */
+int solve_backtrack(solve_t *solve) {
+  if (solve->num_choicepoints == 0) {
+    solve->depth = solve->num_goals + 1;
+    return 0;
+  }
+
+  STATS_COUNT(STATS_BACKTRACKS);
+  solve->depth = solve->choicepoints[--solve->num_choicepoints];
+  solve_undo(solve, solve->states[solve->depth]->trail_mark);
+  return 1;
+}
+
+/* Searches for the next solution of the conjunction, leaving it in
+ * solve->variables->bindings.  Returns 0 when there are no more.  Goals
+ * are driven iteratively: a choicepoint is only pushed for a goal that
+ * still has candidates left after the one that matched, so deterministic
+ * goals leave nothing to backtrack into. */
+int solve_next(solve_t *solve) {
+  if (solve->depth > solve->num_goals) {
+    return 0;
+  } else if (solve->depth < 0) {
+    solve->depth = 0;
+    if (solve->num_goals > 0) {
+      solve_goal_state_begin(solve, solve->states[0]);
+    }
+  } else if (!solve_backtrack(solve)) {
+    return 0;
+  }
+
+  return solve_run(solve);
+}
+
+/* Drives the goals from solve->depth, whose state is ready to be tried,
+ * until all of them hold or nothing is left to backtrack into.  A worker
+ * of a parallel search offers each goal's candidates to idle workers as
+ * it starts it, and gives up if the search has been stopped. */
+int solve_run(solve_t *solve) {
+  solve_goal_state_t *state;
+
+  while (solve->depth < solve->num_goals) {
+    state = solve->states[solve->depth];
+
+    if (solve->worker != NULL && solve_worker_stopped(solve->worker)) {
+      return 0;
+    }
+
+    if (!solve_goal_state_next(solve, state)) {
+      if (!solve_backtrack(solve)) {
+	return 0;
+      }
+      continue;
+    }
+
+    if (state->candidate_index < state->num_candidates) {
+      solve_push_choicepoint(solve, solve->depth);
+    }
+
+    if (++solve->depth < solve->num_goals) {
+      solve_goal_state_begin(solve, solve->states[solve->depth]);
+      if (solve->worker != NULL) {
+	solve_worker_split(solve->worker, solve->states[solve->depth]);
+      }
+    }
+  }
+
+  return 1;
+}
+
+/* Returns how many solutions of the query are wanted, or -1 for all of
+ * them.  A query without variables only needs the first. */
+int solve_limit(solve_t *solve) {
+  if ((first_solution_only || solve->variables->num_variables == 0) &&
+      solve->limit != 0) {
+    return 1;
+  }
+
+  return solve->limit;
+}
+
+/* ==== Solve Cursor ==== */
+
+/* Opens a cursor on solve.  The goals are planned, or compiled for the
+ * rule machine if they call rules that have not been materialized; no
+ * solution is searched for until solve_cursor_next.  Variables bound
+ * beforehand are parameters and are compiled as constants. */
+void solve_cursor_open(solve_cursor_t *cursor, solve_t *solve) {
+  solve_variable_table_t *variables = solve->variables;
+  solve_condition_t *condition;
+  solve_subgoal_t *subgoal;
+  machine_goal_t *goal;
+  int i,
+      j;
+
+  cursor->solve = solve;
+  cursor->query = NULL;
+  cursor->machine = NULL;
+  cursor->parameters = NULL;
+  cursor->limit = solve_limit(solve);
+  cursor->num_solutions = 0;
+  cursor->done = cursor->limit == 0;
+
+  if (solve->symbol_table == NULL || !solve_has_rules(solve)) {
+    if (solve->num_goals > 1) {
+      solve_plan(solve);
+    }
+    return;
+  }
+
+  cursor->parameters = NEW(symbol_table_node_t *, variables->num_variables + 1);
+  memcpy(cursor->parameters,
+	 variables->bindings,
+	 sizeof(symbol_table_node_t *) * variables->num_variables);
+
+  /* The goals are kept in source order, as a rule body's would be. */
+  cursor->query = NEW(machine_clause_t, 1);
+  initialize_machine_clause(cursor->query);
+  machine_clause_add_goal(cursor->query, NULL);
+  for (i=0; i<solve->num_goals; ++i) {
+    goal = machine_clause_add_goal(cursor->query, solve->goals[i]->predicate);
+    for (j=0; j<solve->goals[i]->num_subgoals; ++j) {
+      subgoal = solve->goals[i]->subgoals[j];
+      condition = subgoal->condition;
+      if (condition->type == CONSTANT) {
+	goal->args[subgoal->pos] = condition->symbol->id;
+      } else if (cursor->parameters[condition->index] != NULL) {
+	goal->args[subgoal->pos] = cursor->parameters[condition->index]->id;
+      } else {
+	goal->args[subgoal->pos] = -1 - condition->index;
+      }
+    }
+  }
+  cursor->query->num_variables = variables->num_variables;
+  machine_clause_compile(cursor->query, 1);
+
+  cursor->machine = NEW(machine_t, 1);
+  initialize_machine(cursor->machine, solve->symbol_table);
+  machine_enter(cursor->machine, cursor->query);
+}
+
+/* Searches for the cursor's next solution and binds the query's variables
+ * to it; a variable a rule leaves unbound is bound to NULL.  Returns 0
+ * once the solutions or the limit are used up. */
+int solve_cursor_next(solve_cursor_t *cursor) {
+  solve_t *solve = cursor->solve;
+  machine_t *machine = cursor->machine;
+  int cell,
+      i;
+
+  if (cursor->done) {
+    return 0;
+  }
+
+  if (machine == NULL) {
+    cursor->done = !solve_next(solve);
+  } else if (cursor->num_solutions == 0) {
+    cursor->done = !machine_run(machine);
+  } else {
+    cursor->done = !machine_backtrack(machine) || !machine_run(machine);
+  }
+
+  if (cursor->done) {
+    return 0;
+  }
+
+  if (machine != NULL) {
+    for (i=0; i<solve->variables->num_variables; ++i) {
+      if (cursor->parameters[i] != NULL) {
+	continue;
+      }
+
+      cell = machine_deref(machine, machine->slots[i]);
+      solve->variables->bindings[i] = cell >= 0
+	? symbol_table_get(solve->symbol_table, cell)
+	: NULL;
+    }
+  }
+
+  cursor->done = ++cursor->num_solutions == cursor->limit;
+  return 1;
+}
+
+/* Abandons whatever is left of the search.  The variables bound by it are
+ * unbound again and solve can be opened again. */
+void solve_cursor_close(solve_cursor_t *cursor) {
+  solve_t *solve = cursor->solve;
+
+  if (cursor->machine != NULL) {
+    destroy_machine(cursor->machine);
+    destroy_machine_clause(cursor->query);
+    FREE(cursor->machine);
+    FREE(cursor->query);
+    memcpy(solve->variables->bindings,
+	   cursor->parameters,
+	   sizeof(symbol_table_node_t *) * solve->variables->num_variables);
+    FREE(cursor->parameters);
+  } else {
+    solve_undo(solve, 0);
+    solve->num_choicepoints = 0;
+    solve->depth = -1;
+  }
+
+  cursor->machine = NULL;
+  cursor->query = NULL;
+  cursor->parameters = NULL;
+  cursor->done = 1;
+}
+
+/* ==== Parallel Solve ==== */
+
+/* Searches the alternatives of the query on num_or_workers threads, the
+ * calling one included.  Solutions are printed as they are found, so their
+ * order differs from a serial run. */
+void execute_solve_parallel(solve_t *solve) {
+  solve_parallel_t parallel;
+  solve_worker_t *workers;
+  solve_task_t *task;
+  pthread_t *threads;
+  int *started,
+      i;
+
+  parallel.solve = solve;
+  parallel.num_workers = num_or_workers;
+  parallel.limit = solve_limit(solve);
+  parallel.stop = 0;
+  parallel.pending = 0;
+  parallel.num_queued = 0;
+  parallel.num_solutions = 0;
+  pthread_mutex_init(&parallel.lock, NULL);
+  pthread_cond_init(&parallel.work, NULL);
+
+  parallel.deques = NEW(solve_deque_t, parallel.num_workers);
+  workers = NEW(solve_worker_t, parallel.num_workers);
+  threads = NEW(pthread_t, parallel.num_workers);
+  started = NEW(int, parallel.num_workers);
+  for (i=0; i<parallel.num_workers; ++i) {
+    parallel.deques[i].head = parallel.deques[i].num_tasks = 0;
+    parallel.deques[i].num_allocated = 1;
+    parallel.deques[i].tasks = NEW(solve_task_t *, 1);
+    pthread_mutex_init(&parallel.deques[i].lock, NULL);
+    initialize_solve_worker(&workers[i], &parallel, i);
+  }
+
+  task = NEW(solve_task_t, 1);
+  task->depth = 0;
+  task->candidate_index = -1;
+  task->num_candidates = 0;
+  task->candidates = NULL;
+  task->bindings = NULL;
+  solve_parallel_push(&parallel, 0, task);
+
+  for (i=1; i<parallel.num_workers; ++i) {
+    started[i] = pthread_create(&threads[i],
+				NULL,
+				solve_worker_run,
+				&workers[i]) == 0;
+  }
+  solve_worker_run(&workers[0]);
+
+  for (i=1; i<parallel.num_workers; ++i) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    }
+  }
+
+  if (solve->variables->num_variables == 0) {
+    fputs(parallel.num_solutions > 0 ? "true.\n" : "false.\n",
+	  solve->output);
+  } else if (parallel.num_solutions == 0) {
+    fprintf(solve->output, "false.\n");
+  }
+
+  /* A stopped search can leave tasks behind. */
+  for (i=0; i<parallel.num_workers; ++i) {
+    while ((task = solve_deque_pop(&parallel.deques[i], 0)) != NULL) {
+      destroy_solve_task(task);
+      FREE(task);
+    }
+
+    FREE(parallel.deques[i].tasks);
+    pthread_mutex_destroy(&parallel.deques[i].lock);
+    destroy_solve_worker(&workers[i]);
+  }
+
+  pthread_mutex_destroy(&parallel.lock);
+  pthread_cond_destroy(&parallel.work);
+  FREE(parallel.deques);
+  FREE(workers);
+  FREE(threads);
+  FREE(started);
+}
+
+void initialize_solve_worker(solve_worker_t *worker,
+			     solve_parallel_t *parallel,
+			     int id) {
+  solve_t *solve = parallel->solve;
+  int i;
+
+  worker->parallel = parallel;
+  worker->id = id;
+  worker->num_steps = 0;
+
+  worker->variables.num_variables = solve->variables->num_variables;
+  worker->variables.num_allocated = solve->variables->num_variables;
+  worker->variables.conditions = solve->variables->conditions;
+  worker->variables.bindings = NEW(symbol_table_node_t *,
+				   worker->variables.num_variables + 1);
+
+  initialize_solve(&worker->solve, &worker->variables);
+  worker->solve.symbol_table = solve->symbol_table;
+  worker->solve.output = solve->output;
+  worker->solve.worker = worker;
+  for (i=0; i<solve->num_goals; ++i) {
+    solve_add(&worker->solve, solve->goals[i]);
+  }
+}
+
+/* The goals and conditions belong to the query; only the worker's states,
+ * bindings and stacks are freed. */
+void destroy_solve_worker(solve_worker_t *worker) {
+  solve_t *solve = &worker->solve;
+  int i;
+
+  for (i=0; i<solve->num_goals; ++i) {
+    destroy_solve_goal_state(solve->states[i]);
+    FREE(solve->states[i]);
+  }
+
+  FREE(solve->goals);
+  FREE(solve->states);
+  FREE(solve->trail);
+  FREE(solve->choicepoints);
+  FREE(worker->variables.bindings);
+  solve->goals = NULL;
+  solve->states = NULL;
+  solve->trail = solve->choicepoints = NULL;
+  worker->variables.bindings = NULL;
+}
+
+void *solve_worker_run(void *data) {
+  solve_worker_t *worker = (solve_worker_t *)data;
+  solve_parallel_t *parallel = worker->parallel;
+  solve_task_t *task;
+
+  while ((task = solve_parallel_take(parallel, worker->id)) != NULL) {
+    solve_worker_task(worker, task);
+    destroy_solve_task(task);
+    FREE(task);
+
+    pthread_mutex_lock(&parallel->lock);
+    if (--parallel->pending == 0) {
+      pthread_cond_broadcast(&parallel->work);
+    }
+    pthread_mutex_unlock(&parallel->lock);
+  }
+
+  return NULL;
+}
+
+/* Runs one branch to exhaustion, starting from the task's bindings with
+ * an empty trail, so backtracking never goes above task->depth. */
+void solve_worker_task(solve_worker_t *worker, solve_task_t *task) {
+  solve_t *solve = &worker->solve;
+  solve_goal_state_t *state = solve->states[task->depth];
+  int i;
+
+  for (i=0; i<worker->variables.num_variables; ++i) {
+    worker->variables.bindings[i] = task->bindings != NULL
+      ? task->bindings[i]
+      : NULL;
+  }
+
+  solve->num_trail = 0;
+  solve->num_choicepoints = 0;
+  solve->depth = task->depth;
+
+  if (task->candidate_index < 0) {
+    solve_goal_state_begin(solve, state);
+  } else {
+    state->candidate = -1;
+    state->candidates = task->candidates;
+    state->candidate_index = task->candidate_index;
+    state->num_candidates = task->num_candidates;
+    state->trail_mark = 0;
+    state->ground = 0;
+  }
+  solve_worker_split(worker, state);
+
+  if (solve_run(solve)) {
+    while (solve_worker_solution(worker) && solve_next(solve)) {
+    }
+  }
+
+  /* The state may still point at the task's candidates. */
+  for (i=task->depth; i<solve->num_goals; ++i) {
+    solve->states[i]->candidates = NULL;
+    solve->states[i]->num_candidates = 0;
+  }
+}
+
+/* Moves the back half of the state's untried candidates, with the current
+ * bindings, into a new task, unless the worker still has one queued. */
+void solve_worker_split(solve_worker_t *worker, solve_goal_state_t *state) {
+  solve_deque_t *deque = &worker->parallel->deques[worker->id];
+  solve_task_t *task;
+  int remaining = state->num_candidates - state->candidate_index,
+      first,
+      empty,
+      i;
+
+  if (remaining < 2) {
+    return;
+  }
+
+  pthread_mutex_lock(&deque->lock);
+  empty = deque->head == deque->num_tasks;
+  pthread_mutex_unlock(&deque->lock);
+  if (!empty) {
+    return;
+  }
+
+  first = state->num_candidates - remaining / 2;
+
+  task = NEW(solve_task_t, 1);
+  task->depth = worker->solve.depth;
+  task->bindings = NEW(symbol_table_node_t *,
+		       worker->variables.num_variables + 1);
+  memcpy(task->bindings,
+	 worker->variables.bindings,
+	 sizeof(symbol_table_node_t *) * worker->variables.num_variables);
+
+  if (state->candidates == NULL) {
+    task->candidates = NULL;
+    task->candidate_index = first;
+    task->num_candidates = state->num_candidates;
+  } else {
+    task->candidates = NEW(int, state->num_candidates - first);
+    for (i=first; i<state->num_candidates; ++i) {
+      task->candidates[i - first] = state->candidates[i];
+    }
+    task->candidate_index = 0;
+    task->num_candidates = state->num_candidates - first;
+  }
+
+  state->num_candidates = first;
+  solve_parallel_push(worker->parallel, worker->id, task);
+}
+
+/* Prints the solution the worker just found.  Returns 0 if the search
+ * should stop. */
+int solve_worker_solution(solve_worker_t *worker) {
+  solve_parallel_t *parallel = worker->parallel;
+  int return_value;
+
+  pthread_mutex_lock(&parallel->lock);
+  return_value = !parallel->stop;
+  if (return_value) {
+    parallel->num_solutions++;
+    if (worker->variables.num_variables > 0) {
+      print_solve_solution(&worker->solve);
+    }
+
+    if (parallel->num_solutions == parallel->limit) {
+      parallel->stop = 1;
+      return_value = 0;
+      pthread_cond_broadcast(&parallel->work);
+    }
+  }
+  pthread_mutex_unlock(&parallel->lock);
+
+  return return_value;
+}
+
+/* Checked every SOLVE_STOP_INTERVAL steps, to keep the lock off the
+ * search loop. */
+int solve_worker_stopped(solve_worker_t *worker) {
+  int stop;
+
+  if (++worker->num_steps < SOLVE_STOP_INTERVAL) {
+    return 0;
+  }
+
+  worker->num_steps = 0;
+  pthread_mutex_lock(&worker->parallel->lock);
+  stop = worker->parallel->stop;
+  pthread_mutex_unlock(&worker->parallel->lock);
+
+  return stop;
+}
+
+void solve_parallel_push(solve_parallel_t *parallel,
+			 int id,
+			 solve_task_t *task) {
+  solve_deque_t *deque = &parallel->deques[id];
+
+  pthread_mutex_lock(&parallel->lock);
+  parallel->pending++;
+  pthread_mutex_unlock(&parallel->lock);
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->num_tasks >= deque->num_allocated) {
+    if (deque->head > 0) {
+      memmove(deque->tasks,
+	      deque->tasks + deque->head,
+	      sizeof(solve_task_t *) * (deque->num_tasks - deque->head));
+      deque->num_tasks -= deque->head;
+      deque->head = 0;
+    } else {
+      deque->num_allocated *= ENLARGE_FACTOR;
+      deque->tasks = RENEW(deque->tasks,
+			   solve_task_t *,
+			   deque->num_allocated);
+    }
+  }
+  deque->tasks[deque->num_tasks++] = task;
+  pthread_mutex_unlock(&deque->lock);
+
+  pthread_mutex_lock(&parallel->lock);
+  parallel->num_queued++;
+  pthread_cond_signal(&parallel->work);
+  pthread_mutex_unlock(&parallel->lock);
+}
+
+/* Returns the next task for worker id: its own newest, else the oldest
+ * one of another worker.  Waits while others are still busy, and returns
+ * NULL once every task is finished or the search has been stopped. */
+solve_task_t *solve_parallel_take(solve_parallel_t *parallel, int id) {
+  solve_task_t *task;
+  int i;
+
+  for (;;) {
+    pthread_mutex_lock(&parallel->lock);
+    while (!parallel->stop && parallel->pending > 0 &&
+	   parallel->num_queued <= 0) {
+      pthread_cond_wait(&parallel->work, &parallel->lock);
+    }
+
+    if (parallel->stop || parallel->pending == 0) {
+      pthread_mutex_unlock(&parallel->lock);
+      return NULL;
+    }
+    pthread_mutex_unlock(&parallel->lock);
+
+    task = solve_deque_pop(&parallel->deques[id], 1);
+    for (i=1; task==NULL && i<parallel->num_workers; ++i) {
+      task = solve_deque_pop(&parallel->deques[(id + i) %
+					       parallel->num_workers],
+			     0);
+    }
+
+    if (task != NULL) {
+      pthread_mutex_lock(&parallel->lock);
+      parallel->num_queued--;
+      pthread_mutex_unlock(&parallel->lock);
+      return task;
+    }
+  }
+}
+
+/* Takes a task from the back of the deque if own, else from the front. */
+solve_task_t *solve_deque_pop(solve_deque_t *deque, int own) {
+  solve_task_t *task = NULL;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->head < deque->num_tasks) {
+    task = own
+      ? deque->tasks[--deque->num_tasks]
+      : deque->tasks[deque->head++];
+    if (deque->head == deque->num_tasks) {
+      deque->head = deque->num_tasks = 0;
+    }
+  }
+  pthread_mutex_unlock(&deque->lock);
+
+  return task;
+}
+
+void destroy_solve_task(solve_task_t *task) {
+  FREE(task->candidates);
+  FREE(task->bindings);
+  task->candidates = NULL;
+  task->bindings = NULL;
+}
+
+/* Reorders the goals so that cheap, selective ones run first.  Goals are
+ * picked greedily by their estimated number of matching clauses, given the
+ * variables bound by the goals already placed; ties keep source order. */
+void solve_plan(solve_t *solve) {
+  solve_goal_t **goals = NEW(solve_goal_t *, solve->num_goals);
+  solve_goal_state_t **states = NEW(solve_goal_state_t *, solve->num_goals);
+  double *estimates = NEW(double, solve->num_goals),
+         estimate;
+  char *bound = NEW(char, solve->variables->num_variables + 1),
+       *placed = NEW(char, solve->num_goals);
+  solve_goal_t *goal;
+  solve_condition_t *condition;
+  int best,
+      i,
+      j;
+
+  for (i=0; i<solve->variables->num_variables; ++i) {
+    bound[i] = solve->variables->bindings[i] != NULL;
+  }
+  memset(placed, 0, solve->num_goals);
+
+  for (i=0; i<solve->num_goals; ++i) {
+    best = -1;
+    for (j=0; j<solve->num_goals; ++j) {
+      if (placed[j]) {
+	continue;
+      }
+
+      estimate = solve_goal_estimate(solve->goals[j], bound);
+      if (best < 0 || estimate < estimates[i]) {
+	best = j;
+	estimates[i] = estimate;
+      }
+    }
+
+    placed[best] = 1;
+    goals[i] = goal = solve->goals[best];
+    states[i] = solve->states[best];
+
+    for (j=0; j<goal->num_subgoals; ++j) {
+      condition = goal->subgoals[j]->condition;
+      if (condition->type == VARIABLE) {
+	bound[condition->index] = 1;
+      }
+    }
+  }
+
+  memcpy(solve->goals, goals, sizeof(solve_goal_t *) * solve->num_goals);
+  memcpy(solve->states,
+	 states,
+	 sizeof(solve_goal_state_t *) * solve->num_goals);
+
+  if (debug_output) {
+    print_solve_plan(solve, estimates);
+  }
+
+  FREE(goals);
+  FREE(states);
+  FREE(estimates);
+  FREE(bound);
+  FREE(placed);
+}
+
+/* Estimates how many clauses of goal's predicate match once the variables
+ * flagged in bound have values.  A constant can match at most as many
+ * clauses as it has reverse links; a bound variable is assumed to pick one
+ * key of a single-argument index on its position, or a fixed fraction of
+ * the clauses when there is no such index to count distinct keys. */
+double solve_goal_estimate(solve_goal_t *goal, const char *bound) {
+  predicate_table_node_t *predicate = goal->predicate;
+  predicate_index_t *index;
+  solve_condition_t *condition;
+  double estimate = predicate->num_link,
+         clauses = predicate->num_link;
+  int pos,
+      i;
+
+  if (clauses == 0) {
+    return 0;
+  }
+
+  for (i=0; i<goal->num_subgoals; ++i) {
+    condition = goal->subgoals[i]->condition;
+    pos = goal->subgoals[i]->pos;
+
+    if (condition->type == CONSTANT) {
+      if (condition->symbol->num_link < clauses) {
+	estimate *= condition->symbol->num_link / clauses;
+      }
+    } else if (bound[condition->index]) {
+      index = predicate_table_node_find_index(predicate, 1, &pos);
+      if (index != NULL && index->num_keys > 0) {
+	estimate /= index->num_keys;
+      } else {
+	estimate /= BOUND_VARIABLE_SELECTIVITY;
+      }
+    }
+  }
+
+  return estimate;
+}
+
+void initialize_solve_goal_state(solve_goal_state_t *state,
+				 solve_goal_t *goal) {
+  state->goal = goal;
+  state->subgoal_index = 0;
+  state->candidate = -1;
+  state->candidate_index = 0;
+  state->num_candidates = 0;
+  state->candidates = NULL;
+  state->trail_mark = 0;
+  state->args = NULL;
+  state->num_allocated = 0;
+  state->scratch = NULL;
+  state->key = NULL;
+  state->ground = 0;
+}
+
+/* Prepares state to enumerate the clauses that can match its goal under
+ * the current bindings.  An index on exactly the bound arguments is used
+ * when there is one, and the posting bitmaps of the bound symbols are
+ * intersected when several arguments are bound.  With one bound argument
+ * and no index on it, the reverse links of its symbol are followed when
+ * they are much shorter than the clause list and the fact columns are
+ * scanned when not. */
+void solve_goal_state_begin(solve_t *solve, solve_goal_state_t *state) {
+  solve_goal_t *goal = state->goal;
+  predicate_table_node_t *predicate = goal->predicate;
+  predicate_index_t *index;
+  solve_condition_t *condition;
+  symbol_table_node_t *symbol,
+                      *rarest = NULL;
+  symbol_table_to_predicate_t *link;
+  int rarest_pos = 0,
+      num_bound = 0,
+      tabled,
+      i;
+
+  if (state->args == NULL && predicate->arity > 0) {
+    state->args = NEW(symbol_table_node_t *, predicate->arity);
+  }
+
+  for (i=0; i<goal->num_subgoals; ++i) {
+    condition = goal->subgoals[i]->condition;
+    if (condition->type == CONSTANT) {
+      symbol = condition->symbol;
+    } else {
+      symbol = solve->variables->bindings[condition->index];
+    }
+
+    state->args[goal->subgoals[i]->pos] = symbol;
+    num_bound += symbol != NULL;
+    if (symbol != NULL &&
+	(rarest == NULL || symbol->num_link < rarest->num_link)) {
+      rarest = symbol;
+      rarest_pos = goal->subgoals[i]->pos;
+    }
+  }
+
+  state->candidate = -1;
+  state->candidate_index = 0;
+  state->trail_mark = solve->num_trail;
+  state->ground = 0;
+
+  tabled = tabling && solve_goal_state_key(state);
+  if (tabled && solve_goal_state_lookup(state)) {
+    return;
+  }
+
+  index = predicate->arity > 0
+    ? predicate_table_node_select_index(predicate, state->args)
+    : NULL;
+
+  if (index != NULL && index->num_positions == num_bound) {
+    state->candidates = predicate_index_lookup(index,
+					       predicate,
+					       state->args,
+					       &state->num_candidates);
+    state->ground = num_bound == predicate->arity;
+  } else if (num_bound > 1) {
+    solve_goal_state_intersect(state);
+  } else if (index != NULL) {
+    state->candidates = predicate_index_lookup(index,
+					       predicate,
+					       state->args,
+					       &state->num_candidates);
+  } else if (rarest != NULL &&
+	     rarest->num_link < predicate->num_link / SCAN_RATIO) {
+    if (state->num_allocated < rarest->num_link) {
+      state->num_allocated = rarest->num_link;
+      state->scratch = RENEW(state->scratch, int, state->num_allocated);
+    }
+
+    state->num_candidates = 0;
+    for (i=0; i<rarest->num_link; ++i) {
+      link = &rarest->links[i];
+      if (link->predicate == predicate->id && link->position == rarest_pos) {
+	state->scratch[state->num_candidates++] = link->clause;
+      }
+    }
+    state->candidates = state->scratch;
+  } else if (rarest != NULL) {
+    if (state->num_allocated < predicate->num_link) {
+      state->num_allocated = predicate->num_link;
+      state->scratch = RENEW(state->scratch, int, state->num_allocated);
+    }
+
+    state->num_candidates = predicate_table_node_scan(predicate,
+						      state->args,
+						      state->scratch);
+    state->candidates = state->scratch;
+  } else {
+    state->candidates = NULL;
+    state->num_candidates = predicate->num_link;
+  }
+
+  if (tabled) {
+    solve_goal_state_store(state);
+  }
+}
+
+/* Builds the answer table key of the goal, as it is called now, into
+ * state->key.  Returns 0 for a call with nothing bound and no repeated
+ * variable, which every clause answers anyway. */
+int solve_goal_state_key(solve_goal_state_t *state) {
+  solve_goal_t *goal = state->goal;
+  solve_condition_t *condition;
+  int arity = goal->predicate->arity,
+      useful = 0,
+      pos,
+      i,
+      j;
+
+  if (arity == 0) {
+    return 0;
+  }
+
+  if (state->key == NULL) {
+    state->key = NEW(int, arity);
+  }
+
+  for (i=0; i<goal->num_subgoals; ++i) {
+    pos = goal->subgoals[i]->pos;
+    if (state->args[pos] != NULL) {
+      state->key[pos] = state->args[pos]->id;
+      useful = 1;
+      continue;
+    }
+
+    condition = goal->subgoals[i]->condition;
+    state->key[pos] = -1 - pos;
+    for (j=0; j<i; ++j) {
+      if (goal->subgoals[j]->condition == condition) {
+	state->key[pos] = state->key[goal->subgoals[j]->pos];
+	useful = 1;
+	break;
+      }
+    }
+  }
+
+  return useful;
+}
+
+/* Serves the call from the predicate's answer table if it has been made
+ * before.  Returns 0 on a miss. */
+int solve_goal_state_lookup(solve_goal_state_t *state) {
+  predicate_table_node_t *predicate = state->goal->predicate;
+  answer_table_t *table = &predicate->answers;
+  answer_entry_t *entry;
+
+  pthread_mutex_lock(&table->lock);
+  entry = answer_table_find(table,
+			    state->key,
+			    predicate->arity,
+			    answer_table_hash(state->key, predicate->arity));
+  if (entry != NULL) {
+    table->hits++;
+    state->candidates = entry->answers;
+    state->num_candidates = entry->num_answers;
+  } else {
+    table->misses++;
+  }
+  pthread_mutex_unlock(&table->lock);
+
+  return entry != NULL;
+}
+
+/* Narrows the candidates down to the clauses that really answer the call,
+ * in clause order, and records them in the answer table. */
+void solve_goal_state_store(solve_goal_state_t *state) {
+  predicate_table_node_t *predicate = state->goal->predicate;
+  answer_table_t *table = &predicate->answers;
+  answer_entry_t *entry = NEW(answer_entry_t, 1),
+                 *existing;
+  atom_t **columns = predicate->columns;
+  int arity = predicate->arity,
+      ordinal,
+      code,
+      i,
+      j;
+
+  entry->key = NEW(int, arity);
+  memcpy(entry->key, state->key, sizeof(int) * arity);
+  entry->hash = answer_table_hash(entry->key, arity);
+  entry->num_answers = 0;
+  entry->answers = NEW(int, state->num_candidates + 1);
+
+  for (i=0; i<state->num_candidates; ++i) {
+    ordinal = state->candidates == NULL ? i : state->candidates[i];
+    for (j=0; j<arity; ++j) {
+      code = entry->key[j];
+      if (code >= 0
+	  ? columns[j][ordinal] != (atom_t)code
+	  : -1 - code != j &&
+	    columns[j][ordinal] != columns[-1 - code][ordinal]) {
+	break;
+      }
+    }
+
+    if (j == arity) {
+      entry->answers[entry->num_answers++] = ordinal;
+    }
+  }
+  entry->answers = RENEW(entry->answers, int, entry->num_answers + 1);
+
+  pthread_mutex_lock(&table->lock);
+  existing = answer_table_find(table, entry->key, arity, entry->hash);
+  if (existing == NULL) {
+    answer_table_add(table, entry);
+  }
+  pthread_mutex_unlock(&table->lock);
+
+  if (existing != NULL) {
+    FREE(entry->key);
+    FREE(entry->answers);
+    FREE(entry);
+    entry = existing;
+  }
+
+  state->candidates = entry->answers;
+  state->num_candidates = entry->num_answers;
+}
+
+/* Sets the candidates of state to the clauses whose bound arguments all
+ * match, by intersecting the posting bitmaps of the bound symbols. */
+void solve_goal_state_intersect(solve_goal_state_t *state) {
+  predicate_table_node_t *predicate = state->goal->predicate;
+  bitmap_t **bitmaps = NEW(bitmap_t *, predicate->arity);
+  symbol_table_posting_t *posting;
+  int num_bitmaps = 0,
+      smallest = predicate->num_link,
+      i;
+
+  state->num_candidates = 0;
+  state->candidates = NULL;
+
+  for (i=0; i<predicate->arity; ++i) {
+    if (state->args[i] == NULL) {
+      continue;
+    }
+
+    posting = symbol_table_node_find_posting(state->args[i], predicate, i);
+    if (posting == NULL) {
+      FREE(bitmaps);
+      return;
+    }
+
+    bitmaps[num_bitmaps++] = &posting->clauses;
+    if (posting->clauses.cardinality < smallest) {
+      smallest = posting->clauses.cardinality;
+    }
+  }
+
+  if (state->num_allocated < smallest) {
+    state->num_allocated = smallest;
+    state->scratch = RENEW(state->scratch, int, state->num_allocated);
+  }
+
+  state->num_candidates = bitmap_intersect(bitmaps,
+					   num_bitmaps,
+					   state->scratch);
+  state->candidates = state->scratch;
+  FREE(bitmaps);
+}
+
+/* Tries the remaining candidates of state in order and stops at the first
+ * clause that unifies with the goal, binding its free variables. */
+int solve_goal_state_next(solve_t *solve, solve_goal_state_t *state) {
+  solve_goal_t *goal = state->goal;
+  int ordinal;
+
+  while (state->candidate_index < state->num_candidates) {
+    ordinal = state->candidates == NULL
+      ? state->candidate_index
+      : state->candidates[state->candidate_index];
+    state->candidate_index++;
+    STATS_COUNT(STATS_CANDIDATES);
+
+    if (state->ground) {
+      state->candidate = ordinal;
+      return 1;
+    }
+
+    STATS_COUNT(STATS_UNIFICATIONS);
+    if (goal->predicate->unify_goal(solve, goal, ordinal)) {
+      state->candidate = ordinal;
+      return 1;
+    }
+
+    solve_undo(solve, state->trail_mark);
+  }
+
+  state->candidate = -1;
+  return 0;
+}
+
+/* ==== Solve Unify ==== */
+
+/* Unifies the argument condition with atom, binding it if it is a free
+ * variable.  A variable bound by an earlier argument of the same fact is
+ * compared like a constant, so repeated variables need no special case. */
+int solve_unify_atom(solve_t *solve,
+		     solve_condition_t *condition,
+		     atom_t atom) {
+  symbol_table_node_t *bound;
+
+  if (condition->type == CONSTANT) {
+    return (atom_t)condition->symbol->id == atom;
+  }
+
+  bound = solve->variables->bindings[condition->index];
+  if (bound == NULL) {
+    solve_bind(solve, condition, solve->symbol_table->symbols[atom]);
+    return 1;
+  }
+
+  return (atom_t)bound->id == atom;
+}
+
+/* The subgoals of a goal are its arguments in order, so the kernels pair
+ * them by position with the atoms of the fact at ordinal, read from the
+ * columns of the goal's predicate. */
+int solve_unify_fact_1(solve_t *solve, solve_goal_t *goal, int ordinal) {
+  return solve_unify_atom(solve,
+			  goal->subgoals[0]->condition,
+			  goal->predicate->columns[0][ordinal]);
+}
+
+int solve_unify_fact_2(solve_t *solve, solve_goal_t *goal, int ordinal) {
+  atom_t * const *columns = goal->predicate->columns;
+
+  return
+    solve_unify_atom(solve, goal->subgoals[0]->condition, columns[0][ordinal]) &&
+    solve_unify_atom(solve, goal->subgoals[1]->condition, columns[1][ordinal]);
+}
+
+int solve_unify_fact_3(solve_t *solve, solve_goal_t *goal, int ordinal) {
+  atom_t * const *columns = goal->predicate->columns;
+
+  return
+    solve_unify_atom(solve, goal->subgoals[0]->condition, columns[0][ordinal]) &&
+    solve_unify_atom(solve, goal->subgoals[1]->condition, columns[1][ordinal]) &&
+    solve_unify_atom(solve, goal->subgoals[2]->condition, columns[2][ordinal]);
+}
+
+int solve_unify_fact_n(solve_t *solve, solve_goal_t *goal, int ordinal) {
+  solve_subgoal_t *subgoal;
+  int i;
+
+  for (i=0; i<goal->num_subgoals; ++i) {
+    subgoal = goal->subgoals[i];
+    if (!solve_unify_atom(solve,
+			  subgoal->condition,
+			  goal->predicate->columns[subgoal->pos][ordinal])) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+void destroy_solve_goal_state(solve_goal_state_t *state) {
+  FREE(state->args);
+  FREE(state->scratch);
+  FREE(state->key);
+  state->args = NULL;
+  state->scratch = NULL;
+  state->key = NULL;
+  state->candidates = NULL;
+  state->num_candidates = state->num_allocated = 0;
+  state->goal = NULL;
+}
+
+void initialize_solve_goal(solve_goal_t *goal,
+			   predicate_table_node_t *predicate) {
+  goal->predicate = predicate;
   goal->num_subgoals = 0;
   goal->num_allocated = 1;
   goal->subgoals = NEW(solve_subgoal_t *, goal->num_allocated);
 }
 
+void destroy_solve_goal(solve_goal_t *goal) {
+  int i;
+
+  for (i=0; i<goal->num_subgoals; ++i) {
+    if (goal->subgoals[i]->condition->type == CONSTANT) {
+      FREE(goal->subgoals[i]->condition);
+    }
+    FREE(goal->subgoals[i]);
+  }
+
+  goal->num_subgoals = goal->num_allocated = 0;
+  FREE(goal->subgoals);
+  goal->subgoals = NULL;
+  goal->predicate = NULL;
+}
+
 void solve_goal_enlarge(solve_goal_t *goal) {
   goal->num_allocated *= ENLARGE_FACTOR;
   goal->subgoals = RENEW(goal->subgoals,
@@ -452,7 +5998,7 @@ void solve_goal_add(solve_goal_t *goal, solve_subgoal_t *subgoal) {
     solve_goal_enlarge(goal);
   }
 
-  goal->subgoals[goal->num_subgoals] = subgoal;
+  goal->subgoals[goal->num_subgoals++] = subgoal;
 }
 
 void initialize_solve_subgoal(solve_subgoal_t *subgoal,
@@ -464,20 +6010,25 @@ void initialize_solve_subgoal(solve_subgoal_t *subgoal,
 
 void initialize_solve_condition_constant(solve_condition_t *condition,
 					 symbol_table_node_t *symbol) {
+  condition->name = symbol->name;
   condition->type = CONSTANT;
   condition->symbol = symbol;
+  condition->index = -1;
 }
 
 void initialize_solve_condition_variable(solve_condition_t *condition,
 					 symbol_table_node_t *symbol) {
+  condition->name = symbol->name;
   condition->type = VARIABLE;
   condition->symbol = symbol;
+  condition->index = -1;
 }
 
 void initialize_solve_variable_table(solve_variable_table_t *table) {
   table->num_variables = 0;
   table->num_allocated = 1;
   table->conditions = NEW(solve_condition_t *, table->num_allocated);
+  table->bindings = NEW(symbol_table_node_t *, table->num_allocated);
 }
 
 void solve_variable_table_add(solve_variable_table_t *table,
@@ -486,6 +6037,8 @@ void solve_variable_table_add(solve_variable_table_t *table,
     solve_variable_table_enlarge(table);
   }
 
+  condition->index = table->num_variables;
+  table->bindings[table->num_variables] = NULL;
   table->conditions[table->num_variables++] = condition;
 }
 
@@ -494,16 +6047,43 @@ void solve_variable_table_enlarge(solve_variable_table_t *table) {
   table->conditions = RENEW(table->conditions,
 			    solve_condition_t *,
 			    table->num_allocated);
+  table->bindings = RENEW(table->bindings,
+			  symbol_table_node_t *,
+			  table->num_allocated);
+}
+
+void destroy_solve_variable_table(solve_variable_table_t *table) {
+  int i;
+
+  for (i=0; i<table->num_variables; ++i) {
+    FREE((char *)table->conditions[i]->symbol->name);
+    destroy_symbol_table_node(table->conditions[i]->symbol);
+    FREE(table->conditions[i]->symbol);
+    FREE(table->conditions[i]);
+  }
+
+  table->num_variables = table->num_allocated = 0;
+  FREE(table->conditions);
+  FREE(table->bindings);
+  table->conditions = NULL;
+  table->bindings = NULL;
 }
 
 solve_condition_t *solve_variable_table_find(solve_variable_table_t *table,
 					     const char *name) {
+  return solve_variable_table_find_n(table, name, (int)strlen(name));
+}
+
+solve_condition_t *solve_variable_table_find_n(solve_variable_table_t *table,
+					       const char *name,
+					       int length) {
   int i;
   solve_condition_t *condition;
 
   for (i=0; i<table->num_variables; ++i) {
     condition = table->conditions[i];
-    if (strcmp(condition->symbol->name, name) == 0) {
+    if (condition->symbol->length == length &&
+	memcmp(condition->symbol->name, name, length) == 0) {
       return condition;
     }
   }
@@ -514,13 +6094,28 @@ solve_condition_t *solve_variable_table_find(solve_variable_table_t *table,
 solve_condition_t *solve_variable_table_find_or_add(
     solve_variable_table_t *table,
     const char *name) {
+  return solve_variable_table_find_or_add_n(table, name, (int)strlen(name));
+}
+
+/* Variables keep their own copy of their name. */
+solve_condition_t *solve_variable_table_find_or_add_n(
+    solve_variable_table_t *table,
+    const char *name,
+    int length) {
   symbol_table_node_t *symbol;
-  solve_condition_t *condition = solve_variable_table_find(table, name);
+  char *copy;
+  solve_condition_t *condition = solve_variable_table_find_n(table,
+							     name,
+							     length);
 
   if (condition == NULL) {
+    copy = NEW(char, length + 1);
+    memcpy(copy, name, length);
+    copy[length] = '\0';
+
     symbol = NEW(symbol_table_node_t, 1);
     assert(symbol != NULL);
-    initialize_symbol_table_node(symbol, name);
+    initialize_symbol_table_node(symbol, copy);
 
     condition = NEW(solve_condition_t, 1);
     assert(condition != NULL);
@@ -535,12 +6130,15 @@ solve_condition_t *solve_variable_table_find_or_add(
 /*****************************************
  * Rule Functions
  *****************************************/
+#undef MEMORY_CATEGORY
+#define MEMORY_CATEGORY MEMORY_OTHER
+
 void define_facts(const mpc_ast_t *ast,
 		  symbol_table_t *symbol_table,
 		  predicate_table_t *predicate_table) {
   int ident_number,
-      i;
-  const char *params[MAX_PARAMS];
+      num_allocated = 0;
+  const char **params = NULL;
   find_tag_state_t fact_state,
                    predicate_state,
                    ident_state;
@@ -554,12 +6152,14 @@ void define_facts(const mpc_ast_t *ast,
     while ((predicate = find_tag_next(&predicate_state, "predicate")) != NULL) {
       ident_number = 0;
 
-      for (i=0; i<MAX_PARAMS; ++i) {
-	params[i] = NULL;
-      }
-
       initialize_tag_state(&ident_state, predicate);
       while ((ident = find_tag_next(&ident_state, "ident")) != NULL) {
+	if (ident_number >= num_allocated) {
+	  num_allocated = num_allocated > 0
+	    ? num_allocated * ENLARGE_FACTOR
+	    : 1;
+	  params = RENEW(params, const char *, num_allocated);
+	}
 	params[ident_number++] = ident->contents;
       }
 
@@ -570,6 +6170,80 @@ void define_facts(const mpc_ast_t *ast,
 	       &params[1]);
     }
   }
+
+  FREE(params);
+}
+
+/* Rules come after every fact of the file in clause order here, since the
+ * facts are all defined first. */
+void define_rules(const mpc_ast_t *ast,
+		  symbol_table_t *symbol_table,
+		  predicate_table_t *predicate_table) {
+  find_tag_state_t rule_state,
+                   predicate_state;
+  const mpc_ast_t *rule,
+                  *predicate;
+  solve_variable_table_t variables;
+  machine_clause_t *clause;
+
+  initialize_tag_state(&rule_state, ast);
+  while ((rule = find_tag_next(&rule_state, "rule")) != NULL) {
+    clause = NEW(machine_clause_t, 1);
+    assert(clause != NULL);
+    initialize_machine_clause(clause);
+    initialize_solve_variable_table(&variables);
+
+    initialize_tag_state(&predicate_state, rule);
+    while ((predicate = find_tag_next(&predicate_state, "predicate")) != NULL) {
+      define_rule_goal(predicate,
+		       clause,
+		       symbol_table,
+		       predicate_table,
+		       &variables);
+    }
+
+    clause->num_variables = variables.num_variables;
+    machine_clause_compile(clause, 0);
+    predicate_table_node_add_rule(clause->goals[0].predicate, clause);
+    destroy_solve_variable_table(&variables);
+  }
+}
+
+void define_rule_goal(const mpc_ast_t *ast,
+		      machine_clause_t *clause,
+		      symbol_table_t *symbol_table,
+		      predicate_table_t *predicate_table,
+		      solve_variable_table_t *variables) {
+  find_tag_state_t ident_state;
+  const mpc_ast_t *ident;
+  const char *pred_name;
+  machine_goal_t *goal;
+  int arity = 0,
+      i = 0;
+
+  initialize_tag_state(&ident_state, ast);
+  pred_name = find_tag_next(&ident_state, "ident")->contents;
+  while (find_tag_next(&ident_state, "ident") != NULL) {
+    arity++;
+  }
+
+  goal = machine_clause_add_goal(clause,
+				 predicate_table_find_or_add(predicate_table,
+							     pred_name,
+							     arity));
+
+  initialize_tag_state(&ident_state, ast);
+  find_tag_next(&ident_state, "ident");
+  while ((ident = find_tag_next(&ident_state, "ident")) != NULL) {
+    if (has_tag(ident, "variable")) {
+      goal->args[i++] = -1 - solve_variable_table_find_or_add(
+	  variables,
+	  ident->contents)->index;
+    } else {
+      goal->args[i++] = symbol_table_find_or_add(symbol_table,
+						 ident->contents)->id;
+    }
+  }
 }
 
 void execute_queries(const mpc_ast_t *ast,
@@ -587,15 +6261,17 @@ void execute_queries(const mpc_ast_t *ast,
 void execute_query(const mpc_ast_t *ast,
 		   symbol_table_t *symbol_table,
 		   predicate_table_t *predicate_table) {
-  find_tag_state_t predicate_state;
-  const mpc_ast_t *predicate;
+  find_tag_state_t predicate_state,
+                   limit_state;
+  const mpc_ast_t *predicate,
+                  *limit;
   solve_variable_table_t variables;
   solve_t solve;
   solve_goal_t *goal;
 
-  initialize_solve(&solve);
   initialize_solve_variable_table(&variables);
-  predicate_table = predicate_table;
+  initialize_solve(&solve, &variables);
+  solve.symbol_table = symbol_table;
 
   initialize_tag_state(&predicate_state, ast);
   while ((predicate = find_tag_next(&predicate_state, "predicate")) != NULL) {
@@ -606,7 +6282,57 @@ void execute_query(const mpc_ast_t *ast,
     solve_add(&solve, goal);
   }
 
-  /* unify(&solve, &variables); */
+  initialize_tag_state(&limit_state, ast);
+  if ((limit = find_tag_next(&limit_state, "limit")) != NULL) {
+    solve.limit = atoi(limit->children[1]->contents);
+  }
+
+  execute_solve(&solve);
+
+  destroy_solve(&solve);
+  destroy_solve_variable_table(&variables);
+}
+
+/* Runs a query, printing its solutions as a cursor produces them.  The
+ * alternatives are searched on several workers if asked for, unless the
+ * query calls rules that have not been materialized. */
+void execute_solve(solve_t *solve) {
+  solve_cursor_t cursor;
+  int num_solutions = 0;
+
+  print_solve(solve);
+  solve_cursor_open(&cursor, solve);
+
+  if (num_or_workers > 1 && solve->num_goals > 0 &&
+      cursor.machine == NULL && !cursor.done) {
+    execute_solve_parallel(solve);
+  } else if (solve->variables->num_variables == 0) {
+    fputs(solve_cursor_next(&cursor) ? "true.\n" : "false.\n", solve->output);
+  } else {
+    while (solve_cursor_next(&cursor)) {
+      print_solve_solution(solve);
+      num_solutions++;
+    }
+
+    if (num_solutions == 0) {
+      fprintf(solve->output, "false.\n");
+    }
+  }
+
+  solve_cursor_close(&cursor);
+}
+
+int solve_has_rules(solve_t *solve) {
+  int i;
+
+  for (i=0; i<solve->num_goals; ++i) {
+    if (solve->goals[i]->predicate->num_rules > 0 &&
+	!solve->goals[i]->predicate->materialized) {
+      return 1;
+    }
+  }
+
+  return 0;
 }
 
 solve_goal_t *execute_query_build_goal(const mpc_ast_t *ast,
@@ -614,11 +6340,11 @@ solve_goal_t *execute_query_build_goal(const mpc_ast_t *ast,
 				       predicate_table_t *predicate_table,
 				       solve_variable_table_t *variables) {
   int ident_number;
-  const char *name;
+  const char *name,
+             *pred_name;
   find_tag_state_t ident_state;
   const mpc_ast_t *ident;
-  solve_goal_t *goal = NEW(solve_goal_t, 1);
-  predicate_table_node_t *predicate;
+  solve_goal_t *goal;
   solve_subgoal_t *subgoal;
   solve_condition_t *condition;
   symbol_table_node_t *symbol;
@@ -628,13 +6354,9 @@ solve_goal_t *execute_query_build_goal(const mpc_ast_t *ast,
 
   ident_number = 0;
   initialize_tag_state(&ident_state, ast);
-  {
-    ident = find_tag_next(&ident_state, "ident");
-
-    name = ident->contents;
-    predicate = predicate_table_find_or_add(predicate_table, name);
-    initialize_solve_goal(goal, predicate);
-  }
+  ident = find_tag_next(&ident_state, "ident");
+  pred_name = ident->contents;
+  initialize_solve_goal(goal, NULL);
 
   while ((ident = find_tag_next(&ident_state, "ident")) != NULL) {
     name = ident->contents;
@@ -656,6 +6378,11 @@ solve_goal_t *execute_query_build_goal(const mpc_ast_t *ast,
     solve_goal_add(goal, subgoal);
   }
 
+  /* The functor is only known once every argument has been counted. */
+  goal->predicate = predicate_table_find_or_add(predicate_table,
+						pred_name,
+						goal->num_subgoals);
+
   return goal;
 }
 
@@ -666,23 +6393,48 @@ void rule_add(symbol_table_t *symbol_table,
 	      const char **strings) {
   int i;
   predicate_table_node_t *predicate;
-  predicate_table_to_symbol_t *link;
-  symbol_table_node_t *symbols[MAX_PARAMS];
+  symbol_table_node_t **symbols = NEW(symbol_table_node_t *, arity + 1);
 
-  predicate = predicate_table_find_or_add(predicate_table, pred_name);
+  predicate = predicate_table_find_or_add(predicate_table, pred_name, arity);
 
   for (i=0; i<arity; ++i) {
     symbols[i] = symbol_table_find_or_add(symbol_table, strings[i]);
   }
 
-  link = predicate_table_node_add(predicate, arity, symbols);
+  rule_add_symbols(symbol_table, predicate, symbols);
+  FREE(symbols);
+}
 
-  for (i=0; i<arity; ++i) {
-    symbol_table_node_add(symbols[i], i, predicate, link);
+/* Adds a fact whose functor and arguments have already been interned.
+ * With set semantics a fact that is already there is skipped; returns
+ * whether the fact was added.  Materialization keeps each derived fact
+ * once, so it implies set semantics for the facts it starts from too. */
+int rule_add_symbols(symbol_table_t *symbol_table,
+		     predicate_table_node_t *predicate,
+		     symbol_table_node_t **symbols) {
+  int ordinal,
+      i;
+
+  if ((set_semantics || materialize) &&
+      predicate_table_node_contains(predicate, symbols)) {
+    return 0;
   }
+
+  ordinal = predicate_table_node_add(predicate, predicate->arity, symbols);
+
+  for (i=0; i<predicate->arity; ++i) {
+    symbol_table_node_add(symbols[i],
+			  &symbol_table->arena,
+			  i,
+			  predicate,
+			  ordinal);
+  }
+
+  return 1;
 }
 
-void print_symbols(symbol_table_t *table) {
+void print_symbols(symbol_table_t *table,
+		   predicate_table_t *predicate_table) {
   int i,
       j;
   symbol_table_node_t *node;
@@ -694,29 +6446,31 @@ void print_symbols(symbol_table_t *table) {
     node = table->symbols[i];
     printf("'%s':\n", node->name);
     for (j=0; j<node->num_link; ++j) {
-      link = node->links[j];
-      predicate = link->predicate;
-      printf("\t'%s': %d\n", predicate->name, link->position);
+      link = &node->links[j];
+      predicate = predicate_table->predicates[link->predicate];
+      printf("\t'%s/%d': %d\n",
+	     predicate->name,
+	     predicate->arity,
+	     link->position);
     }
   }
 }
 
-void print_predicates(predicate_table_t *table) {
+void print_predicates(symbol_table_t *symbol_table,
+		      predicate_table_t *table) {
   int i,
       j,
       k;
   predicate_table_node_t *node;
-  predicate_table_to_symbol_t *link;
   symbol_table_node_t *symbol;
 
   printf("Predicate Table:\n");
   for (i=0; i<table->num_predicates; ++i) {
     node = table->predicates[i];
     for (j=0; j<node->num_link; ++j) {
-      link = node->links[j];
       printf("%s(", node->name);
-      for (k=0; k<link->arity; ++k) {
-	symbol = link->nodes[k];
+      for (k=0; k<node->arity; ++k) {
+	symbol = symbol_table->symbols[node->columns[k][j]];
 	if (k != 0) {
 	  printf(",");
 	}
@@ -729,36 +6483,586 @@ void print_predicates(predicate_table_t *table) {
 
 void print_rules(symbol_table_t *symbol_table,
 		 predicate_table_t *predicate_table) {
-  print_symbols(symbol_table);
-  print_predicates(predicate_table);
+  predicate_table_node_t *predicate;
+  int i,
+      j;
+
+  print_symbols(symbol_table, predicate_table);
+  print_predicates(symbol_table, predicate_table);
+
+  for (i=0; i<predicate_table->num_predicates; ++i) {
+    predicate = predicate_table->predicates[i];
+    for (j=0; j<predicate->num_rules; ++j) {
+      print_machine_clause(symbol_table, predicate->rules[j]);
+    }
+  }
+}
+
+void print_solve(solve_t *solve) {
+  int i,
+      j;
+  solve_goal_t *goal;
+
+  fprintf(solve->output, "?- ");
+  for (i=0; i<solve->num_goals; ++i) {
+    goal = solve->goals[i];
+    if (i != 0) {
+      fprintf(solve->output, ", ");
+    }
+
+    fprintf(solve->output, "%s(", goal->predicate->name);
+    for (j=0; j<goal->num_subgoals; ++j) {
+      if (j != 0) {
+	fprintf(solve->output, ",");
+      }
+      fprintf(solve->output, "%s", goal->subgoals[j]->condition->name);
+    }
+    fprintf(solve->output, ")");
+  }
+
+  if (solve->limit >= 0) {
+    fprintf(solve->output, " limit %d", solve->limit);
+  }
+  fprintf(solve->output, ".\n");
+}
+
+void print_solve_plan(solve_t *solve, const double *estimates) {
+  int i,
+      j;
+  solve_goal_t *goal;
+
+  fprintf(solve->output, "%% plan: ");
+  for (i=0; i<solve->num_goals; ++i) {
+    goal = solve->goals[i];
+    if (i != 0) {
+      fprintf(solve->output, ", ");
+    }
+
+    fprintf(solve->output, "%s(", goal->predicate->name);
+    for (j=0; j<goal->num_subgoals; ++j) {
+      if (j != 0) {
+	fprintf(solve->output, ",");
+      }
+      fprintf(solve->output, "%s", goal->subgoals[j]->condition->name);
+    }
+    fprintf(solve->output, ") ~%.1f", estimates[i]);
+  }
+  fprintf(solve->output, "\n");
+}
+
+void print_solve_solution(solve_t *solve) {
+  solve_variable_table_t *variables = solve->variables;
+  symbol_table_node_t *binding;
+  int i;
+
+  for (i=0; i<variables->num_variables; ++i) {
+    binding = variables->bindings[i];
+    if (i != 0) {
+      fprintf(solve->output, ", ");
+    }
+    fprintf(solve->output,
+	    "%s = %s",
+	    variables->conditions[i]->name,
+	    binding != NULL ? binding->name : "_");
+  }
+  fprintf(solve->output, ".\n");
 }
 
 /*****************************************
- * Main function
+ * Statistics Functions
  *****************************************/
-int main(int argc, char **argv) {
-  mpc_result_t r;
-  symbol_table_t symbol_table;
-  predicate_table_t predicate_table;
+void statistics_begin(statistics_phase_t phase) {
+#ifdef PROLOG_STATS
+  struct timespec now;
+
+  if (statistics_output != STATS_NONE) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    statistics.phase_start[phase] = now.tv_sec + now.tv_nsec / 1e9;
+  }
+#else
+  (void)phase;
+#endif
+}
+
+void statistics_end(statistics_phase_t phase) {
+#ifdef PROLOG_STATS
+  struct timespec now;
+
+  if (statistics_output != STATS_NONE) {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    statistics.phase_seconds[phase] +=
+      now.tv_sec + now.tv_nsec / 1e9 - statistics.phase_start[phase];
+  }
+#else
+  (void)phase;
+#endif
+}
+
+/* Prints the phase times and counters in the format --stats asked for. */
+void print_statistics(FILE *file) {
+#ifdef PROLOG_STATS
+  static const char *phases[STATS_NUM_PHASES] = {
+    "parse", "ast", "build", "query"
+  };
+  static const char *counters[STATS_NUM_COUNTERS] = {
+    "symbol_lookups", "symbol_hits", "symbol_probes",
+    "predicate_lookups", "predicate_hits", "predicate_probes",
+    "renews", "candidates", "unifications", "backtracks"
+  };
+  int i;
+
+  if (statistics_output == STATS_JSON) {
+    fprintf(file, "{\"phases\": {");
+    for (i=0; i<STATS_NUM_PHASES; ++i) {
+      fprintf(file,
+	      "%s\"%s\": %.6f",
+	      i == 0 ? "" : ", ",
+	      phases[i],
+	      statistics.phase_seconds[i]);
+    }
+
+    fprintf(file, "}, \"counters\": {");
+    for (i=0; i<STATS_NUM_COUNTERS; ++i) {
+      fprintf(file,
+	      "%s\"%s\": %lu",
+	      i == 0 ? "" : ", ",
+	      counters[i],
+	      statistics.counters[i]);
+    }
+    fprintf(file, "}}\n");
+  } else {
+    for (i=0; i<STATS_NUM_PHASES; ++i) {
+      fprintf(file,
+	      "%% %-18s %12.6f s\n",
+	      phases[i],
+	      statistics.phase_seconds[i]);
+    }
+
+    for (i=0; i<STATS_NUM_COUNTERS; ++i) {
+      fprintf(file, "%% %-18s %12lu\n", counters[i], statistics.counters[i]);
+    }
+  }
+#else
+  fprintf(file, "%% built without PROLOG_STATS, so there is nothing to report\n");
+#endif
+}
+
+/*****************************************
+ * Memory Functions
+ *****************************************/
+
+/* Allocates size bytes behind a header recording them, charged to category
+ * while --memstats is on.  NEW and RENEW come here under PROLOG_STATS. */
+void *memory_alloc(memory_category_t category, size_t size) {
+  memory_header_t *header =
+    (memory_header_t *)malloc(MEMORY_HEADER_SIZE + size);
+
+  if (header == NULL) {
+    return NULL;
+  }
+
+  header->size = size;
+  header->category = memory_output ? (int)category : -1;
+  if (header->category >= 0) {
+    memory_charge(category, size);
+  }
+
+  return (char *)header + MEMORY_HEADER_SIZE;
+}
+
+/* Grows or shrinks a block from memory_alloc.  The block stays charged to
+ * the category it was first charged to; one allocated before --memstats
+ * was turned on is charged to category from now on. */
+void *memory_realloc(memory_category_t category, void *orig, size_t size) {
+  memory_header_t *header;
+  size_t old_size;
+
+  if (orig == NULL) {
+    return memory_alloc(category, size);
+  }
+
+  header = (memory_header_t *)((char *)orig - MEMORY_HEADER_SIZE);
+  old_size = header->size;
+  header = (memory_header_t *)realloc(header, MEMORY_HEADER_SIZE + size);
+  if (header == NULL) {
+    return NULL;
+  }
+
+  header->size = size;
+  if (header->category >= 0) {
+    memory_uncharge((memory_category_t)header->category, old_size);
+    memory_charge((memory_category_t)header->category, size);
+  } else if (memory_output) {
+    header->category = (int)category;
+    memory_charge(category, size);
+  }
+
+  return (char *)header + MEMORY_HEADER_SIZE;
+}
+
+void memory_free(void *memory) {
+  memory_header_t *header;
+
+  if (memory == NULL) {
+    return;
+  }
+
+  header = (memory_header_t *)((char *)memory - MEMORY_HEADER_SIZE);
+  if (header->category >= 0) {
+    memory_uncharge((memory_category_t)header->category, header->size);
+  }
+  free(header);
+}
+
+void memory_charge(memory_category_t category, size_t size) {
+  memory_raise(&memory_usage.peak[category],
+	       __atomic_add_fetch(&memory_usage.live[category],
+				  size,
+				  __ATOMIC_RELAXED));
+  memory_raise(&memory_usage.total_peak,
+	       __atomic_add_fetch(&memory_usage.total_live,
+				  size,
+				  __ATOMIC_RELAXED));
+}
+
+void memory_uncharge(memory_category_t category, size_t size) {
+  __atomic_sub_fetch(&memory_usage.live[category], size, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&memory_usage.total_live, size, __ATOMIC_RELAXED);
+}
+
+/* Lifts *peak to live unless another thread has already lifted it past. */
+void memory_raise(size_t *peak, size_t live) {
+  size_t seen = __atomic_load_n(peak, __ATOMIC_RELAXED);
+
+  while (seen < live &&
+	 !__atomic_compare_exchange_n(peak,
+				      &seen,
+				      live,
+				      0,
+				      __ATOMIC_RELAXED,
+				      __ATOMIC_RELAXED)) {
+  }
+}
+
+/* Adds the bytes arena has handed out and left behind to used and
+ * abandoned, by category, and those of its blocks still unused to free. */
+void memory_arena(arena_t *arena,
+		  size_t *used,
+		  size_t *abandoned,
+		  size_t *free_bytes) {
+  size_t total = 0;
+  int i;
+
+  for (i=0; i<MEMORY_NUM_CATEGORIES; ++i) {
+    used[i] += arena->used[i];
+    abandoned[i] += arena->abandoned[i];
+    total += arena->used[i];
+  }
+
+  *free_bytes += arena->reserved - total;
+}
+
+/* Adds the capacity allocated but not in use, by category, to wasted: the
+ * unused tail of every growable array and the empty slots of every hash
+ * table in the databases. */
+void memory_slack(symbol_table_t *symbol_table,
+		  predicate_table_t *predicate_table,
+		  size_t *wasted) {
+  symbol_table_node_t *symbol;
+  predicate_table_node_t *predicate;
+  predicate_index_t *index;
+  int i,
+      j,
+      k;
+
+  /* ==== Symbols ==== */
+  wasted[MEMORY_ATOMS] +=
+    sizeof(symbol_table_node_t *) *
+    (symbol_table->num_allocated - symbol_table->num_symbols) +
+    sizeof(int) * (symbol_table->num_buckets - symbol_table->num_symbols);
+
+  for (i=0; i<symbol_table->num_symbols; ++i) {
+    symbol = symbol_table->symbols[i];
+    wasted[MEMORY_LINKS] +=
+      sizeof(symbol_table_to_predicate_t) *
+      (symbol->num_allocated - symbol->num_link) +
+      sizeof(symbol_table_posting_t) *
+      (symbol->postings_allocated - symbol->num_postings);
+
+    for (j=0; j<symbol->num_postings; ++j) {
+      wasted[MEMORY_LINKS] += memory_slack_bitmap(&symbol->postings[j].clauses);
+    }
+  }
+
+  /* ==== Predicates ==== */
+  wasted[MEMORY_CLAUSES] +=
+    sizeof(predicate_table_node_t *) *
+    (predicate_table->num_allocated - predicate_table->num_predicates) +
+    sizeof(int) *
+    (predicate_table->num_buckets - predicate_table->num_predicates);
+
+  for (i=0; i<predicate_table->num_predicates; ++i) {
+    predicate = predicate_table->predicates[i];
+    wasted[MEMORY_CLAUSES] +=
+      sizeof(atom_t) * predicate->arity *
+      (predicate->num_allocated - predicate->num_link) +
+      sizeof(machine_clause_t *) *
+      (predicate->rules_allocated - predicate->num_rules);
+
+    for (j=0; j<predicate->num_indexes; ++j) {
+      index = predicate->indexes[j];
+      wasted[MEMORY_INDEXES] +=
+	sizeof(predicate_index_bucket_t) *
+	(index->num_buckets - index->num_keys);
+      for (k=0; k<index->num_buckets; ++k) {
+	if (index->buckets[k].num_clauses > 0) {
+	  wasted[MEMORY_INDEXES] +=
+	    sizeof(int) *
+	    (index->buckets[k].num_allocated - index->buckets[k].num_clauses);
+	}
+      }
+    }
+  }
+}
+
+size_t memory_slack_bitmap(bitmap_t *bitmap) {
+  size_t wasted = sizeof(bitmap_container_t) *
+    (bitmap->num_allocated - bitmap->num_containers);
+  int i;
+
+  for (i=0; i<bitmap->num_containers; ++i) {
+    if (bitmap->containers[i].bits == NULL) {
+      wasted += sizeof(unsigned short) *
+	(bitmap->containers[i].num_allocated -
+	 bitmap->containers[i].cardinality);
+    }
+  }
+
+  return wasted;
+}
+
+/* Prints live, peak and wasted bytes per category for --memstats.  Arena
+ * memory is never released before the tables are destroyed, so what the
+ * arenas hold now counts towards the peak as well as towards live;
+ * allocations moved out of an arena count as wasted. */
+void print_memory(FILE *file,
+		  symbol_table_t *symbol_table,
+		  predicate_table_t *predicate_table) {
+#ifdef PROLOG_STATS
+  static const char *categories[MEMORY_NUM_CATEGORIES] = {
+    "atoms", "links", "clauses", "indexes", "query", "other"
+  };
+  size_t used[MEMORY_NUM_CATEGORIES],
+         wasted[MEMORY_NUM_CATEGORIES],
+         free_bytes = 0,
+         total_used = 0,
+         total_wasted = 0;
+  int i;
+
+  memset(used, 0, sizeof(used));
+  memset(wasted, 0, sizeof(wasted));
+  memory_arena(&symbol_table->arena, used, wasted, &free_bytes);
+  memory_arena(&predicate_table->arena, used, wasted, &free_bytes);
+  memory_slack(symbol_table, predicate_table, wasted);
+
+  fprintf(file,
+	  "%% %-18s %12s %12s %12s\n",
+	  "memory",
+	  "live",
+	  "peak",
+	  "wasted");
+  for (i=0; i<MEMORY_NUM_CATEGORIES; ++i) {
+    fprintf(file,
+	    "%% %-18s %12lu %12lu %12lu\n",
+	    categories[i],
+	    (unsigned long)(memory_usage.live[i] + used[i]),
+	    (unsigned long)(memory_usage.peak[i] + used[i]),
+	    (unsigned long)wasted[i]);
+    total_used += used[i];
+    total_wasted += wasted[i];
+  }
+
+  fprintf(file,
+	  "%% %-18s %12lu %12lu %12lu\n",
+	  "total",
+	  (unsigned long)(memory_usage.total_live + total_used),
+	  (unsigned long)(memory_usage.total_peak + total_used),
+	  (unsigned long)total_wasted);
+  fprintf(file, "%% %-18s %12lu\n", "arena free", (unsigned long)free_bytes);
+#else
+  (void)symbol_table;
+  (void)predicate_table;
+  fprintf(file, "%% built without PROLOG_STATS, so there is nothing to report\n");
+#endif
+}
+
+/*****************************************
+ * Library Functions
+ *****************************************/
+void initialize_prolog(prolog_t *prolog) {
+  initialize_symbol_table(&prolog->symbol_table);
+  initialize_predicate_table(&prolog->predicate_table);
+  initialize_loader(&prolog->loader,
+		    &prolog->symbol_table,
+		    &prolog->predicate_table);
+}
+
+void destroy_prolog(prolog_t *prolog) {
+  destroy_loader(&prolog->loader);
+  destroy_symbol_table(&prolog->symbol_table);
+  destroy_predicate_table(&prolog->predicate_table);
+}
+
+/* Loads the facts and rules in filename, or standard input if it is NULL.
+ * Queries in it are skipped; prepare them instead.  Returns 0 on an error,
+ * after reporting it. */
+int prolog_consult(prolog_t *prolog, const char *filename) {
+  int return_value = load_file(&prolog->loader, filename);
+
+  loader_clear_queries(&prolog->loader);
+  if (return_value && materialize) {
+    predicate_table_materialize(&prolog->predicate_table,
+				&prolog->symbol_table);
+  }
+
+  return return_value;
+}
+
+/* As prolog_consult, for the length bytes at text. */
+int prolog_load(prolog_t *prolog, const char *text, size_t length) {
   int return_value;
-  const char *filename = argc > 1 ? argv[1] : NULL;
 
-  return_value = parse_file(&r, filename);
-  if (!return_value) {
-    return 1;
+  prolog->loader.filename = "<text>";
+  prolog->loader.line = 1;
+  return_value = load_buffer(&prolog->loader, text, length);
+
+  loader_clear_queries(&prolog->loader);
+  if (return_value && materialize) {
+    predicate_table_materialize(&prolog->predicate_table,
+				&prolog->symbol_table);
   }
 
-  initialize_symbol_table(&symbol_table);
-  initialize_predicate_table(&predicate_table);
+  return return_value;
+}
 
-  print_tags(r.output, 0);
-  define_facts(r.output, &symbol_table, &predicate_table);
+/* Returns the symbol of an atom to bind a parameter to, interning it if
+ * no loaded clause mentions it yet; such an atom matches no fact. */
+symbol_table_node_t *prolog_atom(prolog_t *prolog, const char *name) {
+  return symbol_table_find_or_add(&prolog->symbol_table, name);
+}
 
-  print_rules(&symbol_table, &predicate_table);
+/* Parses text, a conjunction of goals with an optional "?-" before it and
+ * '.' after it, into query.  Its predicates, constants and variable slots
+ * are resolved here, once, so running it again costs no parsing or
+ * interning.  Returns 0 on a syntax error, after reporting it. */
+int prolog_prepare(prolog_t *prolog, prolog_query_t *query, const char *text) {
+  loader_t *loader = &prolog->loader;
+  size_t length = strlen(text);
+  char *statement = NEW(char, length + 2);
+  int i;
 
-  destroy_symbol_table(&symbol_table);
-  destroy_predicate_table(&predicate_table);
-  mpc_ast_delete(r.output);
+  memcpy(statement, text, length);
+  while (length > 0 && isspace((unsigned char)statement[length - 1])) {
+    length--;
+  }
+  if (length == 0 || statement[length - 1] != '.') {
+    statement[length++] = '.';
+  }
+  statement[length] = '\0';
+
+  loader->filename = "<query>";
+  loader->line = 1;
+  loader->cursor = statement;
+  loader->end = statement + length;
+  loader_skip_space(loader);
+  if (loader->end - loader->cursor >= 2 &&
+      loader->cursor[0] == '?' && loader->cursor[1] == '-') {
+    loader->cursor += 2;
+  }
 
-  return 0;
+  if (!loader_query(loader)) {
+    FREE(statement);
+    return 0;
+  }
+
+  loader_build_query(loader,
+		     loader->queries[loader->num_queries - 1],
+		     &query->solve,
+		     &query->variables);
+  loader_clear_queries(loader);
+  FREE(statement);
+
+  query->prolog = prolog;
+  query->parameters = NEW(symbol_table_node_t *,
+			  query->variables.num_variables + 1);
+  for (i=0; i<query->variables.num_variables; ++i) {
+    query->parameters[i] = NULL;
+  }
+  query->open = 0;
+
+  return 1;
+}
+
+void destroy_prolog_query(prolog_query_t *query) {
+  prolog_query_close(query);
+  destroy_solve(&query->solve);
+  destroy_solve_variable_table(&query->variables);
+  FREE(query->parameters);
+  query->parameters = NULL;
+  query->prolog = NULL;
+}
+
+/* Returns the slot of the variable called name, or -1 if the query has
+ * none. */
+int prolog_query_variable(prolog_query_t *query, const char *name) {
+  solve_condition_t *condition = solve_variable_table_find(&query->variables,
+							   name);
+
+  return condition != NULL ? condition->index : -1;
+}
+
+/* Binds the variable in slot to symbol, from prolog_atom, for the runs
+ * that follow. */
+void prolog_query_bind(prolog_query_t *query,
+		       int slot,
+		       symbol_table_node_t *symbol) {
+  assert(symbol != NULL);
+  query->parameters[slot] = symbol;
+}
+
+/* Frees the variable in slot again for the runs that follow. */
+void prolog_query_unbind(prolog_query_t *query, int slot) {
+  query->parameters[slot] = NULL;
+}
+
+/* Starts a run of the query under its current parameters, abandoning the
+ * previous run if it is still open. */
+void prolog_query_execute(prolog_query_t *query) {
+  prolog_query_close(query);
+  memcpy(query->variables.bindings,
+	 query->parameters,
+	 sizeof(symbol_table_node_t *) * query->variables.num_variables);
+
+  solve_cursor_open(&query->cursor, &query->solve);
+  query->open = 1;
+}
+
+/* Finds the run's next solution.  Returns 0 when there are no more. */
+int prolog_query_next(prolog_query_t *query) {
+  return query->open && solve_cursor_next(&query->cursor);
+}
+
+/* Returns the name of the atom the variable in slot is bound to in the
+ * current solution, or NULL if it is unbound. */
+const char *prolog_query_value(prolog_query_t *query, int slot) {
+  symbol_table_node_t *binding = query->variables.bindings[slot];
+
+  return binding != NULL ? binding->name : NULL;
+}
+
+void prolog_query_close(prolog_query_t *query) {
+  if (query->open) {
+    solve_cursor_close(&query->cursor);
+    query->open = 0;
+  }
 }
@@ -2,66 +2,458 @@
 #define PROLOG_H_
 
 #include "mpc/mpc.h"
+#include <pthread.h>
 
 /*****************************************
  * Struct stubs
  *****************************************/
+struct memory_header_t;
+struct memory_usage_t;
+struct arena_block_t;
+struct arena_t;
+struct bitmap_container_t;
+struct bitmap_t;
+struct answer_entry_t;
+struct answer_table_t;
 struct find_tag_state_t;
+struct machine_goal_t;
+struct machine_clause_t;
+struct machine_switch_bucket_t;
+struct machine_switch_t;
+struct machine_frame_t;
+struct machine_alternatives_t;
+struct machine_choicepoint_t;
+struct machine_t;
+struct materialize_t;
+struct grammar_t;
+struct loader_ident_t;
+struct loader_t;
+struct loader_chunk_t;
+struct loader_query_pool_t;
+struct snapshot_t;
+struct session_t;
+struct statistics_t;
+struct prolog_t;
+struct prolog_query_t;
 struct symbol_table_to_predicate_t;
+struct symbol_table_posting_t;
 struct symbol_table_node_t;
 struct symbol_table_t;
-struct predicate_table_to_symbol_t;
 struct predicate_table_node_t;
 struct predicate_table_t;
+struct predicate_index_bucket_t;
+struct predicate_index_t;
 struct solve_condition_t;
 struct solve_variable_table_t;
 struct solve_goal_state_t;
 struct solve_t;
-struct sole_goal_t;
+struct solve_cursor_t;
+struct solve_task_t;
+struct solve_deque_t;
+struct solve_parallel_t;
+struct solve_worker_t;
+struct solve_goal_t;
 struct solve_subgoal_t;
 struct solve_condition_t;
 
+/*****************************************
+ * Memory
+ *****************************************/
+
+/* What the bytes --memstats reports are spent on.  Heap allocations are
+ * charged to the category of the code that makes them, arena allocations
+ * to the category they are made for. */
+typedef enum memory_category_t {
+  MEMORY_ATOMS,
+  MEMORY_LINKS,
+  MEMORY_CLAUSES,
+  MEMORY_INDEXES,
+  MEMORY_QUERY,
+  MEMORY_OTHER,
+  MEMORY_NUM_CATEGORIES
+} memory_category_t;
+
+/* Precedes every tracked heap allocation, so that it can be uncharged
+ * when it is freed. */
+typedef struct memory_header_t {
+  size_t size;
+  int category;
+} memory_header_t;
+
+/* Live and peak heap bytes per category, updated atomically since the
+ * loader and the query workers allocate on several threads. */
+typedef struct memory_usage_t {
+  size_t live[MEMORY_NUM_CATEGORIES];
+  size_t peak[MEMORY_NUM_CATEGORIES];
+  size_t total_live;
+  size_t total_peak;
+} memory_usage_t;
+
+/*****************************************
+ * Arena
+ *****************************************/
+
+/* Bump allocator backing the symbol and predicate databases.  Memory is
+ * carved out of large blocks and only ever released all at once.  used
+ * counts the bytes handed out per category and abandoned those of them
+ * left behind when an allocation was moved to grow it; reserved is the
+ * size of all the blocks. */
+typedef struct arena_block_t {
+  struct arena_block_t *next;
+  size_t size;
+  size_t used;
+} arena_block_t;
+
+typedef struct arena_t {
+  struct arena_block_t *blocks;
+  void *last;
+  size_t block_size;
+  size_t reserved;
+  size_t used[MEMORY_NUM_CATEGORIES];
+  size_t abandoned[MEMORY_NUM_CATEGORIES];
+} arena_t;
+
+/*****************************************
+ * Bitmaps
+ *****************************************/
+
+/* Compressed set of clause ordinals in the style of Roaring bitmaps: values
+ * are grouped by their high 16 bits, and each group keeps its low halves
+ * either as a sorted array or, once that gets dense, as a 65536-bit map. */
+typedef struct bitmap_container_t {
+  int key;
+  int cardinality;
+  int num_allocated;
+  unsigned short *values;
+  unsigned int *bits;
+} bitmap_container_t;
+
+typedef struct bitmap_t {
+  int cardinality;
+  int num_containers;
+  int num_allocated;
+  struct bitmap_container_t *containers;
+} bitmap_t;
+
+/*****************************************
+ * Answer Tables
+ *****************************************/
+
+/* The clauses of one predicate that answer one call pattern.  key holds an
+ * entry per argument: the symbol id of a bound argument, or -1 - p for an
+ * unbound variable first seen at argument p, so variant calls share it. */
+typedef struct answer_entry_t {
+  unsigned long hash;
+  int *key;
+  int num_answers;
+  int *answers;
+} answer_entry_t;
+
+/* Memoized answers of one predicate, emptied whenever a clause is added to
+ * it.  Queries on several threads share it, hence the lock. */
+typedef struct answer_table_t {
+  int num_entries;
+  int num_allocated;
+  struct answer_entry_t **entries;
+  int num_buckets;
+  int *buckets;
+  long hits;
+  long misses;
+  pthread_mutex_t lock;
+} answer_table_t;
+
+/*****************************************
+ * Abstract Machine
+ *****************************************/
+
+/* Instructions of the rule machine, each followed by its operands.  A
+ * rule's arguments are passed in the argument registers A; X registers
+ * hold variables that live within the head and first goal, Y slots (in
+ * the rule's environment frame) those needed across calls.  Every
+ * variable is a cell on the heap, so registers and slots hold either a
+ * symbol id or a reference -1 - h to heap cell h. */
+typedef enum machine_opcode_t {
+  OP_GET_VARIABLE_X,		/* x, a: X[x] = A[a] */
+  OP_GET_VARIABLE_Y,		/* y, a: Y[y] = A[a] */
+  OP_GET_VALUE_X,		/* x, a: unify X[x] with A[a] */
+  OP_GET_VALUE_Y,		/* y, a: unify Y[y] with A[a] */
+  OP_GET_CONSTANT,		/* c, a: unify symbol c with A[a] */
+  OP_PUT_VARIABLE_X,		/* x, a: X[x] = A[a] = a new variable */
+  OP_PUT_VARIABLE_Y,		/* y, a: Y[y] = A[a] = a new variable */
+  OP_PUT_VALUE_X,		/* x, a: A[a] = X[x] */
+  OP_PUT_VALUE_Y,		/* y, a: A[a] = Y[y] */
+  OP_PUT_CONSTANT,		/* c, a: A[a] = symbol c */
+  OP_ALLOCATE,			/* n: push a frame of n Y slots */
+  OP_DEALLOCATE,		/* pop the frame */
+  OP_CALL,			/* g: call goal g, then continue here */
+  OP_EXECUTE,			/* g: call goal g as the last one */
+  OP_PROCEED,			/* return to the continuation */
+  OP_ANSWER			/* report a solution of the query */
+} machine_opcode_t;
+
+/* A goal as written in the clause: args holds the symbol id of each
+ * constant argument and -1 - v for variable v. */
+typedef struct machine_goal_t {
+  struct predicate_table_node_t *predicate;
+  int *args;
+} machine_goal_t;
+
+/* A rule and its code.  goals[0] is the head (a query has none, and a
+ * NULL predicate there); position is the number of facts of the head
+ * predicate loaded before the rule, which fixes its place in clause
+ * order.  num_registers is the largest arity among the goals. */
+typedef struct machine_clause_t {
+  int num_goals;
+  int goals_allocated;
+  struct machine_goal_t *goals;
+  int num_variables;
+  int num_temporaries;
+  int num_permanents;
+  int num_registers;
+  int num_code;
+  int code_allocated;
+  int *code;
+  int position;
+} machine_clause_t;
+
+/* The rules whose head has one symbol as its first argument, plus those
+ * with a variable there, in clause order. */
+typedef struct machine_switch_bucket_t {
+  int key;
+  int num_rules;
+  int num_allocated;
+  int *rules;
+} machine_switch_bucket_t;
+
+/* First-argument dispatch over the rules of a predicate.  rules holds
+ * the rules with a variable first argument, which every bucket includes
+ * as well. */
+typedef struct machine_switch_t {
+  int num_keys;
+  int num_buckets;
+  struct machine_switch_bucket_t *buckets;
+  int num_rules;
+  int num_allocated;
+  int *rules;
+} machine_switch_t;
+
+/* An environment: the Y slots of a rule at slots in the slot stack, and
+ * where to continue once the rule's body is done. */
+typedef struct machine_frame_t {
+  int parent;
+  const struct machine_clause_t *continuation;
+  int continuation_pc;
+  int slots;
+  int num_slots;
+} machine_frame_t;
+
+/* The clauses of a predicate still to try for one call: facts by
+ * ordinal and rules by number, merged in clause order.  facts is NULL for
+ * every fact in order; facts_offset is >= 0 when they were scanned onto
+ * the machine's saved stack instead. */
+typedef struct machine_alternatives_t {
+  struct predicate_table_node_t *predicate;
+  const int *facts;
+  int facts_offset;
+  int num_facts;
+  int fact_index;
+  const int *rules;
+  int num_rules;
+  int rule_index;
+} machine_alternatives_t;
+
+/* Everything needed to resume a call with its next alternative.  The
+ * call's argument registers are kept on the saved stack at args. */
+typedef struct machine_choicepoint_t {
+  struct machine_alternatives_t alternatives;
+  int env;
+  const struct machine_clause_t *continuation;
+  int continuation_pc;
+  int num_trail;
+  int num_heap;
+  int num_frames;
+  int num_slots;
+  int num_saved;
+  int args;
+} machine_choicepoint_t;
+
+/* The state of one query on the rule machine. */
+typedef struct machine_t {
+  struct symbol_table_t *symbol_table;
+  const struct machine_clause_t *clause;
+  int pc;
+  const struct machine_clause_t *continuation;
+  int continuation_pc;
+  int env;
+  int num_registers;
+  int *registers;
+  int num_temporaries;
+  int *temporaries;
+  int num_frames;
+  int frames_allocated;
+  struct machine_frame_t *frames;
+  int num_slots;
+  int slots_allocated;
+  int *slots;
+  int num_heap;
+  int heap_allocated;
+  int *heap;
+  int num_trail;
+  int trail_allocated;
+  int *trail;
+  int num_choicepoints;
+  int choicepoints_allocated;
+  struct machine_choicepoint_t *choicepoints;
+  int num_saved;
+  int saved_allocated;
+  int *saved;
+  struct symbol_table_node_t **args;
+} machine_t;
+
+/*****************************************
+ * Materialization
+ *****************************************/
+
+/* A bottom-up evaluation of the rules to their fixpoint.  Facts are only
+ * ever appended, so the facts a predicate gained in the previous round
+ * are the ordinals [delta_start, delta_end) of its clauses, by predicate
+ * id.  A predicate's fixpoint_facts and fixpoint_rules count the facts
+ * and rules the last fixpoint took in, where the next one starts.  Heads
+ * derived during a round are queued in pending, as a predicate id
+ * followed by argument symbol ids, and added after it.  The join keeps
+ * its call arguments, fresh variables and scan results in one buffer per
+ * body goal depth, reused from one match and one round to the next. */
+typedef struct materialize_t {
+  struct symbol_table_t *symbol_table;
+  struct predicate_table_t *predicate_table;
+  int *delta_start;
+  int *delta_end;
+  int num_bindings;
+  struct symbol_table_node_t **bindings;
+  struct symbol_table_node_t **args;
+  int num_depths;
+  int max_arity;
+  struct symbol_table_node_t **join_args;
+  int *join_fresh;
+  int **join_scratch;
+  int *scratch_allocated;
+  size_t num_pending;
+  size_t pending_allocated;
+  int *pending;
+  long num_derived;
+  int num_rounds;
+} materialize_t;
+
 /*****************************************
  * Symbol Table
  *****************************************/
+
+/* Symbol ids as stored in the fact columns; the scan kernels assume 32
+ * bits. */
+typedef unsigned int atom_t;
+typedef char atom_t_must_be_32_bits[sizeof(atom_t) == 4 ? 1 : -1];
+
+/* A reverse link from a symbol to one clause it appears in, held by value
+ * in the symbol's links: the predicate's id, the clause's ordinal and the
+ * argument position. */
 typedef struct symbol_table_to_predicate_t {
+  int predicate;
+  int clause;
   int position;
-  struct predicate_table_node_t *predicate;
-  struct predicate_table_to_symbol_t *link;
 } symbol_table_to_predicate_t;
 
+/* The clauses of one predicate in which a symbol appears at one argument
+ * position. */
+typedef struct symbol_table_posting_t {
+  int position;
+  struct predicate_table_node_t *predicate;
+  struct bitmap_t clauses;
+} symbol_table_posting_t;
+
 typedef struct symbol_table_node_t {
   const char *name;
+  int id;
+  int length;
+  unsigned long hash;
   int num_link;
   int num_allocated;
-  struct symbol_table_to_predicate_t **links;
+  struct symbol_table_to_predicate_t *links;
+  int num_postings;
+  int postings_allocated;
+  struct symbol_table_posting_t *postings;
 } symbol_table_node_t;
 
 typedef struct symbol_table_t {
   int num_symbols;
   int num_allocated;
   struct symbol_table_node_t **symbols;
+  int num_buckets;
+  int *buckets;
+  struct arena_t arena;
 } symbol_table_t;
 
 /*****************************************
  * Predicate Table
  *****************************************/
-typedef struct predicate_table_to_symbol_t {
-  int arity;
-  struct symbol_table_node_t **nodes;
-} predicate_table_to_symbol_t;
+
+/* One distinct key of an index: the ordinals of every clause whose
+ * arguments at the indexed positions match.  Empty when num_clauses is 0;
+ * the first clause doubles as the representative used to compare keys. */
+typedef struct predicate_index_bucket_t {
+  unsigned long hash;
+  int num_clauses;
+  int num_allocated;
+  int *clauses;
+} predicate_index_bucket_t;
+
+typedef struct predicate_index_t {
+  int num_positions;
+  int *positions;
+  int num_keys;
+  int num_buckets;
+  struct predicate_index_bucket_t *buckets;
+} predicate_index_t;
+
+/* Unify a call with one fact and bind the call's free variables, either
+ * as a goal of a query or as the argument registers of the rule machine.
+ * A predicate picks its kernels by arity when it is created. */
+typedef int (*solve_unify_t)(struct solve_t *, struct solve_goal_t *, int);
+typedef int (*machine_unify_t)(struct machine_t *,
+			       const struct predicate_table_node_t *,
+			       int);
 
 typedef struct predicate_table_node_t {
   const char *name;
+  int arity;
+  int id;
+  int length;
+  unsigned long hash;
   int num_link;
   int num_allocated;
-  struct predicate_table_to_symbol_t **links;
+  int num_indexes;
+  struct predicate_index_t **indexes;
+  struct arena_t *arena;
+  atom_t **columns;
+  struct answer_table_t answers;
+  int num_rules;
+  int rules_allocated;
+  struct machine_clause_t **rules;
+  struct machine_switch_t dispatch;
+  int materialized;
+  int fixpoint_facts;
+  int fixpoint_rules;
+  struct predicate_index_t *tuples;
+  solve_unify_t unify_goal;
+  machine_unify_t unify_registers;
 } predicate_table_node_t;
 
 typedef struct predicate_table_t {
   int num_predicates;
   int num_allocated;
   struct predicate_table_node_t **predicates;
+  int num_buckets;
+  int *buckets;
+  struct arena_t arena;
 } predicate_table_t;
 
 /*****************************************
@@ -71,23 +463,121 @@ typedef struct solve_variable_table_t {
   int num_variables;
   int num_allocated;
   struct solve_condition_t **conditions;
+  struct symbol_table_node_t **bindings;
 } solve_variable_table_t;
 
+/* Per-goal search state.  candidate is the ordinal of the clause matched
+ * last, or -1.  candidates holds the clause ordinals worth trying (NULL to
+ * try every clause in order) and candidate_index the next one; trail_mark
+ * is the trail height to undo to before each attempt.  ground is set when
+ * every argument is bound and the candidates came from an index on all of
+ * them, so each one matches as it is. */
 typedef struct solve_goal_state_t {
   struct solve_goal_t *goal;
   int subgoal_index;
-  struct predicate_table_to_symbol_t *candidate;
+  int candidate;
   int candidate_index;
+  int num_candidates;
+  const int *candidates;
+  int trail_mark;
+  struct symbol_table_node_t **args;
+  int num_allocated;
+  int *scratch;
+  int *key;
+  int ground;
 } solve_goal_state_t;
 
+/* A conjunction of goals solved left to right.  Bindings made while
+ * solving are recorded on the trail; choicepoints holds the indices of the
+ * goals that still have untried candidates, most recent last.  Answers are
+ * printed to output, stdout unless the query runs on a worker thread.
+ * symbol_table is needed to run the query on the rule machine. */
 typedef struct solve_t {
   int num_goals;
   int num_allocated;
   struct solve_variable_table_t *variables;
   struct solve_goal_t **goals;
   struct solve_goal_state_t **states;
+  int depth;
+  int num_trail;
+  int trail_allocated;
+  int *trail;
+  int num_choicepoints;
+  int choicepoints_allocated;
+  int *choicepoints;
+  FILE *output;
+  struct solve_worker_t *worker;
+  struct symbol_table_t *symbol_table;
+  int limit;
 } solve_t;
 
+/* An open query whose solutions are produced one at a time.  Each
+ * successful solve_cursor_next leaves the next one in the bindings of
+ * solve->variables; between calls the search is held by the goals'
+ * candidate_index and the choicepoints, or by machine when the query
+ * calls rules.  limit caps the solutions returned, -1 for none.
+ * Variables already bound when the cursor is opened are parameters: they
+ * act as constants and keep their values, a copy of which is kept in
+ * parameters while the rule machine runs. */
+typedef struct solve_cursor_t {
+  struct solve_t *solve;
+  struct machine_clause_t *query;
+  struct machine_t *machine;
+  struct symbol_table_node_t **parameters;
+  int limit;
+  int num_solutions;
+  int done;
+} solve_cursor_t;
+
+/* A branch of an OR-parallel search: the goal at depth still has the
+ * candidates [candidate_index, num_candidates) to try under bindings.
+ * candidates is owned by the task, or NULL for every clause in order; a
+ * candidate_index of -1 means the goal has not been started yet. */
+typedef struct solve_task_t {
+  int depth;
+  int candidate_index;
+  int num_candidates;
+  int *candidates;
+  struct symbol_table_node_t **bindings;
+} solve_task_t;
+
+/* A worker's own tasks.  The worker pushes and pops at the back; idle
+ * workers steal the oldest, largest branches from the front at head. */
+typedef struct solve_deque_t {
+  int head;
+  int num_tasks;
+  int num_allocated;
+  struct solve_task_t **tasks;
+  pthread_mutex_t lock;
+} solve_deque_t;
+
+/* Shared state of one OR-parallel query.  pending counts the tasks not yet
+ * finished and num_queued those waiting in a deque; lock guards both, stop,
+ * num_solutions and the query's output.  The search stops once limit
+ * solutions have been printed, unless limit is -1. */
+typedef struct solve_parallel_t {
+  struct solve_t *solve;
+  int num_workers;
+  struct solve_deque_t *deques;
+  int limit;
+  int stop;
+  int pending;
+  int num_queued;
+  int num_solutions;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+} solve_parallel_t;
+
+/* A worker searches with its own copy of the query's goal states and
+ * bindings; the goals and conditions themselves are shared. */
+typedef struct solve_worker_t {
+  struct solve_parallel_t *parallel;
+  int id;
+  int num_steps;
+  struct solve_t solve;
+  struct solve_variable_table_t variables;
+} solve_worker_t;
+
 typedef struct solve_goal_t {
   struct predicate_table_node_t *predicate;
   int num_subgoals;
@@ -109,8 +599,71 @@ typedef struct solve_condition_t {
   const char *name;
   enum solve_condition_type_t type;
   struct symbol_table_node_t *symbol;
+  int index;
 } solve_condition_t;
 
+/*****************************************
+ * Options
+ *****************************************/
+extern int debug_output;
+extern int num_or_workers;
+extern int first_solution_only;
+extern int tabling;
+extern int materialize;
+extern int set_semantics;
+
+/*****************************************
+ * Statistics
+ *****************************************/
+
+/* The phases --stats times.  The loader parses and builds the tables in a
+ * single pass, so for it STATS_PARSE covers both and STATS_BUILD only
+ * what comes after: snapshots, extra indexes and materialization.
+ * STATS_AST is the walk over the mpc tree. */
+typedef enum statistics_phase_t {
+  STATS_PARSE,
+  STATS_AST,
+  STATS_BUILD,
+  STATS_QUERY,
+  STATS_NUM_PHASES
+} statistics_phase_t;
+
+typedef enum statistics_format_t {
+  STATS_NONE,
+  STATS_TEXT,
+  STATS_JSON
+} statistics_format_t;
+
+/* Counters bumped on the hot paths when the interpreter is built with
+ * PROLOG_STATS and --stats is given.  A lookup is a find-or-add call,
+ * a hit one that found the name already there and a probe a table slot
+ * compared along the way. */
+typedef enum statistics_counter_t {
+  STATS_SYMBOL_LOOKUPS,
+  STATS_SYMBOL_HITS,
+  STATS_SYMBOL_PROBES,
+  STATS_PREDICATE_LOOKUPS,
+  STATS_PREDICATE_HITS,
+  STATS_PREDICATE_PROBES,
+  STATS_RENEWS,
+  STATS_CANDIDATES,
+  STATS_UNIFICATIONS,
+  STATS_BACKTRACKS,
+  STATS_NUM_COUNTERS
+} statistics_counter_t;
+
+/* Workers share the counters, so they are only added to atomically. */
+typedef struct statistics_t {
+  double phase_start[STATS_NUM_PHASES];
+  double phase_seconds[STATS_NUM_PHASES];
+  unsigned long counters[STATS_NUM_COUNTERS];
+} statistics_t;
+
+extern statistics_t statistics;
+extern statistics_format_t statistics_output;
+extern memory_usage_t memory_usage;
+extern int memory_output;
+
 /*****************************************
  * AST Parsing
  *****************************************/
@@ -119,83 +672,566 @@ typedef struct find_tag_state_t {
   int child;
 } find_tag_state_t;
 
-int parse_file(mpc_result_t *, const char *);
+/* The mpc parsers for the language.  Building them is not free, so a
+ * process builds them once and reuses them for every file it parses. */
+typedef struct grammar_t {
+  mpc_parser_t *constant;
+  mpc_parser_t *variable;
+  mpc_parser_t *ident;
+  mpc_parser_t *params;
+  mpc_parser_t *predicate;
+  mpc_parser_t *union_;
+  mpc_parser_t *fact;
+  mpc_parser_t *rule;
+  mpc_parser_t *query;
+  mpc_parser_t *limit;
+  mpc_parser_t *lang;
+} grammar_t;
+
+/*****************************************
+ * Loader
+ *****************************************/
+typedef enum loader_token_t {
+  TOKEN_NONE,
+  TOKEN_CONSTANT,
+  TOKEN_VARIABLE
+} loader_token_t;
+
+typedef struct loader_ident_t {
+  const char *name;
+  int length;
+  enum loader_token_t type;
+} loader_ident_t;
+
+/* Reads clauses straight out of a text buffer.  Facts are interned into
+ * the tables as they are read; queries are copied aside and run once the
+ * whole input has been loaded.  idents holds the functor and arguments of
+ * the predicate just read, pointing into the buffer.
+ *
+ * A deferred loader (one chunk of a parallel load) only interns names:
+ * each fact is appended to clause_data as its predicate id followed by
+ * its argument symbol ids, and syntax errors are left to the caller.  The
+ * text of each rule is copied to rules, with the length clause_data had
+ * when it was read in rule_offsets, for the merge to compile in place. */
+typedef struct loader_t {
+  const char *filename;
+  const char *cursor;
+  const char *end;
+  int line;
+  struct symbol_table_t *symbol_table;
+  struct predicate_table_t *predicate_table;
+  int num_idents;
+  int idents_allocated;
+  struct loader_ident_t *idents;
+  struct symbol_table_node_t **symbols;
+  int num_queries;
+  int queries_allocated;
+  char **queries;
+  int num_threads;
+  int deferred;
+  size_t num_clause_data;
+  size_t clause_data_allocated;
+  int *clause_data;
+  int num_rules;
+  int rules_allocated;
+  char **rules;
+  size_t *rule_offsets;
+} loader_t;
+
+/* One slice of a parallel load, with the tables its thread interns into. */
+typedef struct loader_chunk_t {
+  struct loader_t loader;
+  struct symbol_table_t symbol_table;
+  struct predicate_table_t predicate_table;
+  const char *text;
+  size_t length;
+  int return_value;
+} loader_chunk_t;
+
+/* The queries of one batch, shared by a pool of worker threads.  Each
+ * query is taken by one worker, which prints its answers into outputs[i]
+ * and then sets done[i] under lock so they can be emitted in order. */
+typedef struct loader_query_pool_t {
+  int num_queries;
+  int next;
+  struct solve_t *solves;
+  struct solve_variable_table_t *variables;
+  char **outputs;
+  size_t *lengths;
+  int *done;
+  pthread_mutex_t lock;
+  pthread_cond_t finished;
+} loader_query_pool_t;
+
+/*****************************************
+ * Snapshot
+ *****************************************/
+
+/* A binary image of the symbol and predicate tables.  Everything in it is
+ * addressed by offset or id, never by pointer, and every section starts on
+ * an 8-byte boundary, so the file can be mapped and read in place.  The
+ * layout is: header, symbol records, symbol buckets, string pool, then for
+ * each predicate its record, its argument columns and its indexes. */
+typedef struct snapshot_header_t {
+  char magic[8];
+  int version;
+  unsigned int byte_order;
+  int word_size;
+  int num_symbols;
+  int num_symbol_buckets;
+  int num_predicates;
+  long pool_size;
+} snapshot_header_t;
+
+typedef struct snapshot_symbol_t {
+  long name;
+  int length;
+  unsigned int hash;
+} snapshot_symbol_t;
+
+typedef struct snapshot_predicate_t {
+  long name;
+  int length;
+  int arity;
+  int num_clauses;
+  int num_indexes;
+} snapshot_predicate_t;
+
+/* Followed by num_positions positions, num_buckets buckets and the
+ * num_clauses clause ordinals the buckets point into. */
+typedef struct snapshot_index_t {
+  int num_positions;
+  int num_keys;
+  int num_buckets;
+  int num_clauses;
+} snapshot_index_t;
+
+typedef struct snapshot_bucket_t {
+  unsigned int hash;
+  int num_clauses;
+  long clauses;
+} snapshot_bucket_t;
+
+/* A mapped image.  Symbol names and index clause lists point into it, so
+ * it must outlive the tables it was loaded into. */
+typedef struct snapshot_t {
+  const char *data;
+  size_t size;
+  size_t offset;
+} snapshot_t;
+
+/*****************************************
+ * Session
+ *****************************************/
+
+/* An interactive session over resident tables.  Input is read line by
+ * line into buffer until it holds a complete statement, which is then
+ * run as a query or a command. */
+typedef struct session_t {
+  struct symbol_table_t *symbol_table;
+  struct predicate_table_t *predicate_table;
+  struct loader_t *loader;
+  struct grammar_t *grammar;
+  struct snapshot_t *snapshot;
+  int interactive;
+  size_t num_buffer;
+  size_t buffer_allocated;
+  char *buffer;
+} session_t;
+
+/*****************************************
+ * Library
+ *****************************************/
+
+/* A database for a program that links the interpreter in: the tables
+ * facts and rules are loaded into and the loader that reads them. */
+typedef struct prolog_t {
+  struct symbol_table_t symbol_table;
+  struct predicate_table_t predicate_table;
+  struct loader_t loader;
+} prolog_t;
+
+/* A query parsed and resolved once, to be run any number of times.
+ * parameters holds the symbol bound to each variable slot before a run,
+ * NULL for the variables the run is to solve for. */
+typedef struct prolog_query_t {
+  struct prolog_t *prolog;
+  struct solve_t solve;
+  struct solve_variable_table_t variables;
+  struct solve_cursor_t cursor;
+  struct symbol_table_node_t **parameters;
+  int open;
+} prolog_query_t;
+
+void initialize_grammar(grammar_t *);
+void destroy_grammar(grammar_t *);
+void print_grammar(grammar_t *);
+int parse_file(grammar_t *, mpc_result_t *, const char *);
 void print_tags(const mpc_ast_t *, const int);
 const mpc_ast_t *find_tag(const mpc_ast_t *, const char *);
 void initialize_tag_state(find_tag_state_t *, const mpc_ast_t *);
 int has_tag(const mpc_ast_t *, const char *);
 const mpc_ast_t *find_tag_next(find_tag_state_t *, const char *);
 
+/*****************************************
+ * Arena Functions
+ *****************************************/
+void initialize_arena(arena_t *, size_t);
+void *arena_alloc(arena_t *, memory_category_t, size_t);
+void *arena_realloc(arena_t *, memory_category_t, void *, size_t, size_t);
+char *arena_strndup(arena_t *, memory_category_t, const char *, int);
+void destroy_arena(arena_t *);
+
+/*****************************************
+ * Bitmap Functions
+ *****************************************/
+void initialize_bitmap(bitmap_t *);
+void bitmap_append(bitmap_t *, arena_t *, int);
+bitmap_container_t *bitmap_find_container(const bitmap_t *, int);
+int bitmap_container_contains(const bitmap_container_t *, int);
+int bitmap_intersect(bitmap_t **, int, int *);
+
+/*****************************************
+ * Loader Functions
+ *****************************************/
+void initialize_loader(loader_t *, symbol_table_t *, predicate_table_t *);
+void destroy_loader(loader_t *);
+int load_file(loader_t *, const char *);
+int load_stream(loader_t *, FILE *);
+int load_buffer(loader_t *, const char *, size_t);
+int load_parallel(loader_t *, const char *, size_t);
+void *loader_chunk_run(void *);
+void loader_merge_chunk(loader_t *, loader_chunk_t *);
+void loader_defer_fact(loader_t *, predicate_table_node_t *);
+int loader_defer_rule(loader_t *, const char *);
+void loader_defer_goal(loader_t *);
+void loader_skip_space(loader_t *);
+loader_token_t loader_ident(loader_t *);
+int loader_predicate(loader_t *);
+int loader_fact(loader_t *);
+int loader_rule(loader_t *);
+void loader_rule_goal(loader_t *, machine_clause_t *, solve_variable_table_t *);
+int loader_query(loader_t *);
+int loader_limit(loader_t *, int *);
+int loader_error(loader_t *, const char *);
+solve_goal_t *loader_goal(loader_t *, solve_variable_table_t *);
+void loader_execute_queries(loader_t *);
+void loader_execute_parallel(loader_t *);
+void *loader_query_worker(void *);
+void loader_build_query(loader_t *,
+			const char *,
+			solve_t *,
+			solve_variable_table_t *);
+void loader_clear_queries(loader_t *);
+
+/*****************************************
+ * Session Functions
+ *****************************************/
+void initialize_session(session_t *,
+			symbol_table_t *,
+			predicate_table_t *,
+			loader_t *,
+			grammar_t *,
+			snapshot_t *);
+void destroy_session(session_t *);
+void session_run(session_t *, FILE *);
+int session_statement(session_t *, const char *);
+int session_consult(session_t *, const char *);
+int session_command(const char *, const char *);
+
+/*****************************************
+ * Snapshot Functions
+ *****************************************/
+void initialize_snapshot(snapshot_t *);
+void destroy_snapshot(snapshot_t *);
+int snapshot_is_image(const char *);
+int snapshot_save(const char *, symbol_table_t *, predicate_table_t *);
+int snapshot_write(FILE *, const void *, size_t);
+int snapshot_load(snapshot_t *,
+		  const char *,
+		  symbol_table_t *,
+		  predicate_table_t *);
+int snapshot_load_error(const char *);
+const void *snapshot_read(snapshot_t *, size_t);
+int snapshot_load_predicate(snapshot_t *,
+			    const char *,
+			    long,
+			    symbol_table_t *,
+			    predicate_table_t *);
+
+/*****************************************
+ * Answer Table Functions
+ *****************************************/
+void initialize_answer_table(answer_table_t *);
+void destroy_answer_table(answer_table_t *);
+void answer_table_clear(answer_table_t *);
+answer_entry_t *answer_table_find(answer_table_t *,
+				  const int *,
+				  int,
+				  unsigned long);
+void answer_table_add(answer_table_t *, answer_entry_t *);
+void answer_table_rehash(answer_table_t *);
+unsigned long answer_table_hash(const int *, int);
+void print_answer_statistics(predicate_table_t *);
+
+/*****************************************
+ * Machine Functions
+ *****************************************/
+void initialize_machine_clause(machine_clause_t *);
+void destroy_machine_clause(machine_clause_t *);
+machine_goal_t *machine_clause_add_goal(machine_clause_t *,
+					predicate_table_node_t *);
+void machine_clause_compile(machine_clause_t *, int);
+void machine_clause_emit(machine_clause_t *, int, int, int);
+void initialize_machine_switch(machine_switch_t *);
+void destroy_machine_switch(machine_switch_t *);
+machine_switch_bucket_t *machine_switch_probe(machine_switch_t *, int);
+void machine_switch_add(machine_switch_t *, int, int);
+void machine_switch_rehash(machine_switch_t *);
+void machine_switch_bucket_add(machine_switch_bucket_t *, int);
+void initialize_machine(machine_t *, symbol_table_t *);
+void destroy_machine(machine_t *);
+int machine_run(machine_t *);
+int machine_call(machine_t *, predicate_table_node_t *);
+int machine_resume(machine_t *, machine_alternatives_t *, int);
+int machine_retry(machine_t *);
+int machine_alternatives_next(machine_alternatives_t *, machine_t *, int *);
+int machine_alternatives_more(machine_alternatives_t *);
+void machine_select_facts(machine_t *,
+			  machine_alternatives_t *,
+			  predicate_table_node_t *);
+void machine_push_choicepoint(machine_t *, machine_alternatives_t *);
+void machine_enter(machine_t *, const machine_clause_t *);
+void machine_allocate(machine_t *, int);
+int machine_new_variable(machine_t *);
+int machine_deref(machine_t *, int);
+int machine_unify(machine_t *, int, int);
+int machine_unify_atom(machine_t *, int, atom_t);
+int machine_unify_fact_1(machine_t *, const predicate_table_node_t *, int);
+int machine_unify_fact_2(machine_t *, const predicate_table_node_t *, int);
+int machine_unify_fact_3(machine_t *, const predicate_table_node_t *, int);
+int machine_unify_fact_n(machine_t *, const predicate_table_node_t *, int);
+void machine_bind(machine_t *, int, int);
+void machine_undo(machine_t *, int);
+void machine_frame_top(machine_t *, int *, int *);
+int machine_backtrack(machine_t *);
+void machine_reserve(int **, int *, int);
+void print_machine_clause(symbol_table_t *, const machine_clause_t *);
+
+/*****************************************
+ * Materialize Functions
+ *****************************************/
+int predicate_table_materialize(predicate_table_t *, symbol_table_t *);
+int materialize_check(predicate_table_t *, char *);
+void materialize_reserve(materialize_t *);
+void materialize_rule(materialize_t *, machine_clause_t *, int);
+void materialize_join(materialize_t *, machine_clause_t *, int, int);
+void materialize_queue(materialize_t *, machine_clause_t *);
+void materialize_flush(materialize_t *);
+
 /*****************************************
  * Symbol Table Functions
  *****************************************/
+unsigned long hash_string(const char *, int);
 void initialize_symbol_table(symbol_table_t *);
 void symbol_table_enlarge(symbol_table_t *);
+void symbol_table_rehash(symbol_table_t *);
 void symbol_table_add(symbol_table_t *, symbol_table_node_t *);
 void destroy_symbol_table(symbol_table_t *);
+symbol_table_node_t *symbol_table_get(symbol_table_t *, int);
 symbol_table_node_t *symbol_table_find(symbol_table_t *, const char *);
+symbol_table_node_t *symbol_table_find_n(symbol_table_t *, const char *, int);
+symbol_table_node_t *symbol_table_find_hashed(symbol_table_t *,
+					     const char *,
+					     int,
+					     unsigned long);
 symbol_table_node_t *symbol_table_find_or_add(symbol_table_t *,
 					      const char *);
+symbol_table_node_t *symbol_table_find_or_add_n(symbol_table_t *,
+						const char *,
+						int);
+symbol_table_node_t *symbol_table_find_or_add_hashed(symbol_table_t *,
+						     const char *,
+						     int,
+						     unsigned long);
 void initialize_symbol_table_node(symbol_table_node_t *, const char *);
+void initialize_symbol_table_node_hashed(symbol_table_node_t *,
+					  const char *,
+					  int,
+					  unsigned long);
 void symbol_table_node_add(symbol_table_node_t *,
+			   arena_t *,
 			   int,
 			   predicate_table_node_t *,
-			   predicate_table_to_symbol_t *);
-void symbol_table_node_enlarge(symbol_table_node_t *);
+			   int);
+void symbol_table_node_enlarge(symbol_table_node_t *, arena_t *);
+symbol_table_posting_t *symbol_table_node_find_posting(symbol_table_node_t *,
+						       predicate_table_node_t *,
+						       int);
 void destroy_symbol_table_node(symbol_table_node_t *);
 void initialize_symbol_table_to_predicate(symbol_table_to_predicate_t *,
 					  int,
 					  predicate_table_node_t *,
-					  predicate_table_to_symbol_t *);
+					  int);
 void destroy_symbol_table_to_predicate(symbol_table_to_predicate_t *);
 
 /*****************************************
  * Predicate Table Functions
  *****************************************/
+unsigned long hash_functor(const char *, int, int);
 void initialize_predicate_table(predicate_table_t *);
 predicate_table_node_t *predicate_table_add(predicate_table_t *,
 					    predicate_table_node_t *node);
 void predicate_table_enlarge(predicate_table_t *);
+void predicate_table_rehash(predicate_table_t *);
 void destroy_predicate_table(predicate_table_t *);
-predicate_table_node_t *predicate_table_find(predicate_table_t *, const char *);
+predicate_table_node_t *predicate_table_find(predicate_table_t *,
+					     const char *,
+					     int);
+predicate_table_node_t *predicate_table_find_n(predicate_table_t *,
+					       const char *,
+					       int,
+					       int);
 predicate_table_node_t *predicate_table_find_or_add(predicate_table_t *,
-						    const char *);
-void initialize_predicate_table_node(predicate_table_node_t *, const char *);
-void initialize_predicate_table_to_symbol(predicate_table_to_symbol_t *, int );
-predicate_table_to_symbol_t *predicate_table_node_add(predicate_table_node_t *,
+						    const char *,
+						    int);
+predicate_table_node_t *predicate_table_find_or_add_n(predicate_table_t *,
+						      const char *,
 						      int,
-						      symbol_table_node_t **);
+						      int);
+void initialize_predicate_table_node(predicate_table_node_t *,
+				     arena_t *,
+				     const char *,
+				     int);
+void predicate_table_node_select_unify(predicate_table_node_t *);
+int predicate_table_node_add(predicate_table_node_t *,
+			     int,
+			     symbol_table_node_t **);
+int predicate_table_node_append(predicate_table_node_t *,
+				int,
+				symbol_table_node_t **);
 void predicate_table_node_enlarge(predicate_table_node_t *);
+void predicate_table_node_add_rule(predicate_table_node_t *,
+				   machine_clause_t *);
 void destroy_predicate_table_node(predicate_table_node_t *);
-void destroy_predicate_table_to_symbol(predicate_table_to_symbol_t *);
+predicate_index_t *predicate_table_node_add_index(predicate_table_node_t *,
+						  int,
+						  const int *);
+predicate_index_t *predicate_table_node_find_index(predicate_table_node_t *,
+						   int,
+						   const int *);
+predicate_index_t *predicate_table_node_select_index(predicate_table_node_t *,
+						     symbol_table_node_t **);
+predicate_index_t *predicate_table_node_tuple_index(predicate_table_node_t *);
+int predicate_table_node_contains(predicate_table_node_t *,
+				  symbol_table_node_t **);
+void initialize_predicate_index(predicate_index_t *,
+				arena_t *,
+				int,
+				const int *);
+void destroy_predicate_index(predicate_index_t *);
+unsigned long predicate_index_hash(predicate_index_t *,
+				   symbol_table_node_t **,
+				   const predicate_table_node_t *,
+				   int);
+predicate_index_bucket_t *predicate_index_probe(predicate_index_t *,
+						predicate_table_node_t *,
+						symbol_table_node_t **,
+						int,
+						unsigned long);
+void predicate_index_add(predicate_index_t *,
+			 predicate_table_node_t *,
+			 int);
+void predicate_index_rehash(predicate_index_t *);
+const int *predicate_index_lookup(predicate_index_t *,
+				  predicate_table_node_t *,
+				  symbol_table_node_t **,
+				  int *);
+int predicate_table_add_index_spec(predicate_table_t *, const char *);
+int predicate_table_node_scan(predicate_table_node_t *,
+			      symbol_table_node_t **,
+			      int *);
+int column_filter(const atom_t **, const atom_t *, int, int, int *);
 
 /*****************************************
  * Rule Functions
  *****************************************/
 void define_facts(const mpc_ast_t *, symbol_table_t *, predicate_table_t *);
+void define_rules(const mpc_ast_t *, symbol_table_t *, predicate_table_t *);
+void define_rule_goal(const mpc_ast_t *,
+		      machine_clause_t *,
+		      symbol_table_t *,
+		      predicate_table_t *,
+		      solve_variable_table_t *);
 void execute_queries(const mpc_ast_t *, symbol_table_t *, predicate_table_t *);
 void execute_query(const mpc_ast_t *, symbol_table_t *, predicate_table_t *);
 solve_goal_t *execute_query_build_goal(const mpc_ast_t *,
 				       symbol_table_t *,
 				       predicate_table_t *,
 				       solve_variable_table_t *);
+void execute_solve(solve_t *);
+int solve_has_rules(solve_t *);
 void rule_add(symbol_table_t *,
 	      predicate_table_t *,
 	      const char *,
 	      const int,
 	      const char **);
-void print_symbols(symbol_table_t *);
-void print_predicates(predicate_table_t *);
+int rule_add_symbols(symbol_table_t *,
+		      predicate_table_node_t *,
+		      symbol_table_node_t **);
+void print_symbols(symbol_table_t *, predicate_table_t *);
+void print_predicates(symbol_table_t *, predicate_table_t *);
 void print_rules(symbol_table_t *, predicate_table_t *);
+void print_solve(solve_t *);
+void print_solve_solution(solve_t *);
+void print_solve_plan(solve_t *, const double *);
 
 /*****************************************
  * Solve Functions
  *****************************************/
-void initialize_solve(solve_t *);
+void initialize_solve(solve_t *, solve_variable_table_t *);
 void solve_add(solve_t *, solve_goal_t *);
 void solve_enlarge(solve_t *);
+void destroy_solve(solve_t *);
+void solve_bind(solve_t *, solve_condition_t *, symbol_table_node_t *);
+void solve_undo(solve_t *, int);
+void solve_push_choicepoint(solve_t *, int);
+int solve_backtrack(solve_t *);
+int solve_next(solve_t *);
+int solve_run(solve_t *);
+int solve_limit(solve_t *);
+void solve_cursor_open(solve_cursor_t *, solve_t *);
+int solve_cursor_next(solve_cursor_t *);
+void solve_cursor_close(solve_cursor_t *);
+void execute_solve_parallel(solve_t *);
+void initialize_solve_worker(solve_worker_t *, solve_parallel_t *, int);
+void destroy_solve_worker(solve_worker_t *);
+void *solve_worker_run(void *);
+void solve_worker_task(solve_worker_t *, solve_task_t *);
+void solve_worker_split(solve_worker_t *, solve_goal_state_t *);
+int solve_worker_solution(solve_worker_t *);
+int solve_worker_stopped(solve_worker_t *);
+void solve_parallel_push(solve_parallel_t *, int, solve_task_t *);
+solve_task_t *solve_parallel_take(solve_parallel_t *, int);
+solve_task_t *solve_deque_pop(solve_deque_t *, int);
+void destroy_solve_task(solve_task_t *);
+void solve_plan(solve_t *);
+double solve_goal_estimate(solve_goal_t *, const char *);
 void initialize_solve_goal_state(solve_goal_state_t *, solve_goal_t *);
+void solve_goal_state_begin(solve_t *, solve_goal_state_t *);
+void solve_goal_state_intersect(solve_goal_state_t *);
+int solve_goal_state_key(solve_goal_state_t *);
+int solve_goal_state_lookup(solve_goal_state_t *);
+void solve_goal_state_store(solve_goal_state_t *);
+int solve_goal_state_next(solve_t *, solve_goal_state_t *);
+int solve_unify_atom(solve_t *, solve_condition_t *, atom_t);
+int solve_unify_fact_1(solve_t *, solve_goal_t *, int);
+int solve_unify_fact_2(solve_t *, solve_goal_t *, int);
+int solve_unify_fact_3(solve_t *, solve_goal_t *, int);
+int solve_unify_fact_n(solve_t *, solve_goal_t *, int);
+void destroy_solve_goal_state(solve_goal_state_t *);
 void initialize_solve_goal(solve_goal_t *, predicate_table_node_t *);
+void destroy_solve_goal(solve_goal_t *);
 void solve_goal_add(solve_goal_t *, solve_subgoal_t *);
 void solve_goal_enlarge(solve_goal_t *);
 void initialize_solve_subgoal(solve_subgoal_t *, int, solve_condition_t *);
@@ -206,13 +1242,54 @@ void initialize_solve_condition_variable(solve_condition_t *,
 void initialize_solve_variable_table(solve_variable_table_t *);
 void solve_variable_table_add(solve_variable_table_t *, solve_condition_t *);
 void solve_variable_table_enlarge(solve_variable_table_t *);
+void destroy_solve_variable_table(solve_variable_table_t *);
 solve_condition_t *solve_variable_table_find(solve_variable_table_t *,
 					     const char *);
 solve_condition_t *solve_variable_table_find_or_add(solve_variable_table_t *,
 						    const char *);
+solve_condition_t *solve_variable_table_find_n(solve_variable_table_t *,
+					       const char *,
+					       int);
+solve_condition_t *solve_variable_table_find_or_add_n(solve_variable_table_t *,
+						      const char *,
+						      int);
+/*****************************************
+ * Statistics Functions
+ *****************************************/
+void statistics_begin(statistics_phase_t);
+void statistics_end(statistics_phase_t);
+void print_statistics(FILE *);
+
+/*****************************************
+ * Memory Functions
+ *****************************************/
+void *memory_alloc(memory_category_t, size_t);
+void *memory_realloc(memory_category_t, void *, size_t);
+void memory_free(void *);
+void memory_charge(memory_category_t, size_t);
+void memory_uncharge(memory_category_t, size_t);
+void memory_raise(size_t *, size_t);
+void memory_arena(arena_t *, size_t *, size_t *, size_t *);
+void memory_slack(symbol_table_t *, predicate_table_t *, size_t *);
+size_t memory_slack_bitmap(bitmap_t *);
+void print_memory(FILE *, symbol_table_t *, predicate_table_t *);
+
 /*****************************************
- * Main Function
+ * Library Functions
  *****************************************/
-int main(int, char **);
+void initialize_prolog(prolog_t *);
+void destroy_prolog(prolog_t *);
+int prolog_consult(prolog_t *, const char *);
+int prolog_load(prolog_t *, const char *, size_t);
+symbol_table_node_t *prolog_atom(prolog_t *, const char *);
+int prolog_prepare(prolog_t *, prolog_query_t *, const char *);
+void destroy_prolog_query(prolog_query_t *);
+int prolog_query_variable(prolog_query_t *, const char *);
+void prolog_query_bind(prolog_query_t *, int, symbol_table_node_t *);
+void prolog_query_unbind(prolog_query_t *, int);
+void prolog_query_execute(prolog_query_t *);
+int prolog_query_next(prolog_query_t *);
+const char *prolog_query_value(prolog_query_t *, int);
+void prolog_query_close(prolog_query_t *);
 
 #endif